@@ -18,11 +18,16 @@ LOCAL_SRC_FILES := simulator.cc sim_card.cc \
 					sms.cc \
 					gsm.cc \
 					config.cc \
-					path.cc
+					path.cc \
+					snapshot.cc \
+					signal_engine.cc \
+					net_iface.cc \
+					nvram.cc
 
 LOCAL_CFLAGS := -lpthread -ldl -O2 -DGOOGLE_PROTOBUF_NO_RTTI
 
 LOCAL_STATIC_LIBRARIES := liblog libcutils libcppsensors_packet_static libstlport_static libprotobuf-cpp-2.3.0-full
+LOCAL_SHARED_LIBRARIES := libdl
 LOCAL_MODULE := gsmd
 LOCAL_MODULE_TAGS := optional
 
@@ -9,13 +9,14 @@
 ** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
 ** GNU General Public License for more details.
 */
-#include "config.h"
+#include "nvram.h"
 
 #include "android_modem.h"
 #include "sim_card.h"
 #include "sysdeps.h"
 #include <memory.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <time.h>
 #include <assert.h>
 #include <stdint.h>
@@ -23,17 +24,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <dlfcn.h>
+#include <errno.h>
 
 #include <sys/types.h>
-#include <sys/socket.h>
-#include <sys/ioctl.h>
-#include <netinet/in.h>
-#include <net/if.h>
-#include <arpa/inet.h>
 
 
 #include "sms.h"
 #include "remote_call.h"
+#include "signal_engine.h"
+#include "net_iface.h"
 
 #include "log.h"
 
@@ -73,6 +73,7 @@
 static const char* _amodem_switch_technology(AModem modem, AModemTech newtech, int32_t newpreferred);
 static int _amodem_set_cdma_subscription_source( AModem modem, ACdmaSubscriptionSource ss);
 static int _amodem_set_cdma_prl_version( AModem modem, int prlVersion);
+static int amodem_init_commands( void );
 
 #if DEBUG
 static const char*  quote( const char*  line )
@@ -164,6 +165,16 @@ typedef enum {
     A_REGISTRATION_UNSOL_ENABLED_FULL = 2
 } ARegistrationUnsolMode;
 
+/* unsolicited messages that only report the latest state, and can be
+ * coalesced, see amodem_unsol_post() */
+typedef enum {
+    A_UNSOL_CREG = 0,
+    A_UNSOL_CGREG,
+    A_UNSOL_CTEC,
+    A_UNSOL_CSQ,
+    A_UNSOL_MAX     /* don't remove */
+} AUnsolType;
+
 /* Operator selection mode, see +COPS commands */
 typedef enum {
     A_SELECTION_AUTOMATIC,
@@ -191,6 +202,11 @@ typedef struct AVoiceCallRec {
     SysTimer    timer;
     AModem      modem;
     char        is_remote;
+
+    /* call table indexing, see amodem_alloc_call() */
+    unsigned               seq;        /* creation order */
+    struct AVoiceCallRec*  hash_next;  /* next call in the same number bucket */
+    char                   key[ A_CALL_NUMBER_MAX_SIZE+1 ];  /* normalized number */
 } AVoiceCallRec, *AVoiceCall;
 
 #define  MAX_OPERATORS  4
@@ -212,28 +228,13 @@ typedef struct {
 
 /* the spec says that there can only be a max of 4 contexts */
 #define  MAX_DATA_CONTEXTS  4
-#define  MAX_CALLS          4
+#define  MAX_CALLS          4   /* default capacity of the call table */
+#define  MAX_CALLS_LIMIT    1024 /* largest capacity accepted */
 #define  MAX_EMERGENCY_NUMBERS 16
 
 
 #define  A_MODEM_SELF_SIZE   3
 
-typedef struct _signal {
-  int gsm_rssi;
-  int gsm_ber;
-  int cdma_dbm;
-  int cdma_ecio;
-  int evdo_dbm;
-  int evdo_ecio;
-  int evdo_snr;
-  int lte_rssi;
-  int lte_rsrp;
-  int lte_rsrq;
-  int lte_rssnr;
-  int lte_cqi;
-  int lte_timing;
-} signal_t;
-
 typedef enum {
   NONE = 0,
   POOR = 1,
@@ -242,7 +243,7 @@ typedef enum {
   GREAT = 4,
 } signal_strength;
 
-static const signal_t NET_PROFILES[5] = {
+static const ASignalValuesRec NET_PROFILES[5] = {
   /* NONE */
   {0, 7, 105, 160, 110, 160, 0, 105, 140, 3, 200, 0, 500},
   /* POOR (one bar) */
@@ -257,6 +258,14 @@ static const signal_t NET_PROFILES[5] = {
 
 
 
+/* a growable output buffer, see amodem_out_xxx() below */
+typedef struct {
+    char*    data;
+    int      size;
+    int      max;
+    char     data0[256];
+} AModemOutRec, *AModemOut;
+
 typedef struct AModemRec_
 {
     /* Legacy support */
@@ -268,7 +277,24 @@ typedef struct AModemRec_
     int           cell_id;
     int           base_port;
 
-    signal_strength signal;
+    /* signal values, see amodem_signal_changed() */
+    ASignal       signal;
+    AModemOutRec  csq[1];      /* cached +CSQ line */
+    int           csq_valid;
+
+    /* interface carrying the data connection, its address is cached */
+    ANetIface     iface;
+
+    /* running PDP context hook, see amodem_run_hook() */
+    SysProcess    hook;
+    int           hook_started;   /* by the command being executed */
+
+    /* receiver of the final result of the command being executed, if it
+     * can be delayed, and of the one waiting for the hook to exit */
+    AModemAnswerFunc  answer_func;
+    void*             answer_opaque;
+    AModemAnswerFunc  hook_answer;
+    void*             hook_answer_opaque;
 
     /* SMS */
     int           wait_sms;
@@ -293,24 +319,45 @@ typedef struct AModemRec_
     /* data connection contexts */
     ADataContextRec     data_contexts[ MAX_DATA_CONTEXTS ];
 
-    /* active calls */
-    AVoiceCallRec       calls[ MAX_CALLS ];
+    /* active calls, in creation order. each record is allocated on its own
+     * so that it never moves while timers and remote calls point to it */
+    AVoiceCall*         calls;
     int                 call_count;
+    int                 max_calls;
+    unsigned            call_seq;
+    AVoiceCall*         calls_by_id;       /* [max_calls+1], ids start at 1 */
+    AVoiceCall*         calls_by_number;   /* hash buckets of normalized numbers */
+    unsigned            calls_hash_mask;
 
     /* unsolicited callback */  /* XXX: TODO: use this */
     AModemUnsolFunc     unsol_func;
     void*               unsol_opaque;
 
     SmsReceiver         sms_receiver;
-
-    int                 out_size;
-    char                out_buff[1024];
+    SysTimer            sms_timer;         /* expiry of partial messages */
+    int                 sms_timeout;
+    int                 sms_max_messages;
+    int                 sms_max_bytes;
+
+    /* answers to AT commands, and unsolicited messages */
+    AModemOutRec        out[1];
+    AModemOutRec        unsol[1];
+
+    /* coalescing window for state unsolicited messages, 0 to disable */
+    int                 coalesce_ms;
+    SysTimer            coalesce_timer;
+    AModemOutRec        coalesce[ A_UNSOL_MAX ];        /* latest line of each type */
+    unsigned char       coalesce_order[ A_UNSOL_MAX ];  /* pending types, oldest first */
+    int                 coalesce_count;
 
     /*
      * Hold non-volatile ram configuration for modem
      */
-    AConfig *nvram_config;
+    ANvram nvram;
     char *nvram_config_filename;
+    SysTimer nvram_timer;        /* pending write-behind, see amodem_nvram_changed() */
+    int nvram_save_pending;
+    int nvram_keep_file;         /* the file exists but can't be loaded, don't overwrite it */
 
     AModemTech technology;
     /*
@@ -328,19 +375,326 @@ typedef struct AModemRec_
     int prl_version;
 
     const char *emergency_numbers[MAX_EMERGENCY_NUMBERS];
+
+    /* read-only copies of the state for other threads, see amodem_publish_state() */
+    struct AModemStateNodeRec*  state;          /* current one */
+    struct AModemStateNodeRec*  state_retired;  /* replaced, may still be read */
+    struct AModemStateNodeRec*  state_free;     /* reclaimed, reused by the next publish */
+
+    /* bumped by every change to the saved state, see amodem_snapshot_is_dirty() */
+    unsigned    snapshot_gen;
+    unsigned    saved_gen;      /* values at the last snapshot saved or loaded */
+    unsigned    saved_sim_gen;
+    unsigned    saved_sms_gen;
+    int         saved_valid;
 } AModemRec;
 
 
+/** OUTPUT BUFFERS
+ **
+ ** answers and unsolicited messages are built into growable buffers that
+ ** start in an inline array and move to the heap only when a line does not
+ ** fit. the storage is kept between commands, so steady-state formatting
+ ** does not allocate. the returned strings point directly into the buffer.
+ **/
+static int
+amodem_out_ensure( AModemOut  out, int  count )
+{
+    int    new_max;
+    char*  new_data;
+
+    /* always keep room for the terminating zero */
+    if (out->size + count < out->max)
+        return 0;
+
+    new_max = out->max;
+    while (new_max <= out->size + count)
+        new_max += (new_max >> 1) + 16;
+
+    if (out->data == out->data0) {
+        new_data = (char*) malloc( new_max );
+        if (new_data != NULL)
+            memcpy( new_data, out->data0, out->size );
+    } else {
+        new_data = (char*) realloc( out->data, new_max );
+    }
+    if (new_data == NULL)
+        return -1;
+
+    out->data = new_data;
+    out->max  = new_max;
+    return 0;
+}
+
+static void
+amodem_out_init( AModemOut  out )
+{
+    out->data = out->data0;
+    out->max  = sizeof(out->data0);
+    out->size = 0;
+    out->data[0] = 0;
+}
+
+static void
+amodem_out_done( AModemOut  out )
+{
+    if (out->data != out->data0)
+        free( out->data );
+    amodem_out_init( out );
+}
+
+static __inline__ void
+amodem_out_reset( AModemOut  out )
+{
+    out->size = 0;
+}
+
+static __inline__ const char*
+amodem_out_end( AModemOut  out )
+{
+    out->data[ out->size ] = 0;
+    return out->data;
+}
+
+/* reserve 'count' bytes at the end of the buffer, returns NULL on failure */
+static char*
+amodem_out_reserve( AModemOut  out, int  count )
+{
+    char*  p;
+
+    if (amodem_out_ensure( out, count ) < 0)
+        return NULL;
+
+    p          = out->data + out->size;
+    out->size += count;
+    return p;
+}
+
+static void
+amodem_out_add( AModemOut  out, const char*  str, int  len )
+{
+    char*  p = amodem_out_reserve( out, len );
+    if (p != NULL)
+        memcpy( p, str, len );
+}
+
+static __inline__ void
+amodem_out_add_c( AModemOut  out, char  c )
+{
+    if (out->size + 1 < out->max || amodem_out_ensure( out, 1 ) == 0)
+        out->data[ out->size++ ] = c;
+}
+
+static __inline__ void
+amodem_out_add_str( AModemOut  out, const char*  str )
+{
+    amodem_out_add( out, str, strlen(str) );
+}
+
+/* append a decimal integer, equivalent to "%d" */
+static void
+amodem_out_add_int( AModemOut  out, int  value )
+{
+    char      temp[12];
+    char*     end = temp + sizeof(temp);
+    char*     p   = end;
+    unsigned  v   = (value < 0) ? 0U - (unsigned)value : (unsigned)value;
+
+    do {
+        *--p = (char)('0' + v % 10);
+        v   /= 10;
+    } while (v != 0);
+
+    if (value < 0)
+        *--p = '-';
+
+    amodem_out_add( out, p, end - p );
+}
+
+/* append a lowercase hex value with at least 'width' digits, equivalent to "%0*x" */
+static void
+amodem_out_add_hex( AModemOut  out, unsigned  value, int  width )
+{
+    static const char  hexdigits[] = "0123456789abcdef";
+    char   temp[8];
+    char*  end = temp + sizeof(temp);
+    char*  p   = end;
+
+    do {
+        *--p    = hexdigits[value & 15];
+        value >>= 4;
+    } while (value != 0);
+
+    while (p > temp && end - p < width)
+        *--p = '0';
+
+    amodem_out_add( out, p, end - p );
+}
+
+static void
+amodem_out_vprintf( AModemOut  out, const char*  format, va_list  args )
+{
+    for (;;) {
+        int      avail = out->max - out->size;
+        int      len;
+        va_list  args2;
+
+        va_copy( args2, args );
+        len = vsnprintf( out->data + out->size, avail, format, args2 );
+        va_end( args2 );
+
+        if (len < 0)
+            return;
+
+        if (len < avail) {
+            out->size += len;
+            return;
+        }
+        /* truncated, grow and try again */
+        if (amodem_out_ensure( out, len ) < 0)
+            return;
+    }
+}
+
+static void
+amodem_out_printf( AModemOut  out, const char*  format, ... )
+{
+    va_list  args;
+
+    va_start( args, format );
+    amodem_out_vprintf( out, format, args );
+    va_end( args );
+}
+
+/** UNSOLICITED MESSAGES
+ **
+ ** registration, technology and signal changes can be coalesced: within
+ ** the window, each type only keeps its latest line, and the pending ones
+ ** are flushed in a single write when it expires. any other unsolicited
+ ** message flushes them first, so that the RIL sees them in order.
+ **/
+
+/* send the pending coalesced lines, in the order of their last update */
+static void
+amodem_unsol_flush( AModem  modem )
+{
+    AModemOut  out = modem->unsol;
+    int        nn;
+
+    if (modem->coalesce_count == 0)
+        return;
+
+    sys_timer_unset( modem->coalesce_timer );
+
+    amodem_out_reset( out );
+    for (nn = 0; nn < modem->coalesce_count; nn++) {
+        AModemOut  line = &modem->coalesce[ modem->coalesce_order[nn] ];
+
+        amodem_out_add( out, line->data, line->size );
+        /* lines are sent back to back, make sure each one is terminated */
+        if (line->size > 0 && line->data[line->size-1] != '\r' &&
+                              line->data[line->size-1] != '\n')
+            amodem_out_add_c( out, '\r' );
+    }
+    modem->coalesce_count = 0;
+
+    if (modem->unsol_func)
+        modem->unsol_func( modem->unsol_opaque, amodem_out_end( out ) );
+}
+
+static void
+amodem_unsol_flush_timer( void*  _modem )
+{
+    amodem_unsol_flush( (AModem) _modem );
+}
+
+/* start a new unsolicited message, returns NULL if nobody listens to them */
+static AModemOut
+amodem_unsol_begin( AModem  modem )
+{
+    if (!modem->unsol_func)
+        return NULL;
+
+    amodem_unsol_flush( modem );
+    amodem_out_reset( modem->unsol );
+    return modem->unsol;
+}
+
+static void
+amodem_unsol_end( AModem  modem )
+{
+    modem->unsol_func( modem->unsol_opaque, amodem_out_end( modem->unsol ) );
+}
+
+/* same as amodem_unsol_begin() for a message that only reports the latest
+ * state of 'type', must be followed by amodem_unsol_post() */
+static AModemOut
+amodem_unsol_begin_type( AModem  modem, AUnsolType  type )
+{
+    if (modem->coalesce_ms <= 0)
+        return amodem_unsol_begin( modem );
+
+    if (!modem->unsol_func)
+        return NULL;
+
+    amodem_out_reset( &modem->coalesce[type] );
+    return &modem->coalesce[type];
+}
+
+/* send the message, or queue it until the end of the coalescing window,
+ * replacing the previous one of the same type */
+static void
+amodem_unsol_post( AModem  modem, AUnsolType  type )
+{
+    int  nn, pending = modem->coalesce_count;
+
+    if (modem->coalesce_ms <= 0) {
+        amodem_unsol_end( modem );
+        return;
+    }
+
+    amodem_out_end( &modem->coalesce[type] );
+
+    for (nn = 0; nn < modem->coalesce_count; nn++) {
+        if (modem->coalesce_order[nn] == type) {
+            memmove( modem->coalesce_order + nn, modem->coalesce_order + nn + 1,
+                     modem->coalesce_count - nn - 1 );
+            modem->coalesce_count -= 1;
+            break;
+        }
+    }
+    modem->coalesce_order[ modem->coalesce_count++ ] = (unsigned char) type;
+
+    /* the window starts with the first pending message, and is not
+     * extended by the next ones */
+    if (pending == 0)
+        sys_timer_set( modem->coalesce_timer, sys_time_ms() + modem->coalesce_ms,
+                       amodem_unsol_flush_timer, modem );
+}
+
+void
+amodem_set_unsol_coalescing( AModem  modem, int  window_ms )
+{
+    if (window_ms < 0)
+        window_ms = 0;
+
+    modem->coalesce_ms = window_ms;
+    if (window_ms == 0)
+        amodem_unsol_flush( modem );
+}
+
 static void
 amodem_unsol( AModem  modem, const char* format, ... )
 {
-    if (modem->unsol_func) {
+    AModemOut  out = amodem_unsol_begin( modem );
+
+    if (out != NULL) {
         va_list  args;
         va_start(args, format);
-        vsnprintf( modem->out_buff, sizeof(modem->out_buff), format, args );
+        amodem_out_vprintf( out, format, args );
         va_end(args);
 
-        modem->unsol_func( modem->unsol_opaque, modem->out_buff );
+        amodem_unsol_end( modem );
     }
 }
 
@@ -349,23 +703,26 @@ amodem_receive_sms( AModem  modem, SmsPDU  sms )
 {
 #define  SMS_UNSOL_HEADER  "+CMT: 0\r\n"
 
-    if (modem->unsol_func) {
-        int    len, max;
+    AModemOut  out = amodem_unsol_begin( modem );
+
+    if (out != NULL) {
+        int    len;
         char*  p;
 
-        strcpy( modem->out_buff, SMS_UNSOL_HEADER );
-        p   = modem->out_buff + (sizeof(SMS_UNSOL_HEADER)-1);
-        max = sizeof(modem->out_buff) - 3 - (sizeof(SMS_UNSOL_HEADER)-1);
-        len = smspdu_to_hex( sms, p, max );
-        if (len > max) /* too long */
+        amodem_out_add( out, SMS_UNSOL_HEADER, sizeof(SMS_UNSOL_HEADER)-1 );
+
+        len = smspdu_to_hex( sms, NULL, 0 );
+        p   = amodem_out_reserve( out, len + 2 );
+        if (p == NULL) /* too long */
             return;
+
+        smspdu_to_hex( sms, p, len );
         p[len]   = '\r';
         p[len+1] = '\n';
-        p[len+2] = 0;
 
-        R( "SMS>> %s\n", p );
+        R( "SMS>> %s\n", amodem_out_end( out ) + (sizeof(SMS_UNSOL_HEADER)-1) );
 
-        modem->unsol_func( modem->unsol_opaque, modem->out_buff );
+        amodem_unsol_end( modem );
     }
 }
 
@@ -373,17 +730,19 @@ static const char*
 amodem_printf( AModem  modem, const char*  format, ... )
 {
     va_list  args;
+
+    amodem_out_reset( modem->out );
     va_start(args, format);
-    vsnprintf( modem->out_buff, sizeof(modem->out_buff), format, args );
+    amodem_out_vprintf( modem->out, format, args );
     va_end(args);
 
-    return modem->out_buff;
+    return amodem_out_end( modem->out );
 }
 
 static void
 amodem_begin_line( AModem  modem )
 {
-    modem->out_size = 0;
+    amodem_out_reset( modem->out );
 }
 
 static void
@@ -391,17 +750,35 @@ amodem_add_line( AModem  modem, const char*  format, ... )
 {
     va_list  args;
     va_start(args, format);
-    modem->out_size += vsnprintf( modem->out_buff + modem->out_size,
-                                  sizeof(modem->out_buff) - modem->out_size,
-                                  format, args );
+    amodem_out_vprintf( modem->out, format, args );
     va_end(args);
 }
 
 static const char*
 amodem_end_line( AModem  modem )
 {
-    modem->out_buff[ modem->out_size ] = 0;
-    return modem->out_buff;
+    return amodem_out_end( modem->out );
+}
+
+/* the final result code appended to every successful answer */
+#define  AMODEM_OK_SUFFIX  "\rOK"
+
+/* append the final OK to the answer currently held in the output buffer,
+ * using the tracked size instead of rescanning it */
+static const char*
+amodem_end_ok( AModem  modem )
+{
+    amodem_out_add( modem->out, AMODEM_OK_SUFFIX, sizeof(AMODEM_OK_SUFFIX)-1 );
+    return amodem_out_end( modem->out );
+}
+
+/* copy a constant handler answer into the output buffer and append the final OK */
+static const char*
+amodem_copy_ok( AModem  modem, const char*  answer )
+{
+    amodem_out_reset( modem->out );
+    amodem_out_add_str( modem->out, answer );
+    return amodem_end_ok( modem );
 }
 
 #define NV_OPER_NAME_INDEX                     "oper_name_index"
@@ -416,59 +793,96 @@ amodem_end_line( AModem  modem )
 #define NV_EMERGENCY_NUMBER_FMT                    "emergency_number_%d"
 #define NV_PRL_VERSION                         "prl_version"
 #define NV_SREGISTER                           "sregister"
+#define NV_MAX_CALLS                           "max_calls"
+#define NV_SIGNAL_TRACE                        "signal_trace"
+#define NV_SIGNAL_TRACE_LOOP                   "signal_trace_loop"
+#define NV_SIGNAL_WALK                         "signal_walk_ms"
+#define NV_UNSOL_COALESCE                      "unsol_coalesce_ms"
+#define NV_NETWORK_INTERFACE                   "network_interface"
+#define NV_SMS_TIMEOUT                         "sms_reassembly_timeout_ms"
+#define NV_SMS_MAX_MESSAGES                    "sms_reassembly_max_messages"
+#define NV_SMS_MAX_BYTES                       "sms_reassembly_max_bytes"
 
 #define MAX_KEY_NAME 40
 
-static AConfig *
+#define NVRAM_SAVE_DELAY  500   /* ms */
+
+static ANvram
 amodem_load_nvram( AModem modem )
 {
-    AConfig* root = aconfig_node(NULL, NULL);
+    ANvram nvram = anvram_create();
+    if (nvram == NULL)
+        return NULL;
     D("Using config file: %s\n", modem->nvram_config_filename);
-    if (aconfig_load_file(root, modem->nvram_config_filename)) {
+    if (anvram_load_file(nvram, modem->nvram_config_filename) < 0) {
         D("Unable to load config\n");
-        aconfig_set(root, NV_MODEM_TECHNOLOGY, "gsm");
-        aconfig_save_file(root, modem->nvram_config_filename);
+        if (access(modem->nvram_config_filename, F_OK) == 0) {
+            D("%s is corrupted, it won't be overwritten\n", modem->nvram_config_filename);
+            modem->nvram_keep_file = 1;
+        }
+        anvram_set_str(nvram, NV_MODEM_TECHNOLOGY, "gsm");
     }
-    return root;
+    return nvram;
 }
 
-static int
-amodem_nvram_get_int( AModem modem, const char *nvname, int defval)
+/* write the NVRAM if it changed */
+static void
+amodem_nvram_flush( AModem modem )
 {
-    int value;
-    char strval[MAX_KEY_NAME + 1];
-    char *newvalue;
-
-    value = aconfig_int(modem->nvram_config, nvname, defval);
-    snprintf(strval, MAX_KEY_NAME, "%d", value);
-    D("Setting value of %s to %d (%s)",nvname, value, strval);
-    newvalue = strdup(strval);
-    if (!newvalue) {
-        newvalue = "";
-        aconfig_set(modem->nvram_config, nvname, newvalue);
-    } else {
-        aconfig_set(modem->nvram_config, nvname, newvalue);
-        free(newvalue);
+    if (modem->nvram_save_pending) {
+        sys_timer_unset(modem->nvram_timer);
+        modem->nvram_save_pending = 0;
     }
+    if (!modem->nvram_keep_file && anvram_is_dirty(modem->nvram) &&
+        anvram_save_file(modem->nvram, modem->nvram_config_filename) < 0)
+        D("could not save %s: %s", modem->nvram_config_filename, strerror(errno));
+}
 
-    return value;
+int
+amodem_set_nvram_image( AModem modem, int image )
+{
+    anvram_set_format(modem->nvram, image ? A_NVRAM_IMAGE : A_NVRAM_TEXT);
+    amodem_nvram_flush(modem);
+    return anvram_is_dirty(modem->nvram) ? -1 : 0;
 }
 
-const char *
-amodem_nvram_get_str( AModem modem, const char *nvname, const char *defval)
+static void
+amodem_nvram_save_timer( void* _modem )
 {
-    const char *value;
+    AModem modem = (AModem) _modem;
 
-    value = aconfig_str(modem->nvram_config, nvname, defval);
+    modem->nvram_save_pending = 0;
+    amodem_nvram_flush(modem);
+}
 
-    if (!value) {
-        if (!defval)
-            return NULL;
-        value = defval;
+/* changes are written behind, once per NVRAM_SAVE_DELAY, so that bursts
+ * of them cost a single write and none in the command path */
+static void
+amodem_nvram_changed( AModem modem )
+{
+    if (!modem->nvram_save_pending && !modem->nvram_keep_file &&
+        anvram_is_dirty(modem->nvram)) {
+        modem->nvram_save_pending = 1;
+        sys_timer_set(modem->nvram_timer, sys_time_ms() + NVRAM_SAVE_DELAY,
+                      amodem_nvram_save_timer, modem);
     }
+}
 
-    aconfig_set(modem->nvram_config, nvname, value);
+/* missing values are added with their default, so that the saved file
+ * lists every setting */
+static int
+amodem_nvram_get_int( AModem modem, const char *nvname, int defval)
+{
+    int value = anvram_default_int(modem->nvram, nvname, defval);
+    amodem_nvram_changed(modem);
+    return value;
+}
 
+const char *
+amodem_nvram_get_str( AModem modem, const char *nvname, const char *defval)
+{
+    const char *value = anvram_default_str(modem->nvram, nvname, defval);
+    amodem_nvram_changed(modem);
     return value;
 }
 
@@ -499,11 +913,10 @@ amodem_reset( AModem  modem )
 {
     const char *tmp;
     int i;
-    modem->nvram_config = amodem_load_nvram(modem);
     modem->radio_state = A_RADIO_STATE_OFF;
     modem->wait_sms    = 0;
 
-    modem->signal = GOOD;
+    asignal_set_values( modem->signal, &NET_PROFILES[GOOD] );
 
     modem->oper_name_index     = (ANameIndex) amodem_nvram_get_int(modem, NV_OPER_NAME_INDEX, 2);
     modem->oper_selection_mode = (AOperatorSelection) amodem_nvram_get_int(modem, NV_SELECTION_MODE, A_SELECTION_AUTOMATIC);
@@ -543,7 +956,7 @@ amodem_reset( AModem  modem )
     tmp = amodem_nvram_get_str( modem, NV_MODEM_TECHNOLOGY, "gsm" );
     modem->technology = android_parse_modem_tech( tmp );
     if (modem->technology == A_TECH_UNKNOWN) {
-        modem->technology = (AModemTech) aconfig_int( modem->nvram_config, NV_MODEM_TECHNOLOGY, A_TECH_GSM );
+        modem->technology = (AModemTech) anvram_get_int( modem->nvram, NV_MODEM_TECHNOLOGY, A_TECH_GSM );
     }
     // Support GSM, WCDMA, CDMA, EvDo
     modem->preferred_mask = amodem_nvram_get_int( modem, NV_PREFERRED_MODE, 0x1f );
@@ -554,26 +967,85 @@ amodem_reset( AModem  modem )
 
 static AVoiceCall amodem_alloc_call( AModem   modem );
 static void amodem_free_call( AModem  modem, AVoiceCall  call );
+static void amodem_calls_done( AModem  modem );
+static void amodem_publish_state( AModem  modem );
+static void amodem_state_done( AModem  modem );
+static void amodem_signal_changed( void*  _modem, int  levels_changed );
+static void amodem_signal_start( AModem  modem );
 
-static AModemRec   _android_modem[1];
+/* called after each change to the state written by amodem_snapshot_save() */
+static void
+amodem_snapshot_changed( AModem  modem )
+{
+    modem->snapshot_gen += 1;
+}
 
 AModem
 amodem_create( int  base_port, AModemUnsolFunc  unsol_func, void*  unsol_opaque )
 {
-    AModem  modem = _android_modem;
-    char nvfname[] = "modem_config";
+    return amodem_create_with_nvram( base_port, "modem_config", unsol_func, unsol_opaque );
+}
+
+AModem
+amodem_create_with_nvram( int  base_port, const char*  nvram_path,
+                          AModemUnsolFunc  unsol_func, void*  unsol_opaque )
+{
+    AModem  modem = (AModem) calloc( 1, sizeof(*modem) );
+    int     nn;
+
+    if (modem == NULL)
+        return NULL;
+
+    amodem_init_commands();
+    amodem_out_init( modem->out );
+    amodem_out_init( modem->unsol );
+    amodem_out_init( modem->csq );
+    for (nn = 0; nn < A_UNSOL_MAX; nn++)
+        amodem_out_init( &modem->coalesce[nn] );
 
     modem->base_port    = base_port;
-    modem->nvram_config_filename = strdup( nvfname );
+    modem->nvram_config_filename = strdup( nvram_path );
+    if (modem->nvram_config_filename != NULL)
+        modem->nvram = amodem_load_nvram( modem );
+
+    modem->signal = asignal_create( amodem_signal_changed, modem );
+    if (modem->nvram == NULL || modem->signal == NULL) {
+        if (modem->signal != NULL)
+            asignal_destroy( modem->signal );
+        if (modem->nvram != NULL)
+            anvram_destroy( modem->nvram );
+        free( modem->nvram_config_filename );
+        free( modem );
+        return NULL;
+    }
+    modem->coalesce_timer = sys_timer_create();
+    modem->nvram_timer    = sys_timer_create();
+    modem->sms_timer      = sys_timer_create();
 
     amodem_reset( modem );
+    if (amodem_set_max_calls( modem, amodem_nvram_get_int( modem, NV_MAX_CALLS, MAX_CALLS ) ) < 0)
+        amodem_set_max_calls( modem, MAX_CALLS );
+
     modem->supportsNetworkDataType = 1;
     modem->unsol_func   = unsol_func;
     modem->unsol_opaque = unsol_opaque;
+    modem->coalesce_ms  = amodem_nvram_get_int( modem, NV_UNSOL_COALESCE, 0 );
+
+    modem->sms_timeout      = amodem_nvram_get_int( modem, NV_SMS_TIMEOUT, SMS_RECEIVER_TIMEOUT );
+    modem->sms_max_messages = amodem_nvram_get_int( modem, NV_SMS_MAX_MESSAGES, SMS_RECEIVER_MAX_MESSAGES );
+    modem->sms_max_bytes    = amodem_nvram_get_int( modem, NV_SMS_MAX_BYTES, SMS_RECEIVER_MAX_BYTES );
+
+    modem->iface = anetiface_create( amodem_nvram_get_str( modem, NV_NETWORK_INTERFACE,
+                                                           NETWORK_INTERFACE ) );
+    if (modem->iface == NULL)
+        modem->iface = anetiface_create( NETWORK_INTERFACE );
 
     modem->sim = asimcard_create(base_port);
 
-    aconfig_save_file( modem->nvram_config, modem->nvram_config_filename );
+    amodem_signal_start( modem );
+
+    amodem_nvram_changed( modem );
+    amodem_publish_state( modem );
     return  modem;
 }
 
@@ -581,13 +1053,51 @@ void
 amodem_set_legacy( AModem  modem )
 {
     modem->supportsNetworkDataType = 0;
+    amodem_snapshot_changed( modem );
 }
 
 void
 amodem_destroy( AModem  modem )
 {
+    int  nn;
+
+    amodem_calls_done( modem );
+
     asimcard_destroy( modem->sim );
     modem->sim = NULL;
+
+    if (modem->sms_receiver != NULL) {
+        sms_receiver_destroy( modem->sms_receiver );
+        modem->sms_receiver = NULL;
+    }
+    sys_timer_destroy( modem->sms_timer );
+
+    asignal_destroy( modem->signal );
+    modem->signal = NULL;
+
+    if (modem->iface != NULL) {
+        anetiface_destroy( modem->iface );
+        modem->iface = NULL;
+    }
+
+    if (modem->hook != NULL) {
+        sys_process_detach( modem->hook );
+        modem->hook = NULL;
+    }
+
+    amodem_out_done( modem->out );
+    amodem_out_done( modem->unsol );
+    amodem_out_done( modem->csq );
+    for (nn = 0; nn < A_UNSOL_MAX; nn++)
+        amodem_out_done( &modem->coalesce[nn] );
+    sys_timer_destroy( modem->coalesce_timer );
+    amodem_state_done( modem );
+
+    amodem_nvram_flush( modem );
+    sys_timer_destroy( modem->nvram_timer );
+    anvram_destroy( modem->nvram );
+    free( modem->nvram_config_filename );
+    free( modem );
 }
 
 
@@ -600,84 +1110,415 @@ amodem_has_network( AModem  modem )
              modem->oper_selection_mode == A_SELECTION_DEREGISTRATION );
 }
 
+/** SIGNAL STRENGTH
+ **
+ ** the values come from the signal engine, which only reports them when
+ ** one of their levels changes. the +CSQ line is rendered once per change
+ ** and pushed as an unsolicited message, then reused by each +CSQ query.
+ **/
 
-ARadioState
-amodem_get_radio_state( AModem modem )
-{
-    return modem->radio_state;
-}
-
-void
-amodem_set_radio_state( AModem modem, ARadioState  state )
+/* level (0-4) of the technology in use */
+static int
+amodem_signal_level( AModem  modem )
 {
-    modem->radio_state = state;
+    switch (modem->technology) {
+        case A_TECH_LTE:  return asignal_get_level( modem->signal, A_SIGNAL_LTE );
+        case A_TECH_CDMA: return asignal_get_level( modem->signal, A_SIGNAL_CDMA );
+        case A_TECH_EVDO: return asignal_get_level( modem->signal, A_SIGNAL_EVDO );
+        default:          return asignal_get_level( modem->signal, A_SIGNAL_GSM );
+    }
 }
 
-ASimCard
-amodem_get_sim( AModem  modem )
+/* return the cached "+CSQ: ..." line, without line terminator */
+static AModemOut
+amodem_signal_csq( AModem  modem )
 {
-    return  modem->sim;
-}
+    // rssi = 0 (<-113dBm) 1 (<-111) 2-30 (<-109--53) 31 (>=-51) 99 (?!)
+    // ber (bit error rate) - always 99 (unknown), apparently.
+    // TODO: return 99 if modem->radio_state==A_RADIO_STATE_OFF.
+    if (!modem->csq_valid) {
+        const ASignalValuesRec*  v = asignal_get_values( modem->signal );
+        const int  values[12] = {
+            v->gsm_rssi, v->gsm_ber,
+            v->cdma_dbm, v->cdma_ecio,
+            v->evdo_dbm, v->evdo_ecio, v->evdo_snr,
+            v->lte_rssi, v->lte_rsrp, v->lte_rsrq,
+            v->lte_rssnr, v->lte_cqi
+        };
+        int  nn;
 
-ARegistrationState
-amodem_get_voice_registration( AModem  modem )
-{
-    return modem->voice_state;
+        amodem_out_reset( modem->csq );
+        amodem_out_add_str( modem->csq, "+CSQ: " );
+        for (nn = 0; nn < 12; nn++) {
+            if (nn > 0)
+                amodem_out_add_c( modem->csq, ',' );
+            amodem_out_add_int( modem->csq, values[nn] );
+        }
+        amodem_out_end( modem->csq );
+        modem->csq_valid = 1;
+    }
+    return modem->csq;
 }
 
-void
-amodem_set_voice_registration( AModem  modem, ARegistrationState  state )
+static void
+amodem_signal_changed( void*  _modem, int  levels_changed )
 {
-    modem->voice_state = state;
-
-    if (state == A_REGISTRATION_HOME)
-        modem->oper_index = OPERATOR_HOME_INDEX;
-    else if (state == A_REGISTRATION_ROAMING)
-        modem->oper_index = OPERATOR_ROAMING_INDEX;
+    AModem     modem = (AModem) _modem;
+    AModemOut  out, csq;
 
-    switch (modem->voice_mode) {
-        case A_REGISTRATION_UNSOL_ENABLED:
-            amodem_unsol( modem, "+CREG: %d,%d\r",
-                          modem->voice_mode, modem->voice_state );
-            break;
+    modem->csq_valid = 0;
+    amodem_snapshot_changed( modem );
+    if (!levels_changed)
+        return;
 
-        case A_REGISTRATION_UNSOL_ENABLED_FULL:
-            amodem_unsol( modem, "+CREG: %d,%d, \"%04x\", \"%04x\"\r",
-                          modem->voice_mode, modem->voice_state,
-                          modem->area_code & 0xffff, modem->cell_id & 0xffff);
-            break;
-        default:
-            ;
+    out = amodem_unsol_begin_type( modem, A_UNSOL_CSQ );
+    if (out != NULL) {
+        csq = amodem_signal_csq( modem );
+        amodem_out_add( out, csq->data, csq->size );
+        amodem_out_add_c( out, '\r' );
+        amodem_unsol_post( modem, A_UNSOL_CSQ );
     }
+    amodem_publish_state( modem );
 }
 
-ARegistrationState
-amodem_get_data_registration( AModem  modem )
+/* start the trace or random walk configured in the NVRAM, if any */
+static void
+amodem_signal_start( AModem  modem )
 {
-    return modem->data_state;
+    const char*  trace = amodem_nvram_get_str( modem, NV_SIGNAL_TRACE, NULL );
+    int          walk  = amodem_nvram_get_int( modem, NV_SIGNAL_WALK, 0 );
+
+    if (trace != NULL && trace[0] != 0 &&
+        asignal_start_trace( modem->signal, trace,
+                             amodem_nvram_get_int( modem, NV_SIGNAL_TRACE_LOOP, 1 ) ) == 0)
+        return;
+
+    if (walk > 0)
+        asignal_start_random_walk( modem->signal, walk, modem->base_port );
+}
+
+/** STATE SNAPSHOTS
+ **
+ ** after each mutation batch, the event loop fills a new AModemStateRec and
+ ** swaps it in. readers publish the epoch they entered at in their slot
+ ** before loading the pointer, so a replaced state retired at epoch E can
+ ** be reused once every active slot holds an epoch above E. the writer
+ ** never waits, and readers never block or allocate.
+ **/
+typedef struct AModemStateNodeRec {
+    struct AModemStateNodeRec*  next;
+    unsigned long long          retire_epoch;
+    int                         max_calls;   /* capacity of state.calls */
+    AModemStateRec              state;       /* must be last */
+} AModemStateNodeRec, *AModemStateNode;
+
+static unsigned long long  sStateEpoch = 1;
+static unsigned long long  sStateReaders[ AMODEM_STATE_READERS ];  /* 0 when idle */
+static int                 sStateReaderUsed[ AMODEM_STATE_READERS ];
+
+int
+amodem_state_reader_open( void )
+{
+    int  nn;
+
+    for (nn = 0; nn < AMODEM_STATE_READERS; nn++) {
+        int  expected = 0;
+
+        if (__atomic_compare_exchange_n( &sStateReaderUsed[nn], &expected, 1, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST ))
+            return nn;
+    }
+    return -1;
 }
 
 void
-amodem_set_data_registration( AModem  modem, ARegistrationState  state )
+amodem_state_reader_close( int  reader )
 {
-    modem->data_state = state;
+    if ((unsigned)reader >= AMODEM_STATE_READERS)
+        return;
 
-    switch (modem->data_mode) {
+    __atomic_store_n( &sStateReaders[reader], 0, __ATOMIC_SEQ_CST );
+    __atomic_store_n( &sStateReaderUsed[reader], 0, __ATOMIC_SEQ_CST );
+}
+
+AModemState
+amodem_state_acquire( AModem  modem, int  reader )
+{
+    AModemStateNode  node;
+
+    if ((unsigned)reader >= AMODEM_STATE_READERS)
+        return NULL;
+
+    /* the slot must be visible before the pointer is loaded */
+    __atomic_store_n( &sStateReaders[reader],
+                      __atomic_load_n( &sStateEpoch, __ATOMIC_SEQ_CST ),
+                      __ATOMIC_SEQ_CST );
+
+    node = __atomic_load_n( &modem->state, __ATOMIC_SEQ_CST );
+    return node ? &node->state : NULL;
+}
+
+void
+amodem_state_release( int  reader )
+{
+    if ((unsigned)reader < AMODEM_STATE_READERS)
+        __atomic_store_n( &sStateReaders[reader], 0, __ATOMIC_RELEASE );
+}
+
+/* move the retired states that no reader can see anymore to the free list */
+static void
+amodem_state_reclaim( AModem  modem )
+{
+    unsigned long long  oldest = ~0ULL;
+    AModemStateNode*    pnode  = &modem->state_retired;
+    int                 nn;
+
+    for (nn = 0; nn < AMODEM_STATE_READERS; nn++) {
+        unsigned long long  epoch = __atomic_load_n( &sStateReaders[nn], __ATOMIC_SEQ_CST );
+
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+
+    while (*pnode != NULL) {
+        AModemStateNode  node = *pnode;
+
+        if (node->retire_epoch < oldest) {
+            *pnode            = node->next;
+            node->next        = modem->state_free;
+            modem->state_free = node;
+        } else {
+            pnode = &node->next;
+        }
+    }
+}
+
+static AModemStateNode
+amodem_state_alloc( AModem  modem )
+{
+    AModemStateNode*  pnode = &modem->state_free;
+    AModemStateNode   node;
+    int               max_calls = modem->max_calls > 0 ? modem->max_calls : 1;
+
+    for ( ; (node = *pnode) != NULL; pnode = &node->next ) {
+        if (node->max_calls >= modem->call_count) {
+            *pnode     = node->next;
+            node->next = NULL;
+            return node;
+        }
+    }
+
+    node = (AModemStateNode) malloc( sizeof(*node) + (max_calls-1)*sizeof(ACallRec) );
+    if (node != NULL) {
+        node->next      = NULL;
+        node->max_calls = max_calls;
+    }
+    return node;
+}
+
+static int
+amodem_state_size( int  call_count )
+{
+    return offsetof(AModemStateRec, calls) + call_count*sizeof(ACallRec);
+}
+
+static void
+amodem_publish_state( AModem  modem )
+{
+    AModemStateNode  node = amodem_state_alloc( modem );
+    AModemStateNode  old  = modem->state;
+    AModemStateRec*  st;
+    int              nn;
+
+    if (node == NULL)
+        return;
+
+    /* cleared first, so that unchanged states compare equal */
+    st = &node->state;
+    memset( st, 0, amodem_state_size( modem->call_count ) );
+
+    st->radio_state  = modem->radio_state;
+    st->voice_state  = modem->voice_state;
+    st->data_state   = modem->data_state;
+    st->data_network = modem->data_network;
+    st->technology   = modem->technology;
+    st->signal       = amodem_signal_level( modem );
+    st->area_code    = modem->area_code;
+    st->cell_id      = modem->cell_id;
+
+    if (amodem_has_network( modem )) {
+        for (nn = 0; nn < A_NAME_MAX; nn++)
+            memcpy( st->oper_name[nn], modem->operators[ modem->oper_index ].name[nn],
+                    sizeof(st->oper_name[nn]) );
+    }
+
+    for (nn = 0; nn < MAX_DATA_CONTEXTS && nn < AMODEM_STATE_MAX_CONTEXTS; nn++) {
+        st->contexts[nn].id     = modem->data_contexts[nn].id;
+        st->contexts[nn].active = modem->data_contexts[nn].active;
+        memcpy( st->contexts[nn].apn, modem->data_contexts[nn].apn, sizeof(st->contexts[nn].apn) );
+    }
+
+    st->call_count = modem->call_count;
+    for (nn = 0; nn < modem->call_count; nn++)
+        st->calls[nn] = modem->calls[nn]->call;
+
+    if (old != NULL) {
+        st->generation = old->state.generation;
+        if (old->state.call_count == st->call_count &&
+            !memcmp( &old->state, st, amodem_state_size( st->call_count ) ))
+        {
+            /* nothing changed, keep the current one */
+            node->next        = modem->state_free;
+            modem->state_free = node;
+            return;
+        }
+        st->generation += 1;
+    }
+    amodem_snapshot_changed( modem );
+
+    __atomic_store_n( &modem->state, node, __ATOMIC_SEQ_CST );
+
+    if (old != NULL) {
+        old->retire_epoch    = __atomic_fetch_add( &sStateEpoch, 1, __ATOMIC_SEQ_CST );
+        old->next            = modem->state_retired;
+        modem->state_retired = old;
+    }
+    amodem_state_reclaim( modem );
+}
+
+/* readers must be done with this modem */
+static void
+amodem_state_done( AModem  modem )
+{
+    AModemStateNode  lists[3] = { modem->state, modem->state_retired, modem->state_free };
+    int              nn;
+
+    modem->state = modem->state_retired = modem->state_free = NULL;
+
+    for (nn = 0; nn < 3; nn++) {
+        while (lists[nn] != NULL) {
+            AModemStateNode  node = lists[nn];
+            lists[nn] = node->next;
+            free( node );
+        }
+    }
+}
+
+
+ARadioState
+amodem_get_radio_state( AModem modem )
+{
+    return modem->radio_state;
+}
+
+void
+amodem_set_radio_state( AModem modem, ARadioState  state )
+{
+    modem->radio_state = state;
+    amodem_publish_state( modem );
+}
+
+ASimCard
+amodem_get_sim( AModem  modem )
+{
+    return  modem->sim;
+}
+
+ARegistrationState
+amodem_get_voice_registration( AModem  modem )
+{
+    return modem->voice_state;
+}
+
+/* append a +CREG/+CGREG style registration line, 'full' adds the location
+ * fields, 'spaced' selects the historical +CREG separators and 'network'
+ * is only appended when >= 0 */
+static void
+amodem_out_add_registration( AModemOut               out,
+                             const char*             prefix,
+                             ARegistrationUnsolMode  mode,
+                             ARegistrationState      state,
+                             int                     full,
+                             int                     spaced,
+                             unsigned                area_code,
+                             unsigned                cell_id,
+                             int                     network )
+{
+    amodem_out_add_str( out, prefix );
+    amodem_out_add_int( out, mode );
+    amodem_out_add_c( out, ',' );
+    amodem_out_add_int( out, state );
+
+    if (full) {
+        amodem_out_add_str( out, spaced ? ", \"" : ",\"" );
+        amodem_out_add_hex( out, area_code, 4 );
+        amodem_out_add_str( out, spaced ? "\", \"" : "\",\"" );
+        amodem_out_add_hex( out, cell_id, 4 );
+        amodem_out_add_c( out, '"' );
+
+        if (network >= 0) {
+            amodem_out_add_str( out, ",\"" );
+            amodem_out_add_hex( out, network, 4 );
+            amodem_out_add_c( out, '"' );
+        }
+    }
+}
+
+void
+amodem_set_voice_registration( AModem  modem, ARegistrationState  state )
+{
+    AModemOut  out;
+
+    modem->voice_state = state;
+
+    if (state == A_REGISTRATION_HOME)
+        modem->oper_index = OPERATOR_HOME_INDEX;
+    else if (state == A_REGISTRATION_ROAMING)
+        modem->oper_index = OPERATOR_ROAMING_INDEX;
+    amodem_snapshot_changed( modem );
+
+    switch (modem->voice_mode) {
         case A_REGISTRATION_UNSOL_ENABLED:
-            amodem_unsol( modem, "+CGREG: %d,%d\r",
-                          modem->data_mode, modem->data_state );
+        case A_REGISTRATION_UNSOL_ENABLED_FULL:
+            out = amodem_unsol_begin_type( modem, A_UNSOL_CREG );
+            if (out == NULL)
+                break;
+            amodem_out_add_registration( out, "+CREG: ", modem->voice_mode, modem->voice_state,
+                                         modem->voice_mode == A_REGISTRATION_UNSOL_ENABLED_FULL, 1,
+                                         modem->area_code & 0xffff, modem->cell_id & 0xffff, -1 );
+            amodem_out_add_c( out, '\r' );
+            amodem_unsol_post( modem, A_UNSOL_CREG );
             break;
+        default:
+            ;
+    }
+    amodem_publish_state( modem );
+}
 
+ARegistrationState
+amodem_get_data_registration( AModem  modem )
+{
+    return modem->data_state;
+}
+
+/* send the +CGREG unsolicited message, if enabled */
+static void
+amodem_report_data_registration( AModem  modem )
+{
+    AModemOut  out;
+
+    switch (modem->data_mode) {
+        case A_REGISTRATION_UNSOL_ENABLED:
         case A_REGISTRATION_UNSOL_ENABLED_FULL:
-            if (modem->supportsNetworkDataType)
-                amodem_unsol( modem, "+CGREG: %d,%d,\"%04x\",\"%04x\",\"%04x\"\r",
-                            modem->data_mode, modem->data_state,
-                            modem->area_code & 0xffff, modem->cell_id & 0xffff,
-                            modem->data_network );
-            else
-                amodem_unsol( modem, "+CGREG: %d,%d,\"%04x\",\"%04x\"\r",
-                            modem->data_mode, modem->data_state,
-                            modem->area_code & 0xffff, modem->cell_id & 0xffff );
+            out = amodem_unsol_begin_type( modem, A_UNSOL_CGREG );
+            if (out == NULL)
+                break;
+            amodem_out_add_registration( out, "+CGREG: ", modem->data_mode, modem->data_state,
+                                         modem->data_mode == A_REGISTRATION_UNSOL_ENABLED_FULL, 0,
+                                         modem->area_code & 0xffff, modem->cell_id & 0xffff,
+                                         modem->supportsNetworkDataType ? (int)modem->data_network : -1 );
+            amodem_out_add_c( out, '\r' );
+            amodem_unsol_post( modem, A_UNSOL_CGREG );
             break;
 
         default:
@@ -685,11 +1526,19 @@ amodem_set_data_registration( AModem  modem, ARegistrationState  state )
     }
 }
 
-static int
-amodem_nvram_set( AModem modem, const char *name, const char *value )
+void
+amodem_set_data_registration( AModem  modem, ARegistrationState  state )
 {
-    aconfig_set(modem->nvram_config, name, value);
-    return 0;
+    modem->data_state = state;
+    amodem_report_data_registration( modem );
+    amodem_publish_state( modem );
+}
+
+static void
+amodem_nvram_set_int( AModem modem, const char *name, int value )
+{
+    anvram_set_int(modem->nvram, name, value);
+    amodem_nvram_changed(modem);
 }
 static AModemTech
 tech_from_network_type( ADataNetworkType type )
@@ -720,13 +1569,20 @@ amodem_set_data_network_type( AModem  modem, ADataNetworkType   type )
 {
     AModemTech modemTech;
     modem->data_network = type;
-    amodem_set_data_registration( modem, modem->data_state );
+    amodem_report_data_registration( modem );
     modemTech = tech_from_network_type(type);
     if (modem->unsol_func && modemTech != A_TECH_UNKNOWN) {
-        if (_amodem_switch_technology( modem, modemTech, modem->preferred_mask )) {
-            modem->unsol_func( modem->unsol_opaque, modem->out_buff );
+        AModemTech  oldTech = modem->technology;
+        _amodem_switch_technology( modem, modemTech, modem->preferred_mask );
+        if (modem->technology != oldTech) {
+            AModemOut  out = amodem_unsol_begin_type( modem, A_UNSOL_CTEC );
+            if (out != NULL) {
+                amodem_out_printf( out, "+CTEC: %d", modem->technology );
+                amodem_unsol_post( modem, A_UNSOL_CTEC );
+            }
         }
     }
+    amodem_publish_state( modem );
 }
 
 int
@@ -772,6 +1628,8 @@ amodem_set_operator_name( AModem  modem, ANameIndex  index, const char*  buffer,
         buffer_size = avail-1;
     memcpy( oper->name[index], buffer, buffer_size );
     oper->name[index][buffer_size] = 0;
+    amodem_snapshot_changed( modem );
+    amodem_publish_state( modem );
 }
 
 /** CALLS
@@ -788,37 +1646,170 @@ amodem_get_call( AModem  modem, int  index )
     if ((unsigned)index >= (unsigned)modem->call_count)
         return NULL;
 
-    return &modem->calls[index].call;
+    return &modem->calls[index]->call;
 }
 
-static AVoiceCall
-amodem_alloc_call( AModem   modem )
+/* numbers are indexed without their formatting characters, so that
+ * "+1 555-521-5556" and "15555215556" refer to the same call */
+static void
+amodem_normalize_number( const char*  number, char*  key, int  size )
 {
-    AVoiceCall  call  = NULL;
-    int         count = modem->call_count;
+    int  len = 0;
 
-    if (count < MAX_CALLS) {
-        int  id;
+    for ( ; *number && len < size-1; number++ ) {
+        char  c = *number;
 
-        /* find a valid id for this call */
-        for (id = 0; id < modem->call_count; id++) {
-            int  found = 0;
-            int  nn;
-            for (nn = 0; nn < count; nn++) {
-                if ( modem->calls[nn].call.id == (id+1) ) {
-                    found = 1;
-                    break;
-                }
-            }
-            if (!found)
-                break;
+        if ((c >= '0' && c <= '9') || c == '*' || c == '#' ||
+            (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
+            key[len++] = c;
+    }
+    key[len] = 0;
+}
+
+static unsigned
+amodem_number_hash( const char*  key )
+{
+    unsigned  h = 2166136261U;
+
+    while (*key)
+        h = (h ^ (unsigned char)*key++) * 16777619U;
+
+    return h;
+}
+
+/* add a call to the number index, once its number is known */
+static void
+amodem_index_call( AModem  modem, AVoiceCall  vcall )
+{
+    AVoiceCall*  pbucket;
+
+    amodem_normalize_number( vcall->call.number, vcall->key, sizeof(vcall->key) );
+    pbucket = &modem->calls_by_number[ amodem_number_hash( vcall->key ) & modem->calls_hash_mask ];
+
+    vcall->hash_next = *pbucket;
+    *pbucket         = vcall;
+}
+
+static void
+amodem_unindex_call( AModem  modem, AVoiceCall  vcall )
+{
+    AVoiceCall*  pnode = &modem->calls_by_number[ amodem_number_hash( vcall->key ) & modem->calls_hash_mask ];
+
+    for ( ; *pnode != NULL; pnode = &(*pnode)->hash_next ) {
+        if (*pnode == vcall) {
+            *pnode = vcall->hash_next;
+            break;
         }
-        call          = modem->calls + count;
-        call->call.id = id + 1;
-        call->modem   = modem;
+    }
+    vcall->hash_next = NULL;
+}
+
+/* the tables of a call list of 'max' entries, before they're installed */
+typedef struct {
+    AVoiceCall*  calls;
+    AVoiceCall*  by_id;
+    AVoiceCall*  by_number;
+    unsigned     buckets;
+    int          max;
+} ACallTablesRec;
+
+static int
+amodem_call_tables_alloc( ACallTablesRec*  t, int  max_calls )
+{
+    t->max     = max_calls;
+    t->buckets = 8;
+    while (t->buckets < (unsigned)max_calls * 2)
+        t->buckets <<= 1;
+
+    t->calls     = (AVoiceCall*) calloc( max_calls, sizeof(AVoiceCall) );
+    t->by_id     = (AVoiceCall*) calloc( max_calls + 1, sizeof(AVoiceCall) );
+    t->by_number = (AVoiceCall*) calloc( t->buckets, sizeof(AVoiceCall) );
+    if (t->calls == NULL || t->by_id == NULL || t->by_number == NULL) {
+        free( t->calls );
+        free( t->by_id );
+        free( t->by_number );
+        return -1;
+    }
+    return 0;
+}
+
+/* replace the tables of the modem by 't', whose first 'count' entries of
+ * t->calls are the calls, they're indexed here */
+static void
+amodem_call_tables_install( AModem  modem, ACallTablesRec*  t, int  count )
+{
+    int  nn;
+
+    free( modem->calls );
+    free( modem->calls_by_id );
+    free( modem->calls_by_number );
 
-        modem->call_count += 1;
+    modem->calls           = t->calls;
+    modem->call_count      = count;
+    modem->max_calls       = t->max;
+    modem->calls_by_id     = t->by_id;
+    modem->calls_by_number = t->by_number;
+    modem->calls_hash_mask = t->buckets - 1;
+    amodem_snapshot_changed( modem );
+
+    for (nn = 0; nn < count; nn++) {
+        AVoiceCall  vcall = t->calls[nn];
+
+        t->by_id[ vcall->call.id ] = vcall;
+        amodem_index_call( modem, vcall );
+    }
+}
+
+int
+amodem_set_max_calls( AModem  modem, int  max_calls )
+{
+    ACallTablesRec  t[1];
+    int             nn;
+
+    if (max_calls < 1 || max_calls > MAX_CALLS_LIMIT || max_calls < modem->call_count)
+        return -1;
+
+    /* ids of the current calls must remain valid */
+    for (nn = 0; nn < modem->call_count; nn++) {
+        if (modem->calls[nn]->call.id > max_calls)
+            return -1;
+    }
+
+    if (amodem_call_tables_alloc( t, max_calls ) < 0)
+        return -1;
+
+    if (modem->call_count > 0)
+        memcpy( t->calls, modem->calls, modem->call_count * sizeof(AVoiceCall) );
+    amodem_call_tables_install( modem, t, modem->call_count );
+    return 0;
+}
+
+static AVoiceCall
+amodem_alloc_call( AModem   modem )
+{
+    AVoiceCall  call;
+    int         id;
+
+    if (modem->call_count >= modem->max_calls)
+        return NULL;
+
+    /* use the smallest free id, as the RIL expects small ids */
+    for (id = 1; id <= modem->max_calls; id++) {
+        if (modem->calls_by_id[id] == NULL)
+            break;
     }
+    assert( id <= modem->max_calls );
+
+    call = (AVoiceCall) calloc( 1, sizeof(*call) );
+    if (call == NULL)
+        return NULL;
+
+    call->call.id = id;
+    call->modem   = modem;
+    call->seq     = ++modem->call_seq;
+
+    modem->calls[ modem->call_count++ ] = call;
+    modem->calls_by_id[id] = call;
     return call;
 }
 
@@ -839,30 +1830,44 @@ amodem_free_call( AModem  modem, AVoiceCall  call )
     }
 
     for (nn = 0; nn < modem->call_count; nn++) {
-        if ( modem->calls + nn == call )
+        if ( modem->calls[nn] == call )
             break;
     }
     assert( nn < modem->call_count );
 
     memmove( modem->calls + nn,
              modem->calls + nn + 1,
-             (modem->call_count - 1 - nn)*sizeof(*call) );
+             (modem->call_count - 1 - nn)*sizeof(AVoiceCall) );
 
     modem->call_count -= 1;
+    modem->calls_by_id[ call->call.id ] = NULL;
+    amodem_unindex_call( modem, call );
+    free( call );
+}
+
+static void
+amodem_calls_done( AModem  modem )
+{
+    while (modem->call_count > 0)
+        amodem_free_call( modem, modem->calls[ modem->call_count - 1 ] );
+
+    free( modem->calls );
+    free( modem->calls_by_id );
+    free( modem->calls_by_number );
+    modem->calls           = NULL;
+    modem->calls_by_id     = NULL;
+    modem->calls_by_number = NULL;
+    modem->max_calls       = 0;
 }
 
 
 static AVoiceCall
 amodem_find_call( AModem  modem, int  id )
 {
-    int  nn;
+    if (id < 1 || id > modem->max_calls)
+        return NULL;
 
-    for (nn = 0; nn < modem->call_count; nn++) {
-        AVoiceCall call = modem->calls + nn;
-        if (call->call.id == id)
-            return call;
-    }
-    return NULL;
+    return modem->calls_by_id[id];
 }
 
 static void
@@ -878,12 +1883,14 @@ int
 amodem_add_inbound_call( AModem  modem, const char*  number )
 {
     AVoiceCall  vcall = amodem_alloc_call( modem );
-    ACall       call  = &vcall->call;
+    ACall       call;
     int         len;
 
-    if (call == NULL)
+    if (vcall == NULL)
         return -1;
 
+    call = &vcall->call;
+
     call->dir   = A_CALL_INBOUND;
     call->state = A_CALL_INCOMING;
     call->mode  = A_CALL_VOICE;
@@ -892,36 +1899,59 @@ amodem_add_inbound_call( AModem  modem, const char*  number )
     vcall->is_remote = (remote_number_string_to_port(number) > 0);
 
     len  = strlen(number);
-    if (len >= sizeof(call->number))
+    if (len >= (int)sizeof(call->number))
         len = sizeof(call->number)-1;
 
     memcpy( call->number, number, len );
     call->number[len] = 0;
+    amodem_index_call( modem, vcall );
 
     amodem_send_calls_update( modem );
+    amodem_publish_state( modem );
     return 0;
 }
 
 ACall
 amodem_find_call_by_number( AModem  modem, const char*  number )
 {
-    AVoiceCall  vcall = modem->calls;
-    AVoiceCall  vend  = vcall + modem->call_count;
+    char        key[ A_CALL_NUMBER_MAX_SIZE+1 ];
+    AVoiceCall  vcall, found = NULL;
 
-    if (!number)
+    if (!number || modem->calls_by_number == NULL)
         return NULL;
 
-    for ( ; vcall < vend; vcall++ )
-        if ( !strcmp(vcall->call.number, number) )
-            return &vcall->call;
+    amodem_normalize_number( number, key, sizeof(key) );
+    vcall = modem->calls_by_number[ amodem_number_hash( key ) & modem->calls_hash_mask ];
+
+    /* several calls may share a number, return the oldest one */
+    for ( ; vcall != NULL; vcall = vcall->hash_next ) {
+        if ( !strcmp(vcall->key, key) && (found == NULL || vcall->seq < found->seq) )
+            found = vcall;
+    }
 
-    return  NULL;
+    return  found ? &found->call : NULL;
 }
 
 void
 amodem_set_signal_strength( AModem modem, int value)
 {
-    modem->signal = (signal_strength) value;
+    if ((unsigned)value > GREAT)
+        return;
+
+    asignal_set_values( modem->signal, &NET_PROFILES[value] );
+    amodem_publish_state( modem );
+}
+
+int
+amodem_set_signal_trace( AModem  modem, const char*  path, int  loop )
+{
+    return asignal_start_trace( modem->signal, path, loop );
+}
+
+int
+amodem_set_signal_walk( AModem  modem, int  interval_ms )
+{
+    return asignal_start_random_walk( modem->signal, interval_ms, modem->base_port );
 }
 
 static void
@@ -961,6 +1991,7 @@ amodem_update_call( AModem  modem, const char*  fromNumber, ACallState  state )
 
     acall_set_state( vcall, state );
     amodem_send_calls_update(modem);
+    amodem_publish_state( modem );
     return 0;
 }
 
@@ -975,6 +2006,7 @@ amodem_disconnect_call( AModem  modem, const char*  number )
 
     amodem_free_call( modem, vcall );
     amodem_send_calls_update(modem);
+    amodem_publish_state( modem );
     return 0;
 }
 
@@ -1043,10 +2075,9 @@ _amodem_switch_technology( AModem modem, AModemTech newtech, int32_t newpreferre
         return "ERROR: At least one technology must be enabled";
     }
     if (modem->preferred_mask != newpreferred) {
-        char value[MAX_KEY_NAME + 1];
         modem->preferred_mask = newpreferred;
-        snprintf(value, MAX_KEY_NAME, "%d", newpreferred);
-        amodem_nvram_set(modem, NV_PREFERRED_MODE, value);
+        amodem_snapshot_changed( modem );
+        amodem_nvram_set_int(modem, NV_PREFERRED_MODE, newpreferred);
         if (!matchPreferredMask(modem->preferred_mask, newtech)) {
             newtech = chooseTechFromMask(modem, newpreferred);
         }
@@ -1092,6 +2123,7 @@ _amodem_set_cdma_prl_version( AModem modem, int prlVersion)
     D("_amodem_set_cdma_prl_version");
     if (modem->prl_version != prlVersion) {
         modem->prl_version = prlVersion;
+        amodem_snapshot_changed( modem );
         return 0;
     }
     return -1;
@@ -1106,17 +2138,15 @@ amodem_set_cdma_subscription_source( AModem modem, ACdmaSubscriptionSource ss)
     }
 }
 
-#define MAX_INT_DIGITS 10
 static int
 _amodem_set_cdma_subscription_source( AModem modem, ACdmaSubscriptionSource ss)
 {
     D("_amodem_set_cdma_subscription_source()\n");
-    char value[MAX_INT_DIGITS + 1];
 
     if (ss != modem->subscription_source) {
-        snprintf( value, MAX_INT_DIGITS + 1, "%d", ss );
-        amodem_nvram_set( modem, NV_CDMA_SUBSCRIPTION_SOURCE, value );
+        amodem_nvram_set_int( modem, NV_CDMA_SUBSCRIPTION_SOURCE, ss );
         modem->subscription_source = ss;
+        amodem_snapshot_changed( modem );
         return 0;
     }
     return -1;
@@ -1167,8 +2197,8 @@ handleRoamPref( const char * cmd, AModem modem )
          // (if *endptr is null, it means strtol processed the whole string as a number)
         if(endptr && !*endptr) {
             modem->roaming_pref = (ACdmaRoamingPref) roaming_pref;
-            aconfig_set( modem->nvram_config, NV_CDMA_ROAMING_PREF, cmd );
-            aconfig_save_file( modem->nvram_config, modem->nvram_config_filename );
+            amodem_snapshot_changed( modem );
+            amodem_nvram_set_int( modem, NV_CDMA_ROAMING_PREF, roaming_pref );
             return NULL;
         }
     }
@@ -1241,6 +2271,7 @@ handleEmergencyMode( const char* cmd, AModem modem )
 
         if ((!arg) != (!modem->in_emergency_mode)) {
             modem->in_emergency_mode = arg;
+            amodem_snapshot_changed( modem );
             return amodem_printf(modem, "+WSOS: %d", arg);
         }
     }
@@ -1320,13 +2351,11 @@ handleNetworkRegistration( const char*  cmd, AModem  modem )
     if ( !memcmp( cmd, "+CREG", 5 ) ) {
         cmd += 5;
         if (cmd[0] == '?') {
-            if (modem->voice_mode == A_REGISTRATION_UNSOL_ENABLED_FULL)
-                return amodem_printf( modem, "+CREG: %d,%d, \"%04x\", \"%04x\"",
-                                       modem->voice_mode, modem->voice_state,
-                                       modem->area_code, modem->cell_id );
-            else
-                return amodem_printf( modem, "+CREG: %d,%d",
-                                       modem->voice_mode, modem->voice_state );
+            amodem_begin_line( modem );
+            amodem_out_add_registration( modem->out, "+CREG: ", modem->voice_mode, modem->voice_state,
+                                         modem->voice_mode == A_REGISTRATION_UNSOL_ENABLED_FULL, 1,
+                                         modem->area_code, modem->cell_id, -1 );
+            return amodem_end_line( modem );
         } else if (cmd[0] == '=') {
             switch (cmd[1]) {
                 case '0':
@@ -1347,21 +2376,18 @@ handleNetworkRegistration( const char*  cmd, AModem  modem )
                 default:
                     return "ERROR: BAD COMMAND";
             }
+            amodem_snapshot_changed( modem );
         } else {
             assert( 0 && "unreachable" );
         }
     } else if ( !memcmp( cmd, "+CGREG", 6 ) ) {
         cmd += 6;
         if (cmd[0] == '?') {
-            if (modem->supportsNetworkDataType)
-                return amodem_printf( modem, "+CGREG: %d,%d,\"%04x\",\"%04x\",\"%04x\"",
-                                    modem->data_mode, modem->data_state,
-                                    modem->area_code, modem->cell_id,
-                                    modem->data_network );
-            else
-                return amodem_printf( modem, "+CGREG: %d,%d,\"%04x\",\"%04x\"",
-                                    modem->data_mode, modem->data_state,
-                                    modem->area_code, modem->cell_id );
+            amodem_begin_line( modem );
+            amodem_out_add_registration( modem->out, "+CGREG: ", modem->data_mode, modem->data_state,
+                                         1, 0, modem->area_code, modem->cell_id,
+                                         modem->supportsNetworkDataType ? (int)modem->data_network : -1 );
+            return amodem_end_line( modem );
         } else if (cmd[0] == '=') {
             switch (cmd[1]) {
                 case '0':
@@ -1382,6 +2408,7 @@ handleNetworkRegistration( const char*  cmd, AModem  modem )
                 default:
                     return "ERROR: BAD COMMAND";
             }
+            amodem_snapshot_changed( modem );
         } else {
             assert( 0 && "unreachable" );
         }
@@ -1452,6 +2479,7 @@ handleOperatorSelection( const char*  cmd, AModem  modem )
         switch (cmd[1]) {
             case '0':
                 modem->oper_selection_mode = A_SELECTION_AUTOMATIC;
+                amodem_snapshot_changed( modem );
                 return NULL;
 
             case '1':
@@ -1492,6 +2520,7 @@ handleOperatorSelection( const char*  cmd, AModem  modem )
                         return "+CME ERROR: 32";
                     }
                     modem->oper_index = found;
+                    amodem_snapshot_changed( modem );
 
                     /* set the voice and data registration states to home or roaming
                      * depending on the operator index
@@ -1508,6 +2537,7 @@ handleOperatorSelection( const char*  cmd, AModem  modem )
 
             case '2':
                 modem->oper_selection_mode = A_SELECTION_DEREGISTRATION;
+                amodem_snapshot_changed( modem );
                 return NULL;
 
             case '3':
@@ -1522,6 +2552,7 @@ handleOperatorSelection( const char*  cmd, AModem  modem )
                         goto BadCommand;
 
                     modem->oper_name_index = (ANameIndex) format;
+                    amodem_snapshot_changed( modem );
                     return NULL;
                 }
             default:
@@ -1542,7 +2573,10 @@ handleRequestOperator( const char*  cmd, AModem  modem )
         return "+CME ERROR: 30";
 
     oper = modem->operators + modem->oper_index;
-    modem->oper_name_index = (ANameIndex) 2;
+    if (modem->oper_name_index != 2) {
+        modem->oper_name_index = (ANameIndex) 2;
+        amodem_snapshot_changed( modem );
+    }
     return amodem_printf( modem, "+COPS: 0,0,\"%s\"\r"
                           "+COPS: 0,1,\"%s\"\r"
                           "+COPS: 0,2,\"%s\"",
@@ -1560,6 +2594,7 @@ static const char*
 handleSendSMS( const char*  cmd, AModem  modem )
 {
     modem->wait_sms = 1;
+    amodem_snapshot_changed( modem );
     return "> ";
 }
 
@@ -1622,12 +2657,44 @@ smspdu_dump( SmsPDU  pdu, FILE*  out )
 }
 #endif
 
-static const char*
-handleSendSMSText( const char*  cmd, AModem  modem )
+/* drop the partial messages whose missing fragments never came, and wait
+ * for the next one to time out */
+static void
+amodem_sms_expire( void*  _modem )
 {
-#if 1
-    SmsAddressRec  address;
-    char           temp[16];
+    AModem     modem = (AModem) _modem;
+    long long  when  = -1;
+
+    if (modem->sms_receiver != NULL)
+        when = sms_receiver_expire( modem->sms_receiver );
+
+    if (when < 0)
+        sys_timer_unset( modem->sms_timer );
+    else
+        sys_timer_set( modem->sms_timer, when, amodem_sms_expire, modem );
+}
+
+/* replace the receiver of multipart messages, which can be NULL */
+static void
+amodem_set_sms_receiver( AModem  modem, SmsReceiver  receiver )
+{
+    if (modem->sms_receiver != NULL)
+        sms_receiver_destroy( modem->sms_receiver );
+
+    modem->sms_receiver = receiver;
+    amodem_snapshot_changed( modem );
+    if (receiver != NULL)
+        sms_receiver_set_limits( receiver, modem->sms_timeout,
+                                 modem->sms_max_messages, modem->sms_max_bytes );
+    amodem_sms_expire( modem );
+}
+
+static const char*
+handleSendSMSText( const char*  cmd, AModem  modem )
+{
+#if 1
+    SmsAddressRec  address;
+    char           temp[16];
     char           number[16];
     int            numlen;
     int            len = strlen(cmd);
@@ -1652,7 +2719,7 @@ handleSendSMSText( const char*  cmd, AModem  modem )
         int  index;
 
         numlen = sms_address_to_str( &address, temp, sizeof(temp) );
-        if (numlen > sizeof(temp)-1)
+        if (numlen > (int)sizeof(temp)-1)
             break;
         temp[numlen] = 0;
 
@@ -1678,11 +2745,12 @@ handleSendSMSText( const char*  cmd, AModem  modem )
             break;
 
         if (modem->sms_receiver == NULL) {
-            modem->sms_receiver = sms_receiver_create();
-            if (modem->sms_receiver == NULL) {
+            SmsReceiver  receiver = sms_receiver_create();
+            if (receiver == NULL) {
                 D( "%s: could not create SMS receiver\n", __FUNCTION__ );
                 break;
             }
+            amodem_set_sms_receiver( modem, receiver );
         }
 
         index = sms_receiver_add_submit_pdu( modem->sms_receiver, pdu );
@@ -1693,6 +2761,9 @@ handleSendSMSText( const char*  cmd, AModem  modem )
         /* the PDU is now owned by the receiver */
         pdu = NULL;
 
+        if (index == 0)
+            amodem_sms_expire( modem );
+
         if (index > 0) {
             SmsAddressRec  from[1];
             char           temp[12];
@@ -1834,14 +2905,28 @@ static const char*
 handleListCurrentCalls( const char*  cmd, AModem  modem )
 {
     int  nn;
+    AModemOut  out = modem->out;
     amodem_begin_line( modem );
     for (nn = 0; nn < modem->call_count; nn++) {
-        AVoiceCall  vcall = modem->calls + nn;
+        AVoiceCall  vcall = modem->calls[nn];
         ACall       call  = &vcall->call;
-        if (call->mode == A_CALL_VOICE)
-            amodem_add_line( modem, "+CLCC: %d,%d,%d,%d,%d,\"%s\",%d\r\n",
-                             call->id, call->dir, call->state, call->mode,
-                             call->multi, call->number, 129 );
+        if (call->mode != A_CALL_VOICE)
+            continue;
+
+        /* +CLCC: <id>,<dir>,<state>,<mode>,<multi>,"<number>",129 */
+        amodem_out_add_str( out, "+CLCC: " );
+        amodem_out_add_int( out, call->id );
+        amodem_out_add_c( out, ',' );
+        amodem_out_add_int( out, call->dir );
+        amodem_out_add_c( out, ',' );
+        amodem_out_add_int( out, call->state );
+        amodem_out_add_c( out, ',' );
+        amodem_out_add_int( out, call->mode );
+        amodem_out_add_c( out, ',' );
+        amodem_out_add_int( out, call->multi );
+        amodem_out_add_str( out, ",\"" );
+        amodem_out_add_str( out, call->number );
+        amodem_out_add_str( out, "\",129\r\n" );
     }
     return amodem_end_line( modem );
 }
@@ -1936,7 +3021,11 @@ handleListPDPContexts( const char*  cmd, AModem  modem )
         ADataContext  data = modem->data_contexts + nn;
         if (!data->active)
             continue;
-        amodem_add_line( modem, "+CGACT: %d,%d\r\n", data->id, data->active );
+        amodem_out_add_str( modem->out, "+CGACT: " );
+        amodem_out_add_int( modem->out, data->id );
+        amodem_out_add_c( modem->out, ',' );
+        amodem_out_add_int( modem->out, data->active );
+        amodem_out_add_str( modem->out, "\r\n" );
     }
     return amodem_end_line( modem );
 }
@@ -1977,7 +3066,7 @@ handleDefinePDPContext( const char*  cmd, AModem  modem )
             if (p == NULL)
                 goto BadCommand;
             len = (int)( p - cmd );
-            if (len > sizeof(apn)-1 )
+            if (len > (int)sizeof(apn)-1 )
                 len = sizeof(apn)-1;
             memcpy( apn, cmd, len );
             apn[len] = 0;
@@ -1989,61 +3078,113 @@ handleDefinePDPContext( const char*  cmd, AModem  modem )
         data->active = 1;
         data->type   = type;
         memcpy( data->apn, apn, sizeof(data->apn) );
+        amodem_snapshot_changed( modem );
     }
     return NULL;
 BadCommand:
     return "ERROR: BAD COMMAND";
 }
 
-void get_ip(char* addr)
+int
+amodem_set_network_interface( AModem  modem, const char*  name )
 {
-  int fd;
-  struct ifreq ifr;
-
-  fd = socket(AF_INET, SOCK_DGRAM, 0);
-
-  ifr.ifr_addr.sa_family = AF_INET;
-
-  strncpy(ifr.ifr_name, "eth2", IFNAMSIZ-1);
-
-  ioctl(fd, SIOCGIFADDR, &ifr);
-
-  close(fd);
+    if (modem->iface == NULL)
+        return -1;
+    return anetiface_set_name( modem->iface, name );
+}
 
-  strcpy(addr, inet_ntoa(((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr));
+static const char*
+amodem_network_interface( AModem  modem )
+{
+    return modem->iface ? anetiface_get_name( modem->iface ) : NETWORK_INTERFACE;
 }
 
 static const char*
 handleQueryPDPContext( const char* cmd, AModem modem )
 {
-    char ip[16];
-    int  nn;
-    memset(ip, 0, 16);
-    get_ip(ip);
+    /* the address is kept up to date by netlink notifications */
+    const char*  ip = modem->iface ? anetiface_get_address( modem->iface ) : "";
+    int          nn;
+
     amodem_begin_line(modem);
-    D("IP found for interface %s: %s", NETWORK_INTERFACE, ip);
+    D("IP found for interface %s: %s", amodem_network_interface(modem), ip);
     for (nn = 0; nn < MAX_DATA_CONTEXTS; nn++) {
         ADataContext  data = modem->data_contexts + nn;
         if (!data->active)
             continue;
-        amodem_add_line( modem, "+CGDCONT: %d,\"%s\",\"%s\",\"%s\",0,0\r\n",
-                         data->id,
-                         data->type == A_DATA_IP ? "IP" : "PPP",
-                         data->apn,
-                         /* Note: For now, hard-code the IP address of our
-                          *       network interface
-                          */
-                         data->type == A_DATA_IP ? ip : "");
+        /* +CGDCONT: <id>,"<type>","<apn>","<address>",0,0 */
+        amodem_out_add_str( modem->out, "+CGDCONT: " );
+        amodem_out_add_int( modem->out, data->id );
+        amodem_out_add_str( modem->out, data->type == A_DATA_IP ? ",\"IP\",\"" : ",\"PPP\",\"" );
+        amodem_out_add_str( modem->out, data->apn );
+        amodem_out_add_str( modem->out, "\",\"" );
+        /* Note: For now, hard-code the IP address of our
+         *       network interface
+         */
+        if (data->type == A_DATA_IP)
+            amodem_out_add_str( modem->out, ip );
+        amodem_out_add_str( modem->out, "\",0,0\r\n" );
     }
     return amodem_end_line(modem);
 }
 
+/* send the final result of the command that started the hook, if it
+ * is still waiting for it */
+static void
+amodem_hook_answer( AModem  modem )
+{
+    AModemAnswerFunc  func = modem->hook_answer;
+
+    if (func != NULL) {
+        modem->hook_answer = NULL;
+        R( ">> OK (deferred)\n" );
+        func( modem->hook_answer_opaque, "OK" );
+    }
+}
+
+static void
+amodem_hook_exited( void*  _modem, int  status )
+{
+    AModem  modem = (AModem) _modem;
+
+    D("netcfg returned %d", status);
+    modem->hook = NULL;
+    amodem_hook_answer( modem );
+}
+
+/* run "netcfg <interface> <action>" without blocking the event loop. when
+ * it is started by a single command, its final result is only sent once
+ * the hook exits, see amodem_send_line() */
+static void
+amodem_run_hook( AModem  modem, const char*  action )
+{
+    char*  argv[4];
+
+    /* a client that didn't wait for the previous answer gets it now */
+    if (modem->hook != NULL) {
+        sys_process_detach( modem->hook );
+        modem->hook = NULL;
+        amodem_hook_answer( modem );
+    }
+
+    argv[0] = (char*) "netcfg";
+    argv[1] = (char*) amodem_network_interface(modem);
+    argv[2] = (char*) action;
+    argv[3] = NULL;
+
+    modem->hook = sys_process_spawn( argv, amodem_hook_exited, modem );
+    if (modem->hook == NULL) {
+        D("could not start netcfg %s: %s", action, strerror(errno));
+        return;
+    }
+    modem->hook_started = 1;
+}
+
 static const char*
 handleEnablePDPContext( const char*  cmd, AModem  modem )
 {
     /* XXX: TODO: handle PDP start appropriately */
-    int status = system("netcfg "NETWORK_INTERFACE" up");
-    D("netcfg up returned %d", status);
+    amodem_run_hook( modem, "up" );
     return NULL;
 }
 
@@ -2052,8 +3193,6 @@ static const char*
 handleDisablePDPContext( const char*  cmd, AModem  modem )
 {
     /* XXX: TODO: handle PDP deactivate appropriately */
-    int status = 0; //system("netcfg "NETWORK_INTERFACE" down");
-    D("netcfg down returned %d", status);
     memset(modem->data_contexts, 0, sizeof(modem->data_contexts));
     return NULL;
 }
@@ -2063,8 +3202,7 @@ static const char*
 handleStartPDPContext( const char*  cmd, AModem  modem )
 {
     /* XXX: TODO: handle PDP start appropriately */
-    int status = system("netcfg "NETWORK_INTERFACE" dhcp");
-    D("netcfg dhcp returned %d", status);
+    amodem_run_hook( modem, "dhcp" );
     return NULL;
 }
 
@@ -2082,6 +3220,7 @@ remote_voice_call_event( void*  _vcall, int  success )
         /* aargh, the remote emulator probably quitted at that point */
         amodem_free_call(modem, vcall);
         amodem_send_calls_update(modem);
+        amodem_publish_state(modem);
     }
 }
 
@@ -2091,6 +3230,7 @@ voice_call_event( void*  _vcall )
 {
     AVoiceCall  vcall = (AVoiceCall) _vcall;
     ACall       call  = &vcall->call;
+    AModem      modem = vcall->modem;   /* vcall may be freed below */
 
     switch (call->state) {
         case A_CALL_DIALING:
@@ -2122,7 +3262,8 @@ voice_call_event( void*  _vcall )
         default:
             assert( 0 && "unreachable event call state" );
     }
-    amodem_send_calls_update(vcall->modem);
+    amodem_send_calls_update(modem);
+    amodem_publish_state(modem);
 }
 
 static int amodem_is_emergency( AModem modem, const char *number )
@@ -2143,12 +3284,14 @@ static const char*
 handleDial( const char*  cmd, AModem  modem )
 {
     AVoiceCall  vcall = amodem_alloc_call( modem );
-    ACall       call  = &vcall->call;
+    ACall       call;
     int         len;
 
-    if (call == NULL)
+    if (vcall == NULL)
         return "ERROR: TOO MANY CALLS";
 
+    call = &vcall->call;
+
     assert( cmd[0] == 'D' );
     call->dir   = A_CALL_OUTBOUND;
     call->state = A_CALL_DIALING;
@@ -2159,7 +3302,7 @@ handleDial( const char*  cmd, AModem  modem )
     len  = strlen(cmd);
     if (len > 0 && cmd[len-1] == ';')
         len--;
-    if (len >= sizeof(call->number))
+    if (len >= (int)sizeof(call->number))
         len = sizeof(call->number)-1;
 
     /* Converts 4, 7, and 10 digits number to 11 digits */
@@ -2179,10 +3322,12 @@ handleDial( const char*  cmd, AModem  modem )
         memcpy( call->number, cmd, len );
         call->number[len] = 0;
     }
+    amodem_index_call( modem, vcall );
 
     amodem_begin_line( modem );
     if (amodem_is_emergency(modem, call->number)) {
         modem->in_emergency_mode = 1;
+        amodem_snapshot_changed( modem );
         amodem_add_line( modem, "+WSOS: 1" );
     }
     vcall->is_remote = (remote_number_string_to_port(call->number) > 0);
@@ -2200,7 +3345,7 @@ handleAnswer( const char*  cmd, AModem  modem )
 {
     int  nn;
     for (nn = 0; nn < modem->call_count; nn++) {
-        AVoiceCall  vcall = modem->calls + nn;
+        AVoiceCall  vcall = modem->calls[nn];
         ACall       call  = &vcall->call;
 
         if (cmd[0] == 'A') {
@@ -2224,9 +3369,503 @@ handleAnswer( const char*  cmd, AModem  modem )
 int android_snapshot_update_time = 1;
 int android_snapshot_update_time_request = 0;
 
+
+/** SNAPSHOTS
+ **
+ ** the modem state is saved as a header followed by one section per
+ ** module. loading parses everything once into scratch storage first, so
+ ** that a truncated or corrupted file leaves the modem untouched, then
+ ** applies it.
+ **/
+#define  SNAPSHOT_MAGIC     "AMSN"
+#define  SNAPSHOT_VERSION   1
+
+enum {
+    SNAPSHOT_SECTION_MODEM = 1,
+    SNAPSHOT_SECTION_CALLS,
+    SNAPSHOT_SECTION_SIM,
+    SNAPSHOT_SECTION_SMS
+};
+
+/* the signal values are saved as a count followed by the fields, in this
+ * order. new fields must be added at the end */
+#define  SNAPSHOT_SIGNAL_FIELDS  13
+
+static void
+amodem_signal_to_fields( const ASignalValuesRec*  v, int*  field )
+{
+    field[0]  = v->gsm_rssi;
+    field[1]  = v->gsm_ber;
+    field[2]  = v->cdma_dbm;
+    field[3]  = v->cdma_ecio;
+    field[4]  = v->evdo_dbm;
+    field[5]  = v->evdo_ecio;
+    field[6]  = v->evdo_snr;
+    field[7]  = v->lte_rssi;
+    field[8]  = v->lte_rsrp;
+    field[9]  = v->lte_rsrq;
+    field[10] = v->lte_rssnr;
+    field[11] = v->lte_cqi;
+    field[12] = v->lte_timing;
+}
+
+static void
+amodem_signal_from_fields( ASignalValuesRec*  v, const int*  field )
+{
+    v->gsm_rssi   = field[0];
+    v->gsm_ber    = field[1];
+    v->cdma_dbm   = field[2];
+    v->cdma_ecio  = field[3];
+    v->evdo_dbm   = field[4];
+    v->evdo_ecio  = field[5];
+    v->evdo_snr   = field[6];
+    v->lte_rssi   = field[7];
+    v->lte_rsrp   = field[8];
+    v->lte_rsrq   = field[9];
+    v->lte_rssnr  = field[10];
+    v->lte_cqi    = field[11];
+    v->lte_timing = field[12];
+}
+
+static void
+amodem_save_state( AModem  modem, SnapshotWriter  w )
+{
+    int  nn, mm;
+
+    snapshot_put_uint( w, modem->supportsNetworkDataType );
+    snapshot_put_uint( w, modem->radio_state );
+    snapshot_put_int ( w, modem->area_code );
+    snapshot_put_int ( w, modem->cell_id );
+    snapshot_put_uint( w, amodem_signal_level( modem ) );
+    snapshot_put_uint( w, modem->wait_sms );
+
+    snapshot_put_uint( w, modem->voice_mode );
+    snapshot_put_uint( w, modem->voice_state );
+    snapshot_put_uint( w, modem->data_mode );
+    snapshot_put_uint( w, modem->data_state );
+    snapshot_put_uint( w, modem->data_network );
+
+    snapshot_put_uint( w, modem->oper_selection_mode );
+    snapshot_put_uint( w, modem->oper_name_index );
+    snapshot_put_int ( w, modem->oper_index );
+    snapshot_put_uint( w, modem->oper_count );
+    for (nn = 0; nn < MAX_OPERATORS; nn++) {
+        AOperator  oper = &modem->operators[nn];
+
+        snapshot_put_uint( w, oper->status );
+        for (mm = 0; mm < A_NAME_MAX; mm++)
+            snapshot_put_str( w, oper->name[mm] );
+    }
+
+    for (nn = 0; nn < MAX_DATA_CONTEXTS; nn++) {
+        ADataContext  data = &modem->data_contexts[nn];
+
+        snapshot_put_int ( w, data->id );
+        snapshot_put_uint( w, data->active );
+        snapshot_put_uint( w, data->type );
+        snapshot_put_str ( w, data->apn );
+    }
+
+    snapshot_put_uint( w, modem->technology );
+    snapshot_put_int ( w, modem->preferred_mask );
+    snapshot_put_uint( w, modem->subscription_source );
+    snapshot_put_uint( w, modem->roaming_pref );
+    snapshot_put_uint( w, modem->in_emergency_mode );
+    snapshot_put_int ( w, modem->prl_version );
+
+    /* appended to version 1, the exact signal values */
+    {
+        int  field[ SNAPSHOT_SIGNAL_FIELDS ];
+
+        amodem_signal_to_fields( asignal_get_values( modem->signal ), field );
+        snapshot_put_uint( w, SNAPSHOT_SIGNAL_FIELDS );
+        for (nn = 0; nn < SNAPSHOT_SIGNAL_FIELDS; nn++)
+            snapshot_put_int( w, field[nn] );
+    }
+}
+
+/* parse the MODEM section into 'modem', only scalar fields are written.
+ * the signal values go to 'signal' */
+static int
+amodem_load_state( AModem  modem, SnapshotReader  r, ASignalValuesRec*  signal )
+{
+    unsigned  level;
+    int       nn, mm;
+
+    modem->supportsNetworkDataType = snapshot_get_uint( r );
+    modem->radio_state  = (ARadioState) snapshot_get_uint( r );
+    modem->area_code    = snapshot_get_int( r );
+    modem->cell_id      = snapshot_get_int( r );
+    level               = snapshot_get_uint( r );
+    modem->wait_sms     = snapshot_get_uint( r );
+
+    modem->voice_mode   = (ARegistrationUnsolMode) snapshot_get_uint( r );
+    modem->voice_state  = (ARegistrationState) snapshot_get_uint( r );
+    modem->data_mode    = (ARegistrationUnsolMode) snapshot_get_uint( r );
+    modem->data_state   = (ARegistrationState) snapshot_get_uint( r );
+    modem->data_network = (ADataNetworkType) snapshot_get_uint( r );
+
+    modem->oper_selection_mode = (AOperatorSelection) snapshot_get_uint( r );
+    modem->oper_name_index     = (ANameIndex) snapshot_get_uint( r );
+    modem->oper_index          = snapshot_get_int( r );
+    modem->oper_count          = snapshot_get_uint( r );
+    for (nn = 0; nn < MAX_OPERATORS; nn++) {
+        AOperator  oper = &modem->operators[nn];
+
+        oper->status = (AOperatorStatus) snapshot_get_uint( r );
+        for (mm = 0; mm < A_NAME_MAX; mm++)
+            snapshot_get_str( r, oper->name[mm], sizeof(oper->name[mm]) );
+    }
+
+    for (nn = 0; nn < MAX_DATA_CONTEXTS; nn++) {
+        ADataContext  data = &modem->data_contexts[nn];
+
+        data->id     = snapshot_get_int( r );
+        data->active = snapshot_get_uint( r );
+        data->type   = (ADataType) snapshot_get_uint( r );
+        snapshot_get_str( r, data->apn, sizeof(data->apn) );
+    }
+
+    modem->technology          = (AModemTech) snapshot_get_uint( r );
+    modem->preferred_mask      = snapshot_get_int( r );
+    modem->subscription_source = (ACdmaSubscriptionSource) snapshot_get_uint( r );
+    modem->roaming_pref        = (ACdmaRoamingPref) snapshot_get_uint( r );
+    modem->in_emergency_mode   = snapshot_get_uint( r );
+    modem->prl_version         = snapshot_get_int( r );
+
+    if (level > GREAT)
+        return -1;
+
+    /* older snapshots only have the level, and the fields missing from
+     * the list keep the value it gives. those we don't know are skipped */
+    *signal = NET_PROFILES[level];
+    if (r->data < r->end) {
+        int       field[ SNAPSHOT_SIGNAL_FIELDS ];
+        unsigned  count = snapshot_get_uint( r );
+        unsigned  kk;
+
+        if (count > 64)
+            return -1;
+
+        amodem_signal_to_fields( signal, field );
+        for (kk = 0; kk < count; kk++) {
+            int  value = snapshot_get_int( r );
+
+            if (kk < SNAPSHOT_SIGNAL_FIELDS)
+                field[kk] = value;
+        }
+        amodem_signal_from_fields( signal, field );
+    }
+
+    if (r->error                                   ||
+        (unsigned)modem->oper_count > MAX_OPERATORS ||
+        (unsigned)modem->oper_name_index >= A_NAME_MAX)
+        return -1;
+
+    return 0;
+}
+
+static void
+amodem_save_calls( AModem  modem, SnapshotWriter  w )
+{
+    int  nn;
+
+    snapshot_put_uint( w, modem->max_calls );
+    snapshot_put_uint( w, modem->call_count );
+
+    for (nn = 0; nn < modem->call_count; nn++) {
+        AVoiceCall  vcall = modem->calls[nn];
+        ACall       call  = &vcall->call;
+
+        snapshot_put_uint( w, call->id );
+        snapshot_put_uint( w, call->dir );
+        snapshot_put_uint( w, call->state );
+        snapshot_put_uint( w, call->mode );
+        snapshot_put_uint( w, call->multi );
+        snapshot_put_str ( w, call->number );
+        snapshot_put_uint( w, vcall->is_remote );
+    }
+}
+
+/* parse the CALLS section into a malloc()-ed array of records, in
+ * creation order. ids must be unique and fit in the table */
+static int
+amodem_load_calls( SnapshotReader  r, int*  pmax, AVoiceCallRec**  pcalls, int*  pcount )
+{
+    unsigned        max   = snapshot_get_uint( r );
+    unsigned        count = snapshot_get_uint( r );
+    AVoiceCallRec*  calls;
+    char*           used;
+    unsigned        nn;
+
+    if (r->error || max < 1 || max > MAX_CALLS_LIMIT || count > max)
+        return -1;
+
+    calls = (AVoiceCallRec*) calloc( count + 1, sizeof(*calls) );
+    used  = (char*) calloc( max + 1, 1 );
+    if (calls == NULL || used == NULL)
+        goto Fail;
+
+    for (nn = 0; nn < count; nn++) {
+        ACall  call = &calls[nn].call;
+
+        call->id    = snapshot_get_uint( r );
+        call->dir   = (ACallDir) snapshot_get_uint( r );
+        call->state = (ACallState) snapshot_get_uint( r );
+        call->mode  = (ACallMode) snapshot_get_uint( r );
+        call->multi = snapshot_get_uint( r );
+        snapshot_get_str( r, call->number, sizeof(call->number) );
+        calls[nn].is_remote = (snapshot_get_uint( r ) != 0);
+
+        if (r->error || call->id < 1 || (unsigned)call->id > max || used[call->id])
+            goto Fail;
+        used[call->id] = 1;
+    }
+    free( used );
+
+    *pmax   = max;
+    *pcalls = calls;
+    *pcount = count;
+    return 0;
+
+Fail:
+    free( calls );
+    free( used );
+    return -1;
+}
+
+static void
+amodem_snapshot_write( AModem  modem, SnapshotWriter  w )
+{
+    int  section;
+
+    snapshot_put_raw( w, SNAPSHOT_MAGIC, 4 );
+    snapshot_put_uint( w, SNAPSHOT_VERSION );
+
+    section = snapshot_begin_section( w, SNAPSHOT_SECTION_MODEM );
+    amodem_save_state( modem, w );
+    snapshot_end_section( w, section );
+
+    section = snapshot_begin_section( w, SNAPSHOT_SECTION_CALLS );
+    amodem_save_calls( modem, w );
+    snapshot_end_section( w, section );
+
+    section = snapshot_begin_section( w, SNAPSHOT_SECTION_SIM );
+    asimcard_save( modem->sim, w );
+    snapshot_end_section( w, section );
+
+    if (modem->sms_receiver != NULL) {
+        section = snapshot_begin_section( w, SNAPSHOT_SECTION_SMS );
+        sms_receiver_save( modem->sms_receiver, w );
+        snapshot_end_section( w, section );
+    }
+}
+
+/* remember the current state as the last snapshot */
+static void
+amodem_snapshot_mark_clean( AModem  modem )
+{
+    modem->saved_gen     = modem->snapshot_gen;
+    modem->saved_sim_gen = asimcard_get_generation( modem->sim );
+    modem->saved_sms_gen = modem->sms_receiver ? sms_receiver_get_generation( modem->sms_receiver ) : 0;
+    modem->saved_valid   = 1;
+}
+
+int
+amodem_snapshot_save( AModem  modem, const char*  path )
+{
+    SnapshotWriterRec  w[1];
+    int                ret;
+
+    snapshot_writer_init( w );
+    amodem_snapshot_write( modem, w );
+
+    ret = snapshot_write_file( w, path );
+    if (ret < 0)
+        D( "%s: could not write snapshot to %s\n", __FUNCTION__, path );
+    else
+        amodem_snapshot_mark_clean( modem );
+
+    snapshot_writer_done( w );
+    return ret;
+}
+
+int
+amodem_snapshot_is_dirty( AModem  modem )
+{
+    if (!modem->saved_valid || modem->saved_gen != modem->snapshot_gen)
+        return 1;
+
+    if (modem->saved_sim_gen != asimcard_get_generation( modem->sim ))
+        return 1;
+
+    return modem->sms_receiver != NULL &&
+           modem->saved_sms_gen != sms_receiver_get_generation( modem->sms_receiver );
+}
+
+int
+amodem_snapshot_load( AModem  modem, const char*  path )
+{
+    SnapshotReaderRec  r[1], section[1];
+    SnapshotReaderRec  state_r[1], sim_r[1];
+    AModemRec          state[1];
+    ASignalValuesRec   signal[1];
+    ASimCard           sim      = NULL;
+    SmsReceiver        receiver = NULL;
+    AVoiceCallRec*     calls    = NULL;
+    ACallTablesRec     tables[1];
+    int                call_count = 0, max_calls = 0;
+    int                has_state = 0, has_calls = 0, has_sim = 0;
+    void*              data;
+    const char*        magic;
+    int                size, tag, nn;
+
+    data = snapshot_read_file( path, &size );
+    if (data == NULL)
+        return -1;
+
+    snapshot_reader_init( r, data, size );
+    magic = (const char*) snapshot_get_raw( r, 4 );
+    if (magic == NULL || memcmp( magic, SNAPSHOT_MAGIC, 4 ) != 0 ||
+        snapshot_get_uint( r ) != SNAPSHOT_VERSION || r->error) {
+        D( "%s: %s is not a valid modem snapshot\n", __FUNCTION__, path );
+        goto Fail;
+    }
+
+    /* first pass, parse everything without touching the modem */
+    sim = asimcard_create( modem->base_port );
+    if (sim == NULL)
+        goto Fail;
+
+    while ((tag = snapshot_next_section( r, section )) >= 0) {
+        switch (tag) {
+            case SNAPSHOT_SECTION_MODEM:
+                state[0]   = modem[0];
+                state_r[0] = section[0];
+                if (amodem_load_state( state, section, signal ) < 0)
+                    goto Fail;
+                has_state = 1;
+                break;
+
+            case SNAPSHOT_SECTION_CALLS:
+                free( calls );
+                calls = NULL;
+                if (amodem_load_calls( section, &max_calls, &calls, &call_count ) < 0)
+                    goto Fail;
+                has_calls = 1;
+                break;
+
+            case SNAPSHOT_SECTION_SIM:
+                sim_r[0] = section[0];
+                if (asimcard_load( sim, section ) < 0)
+                    goto Fail;
+                has_sim = 1;
+                break;
+
+            case SNAPSHOT_SECTION_SMS:
+                if (receiver != NULL)
+                    sms_receiver_destroy( receiver );
+                receiver = sms_receiver_load( section );
+                if (receiver == NULL)
+                    goto Fail;
+                break;
+
+            default:  /* written by a newer version, skip it */
+                break;
+        }
+    }
+    if (r->error) {
+        D( "%s: %s is truncated\n", __FUNCTION__, path );
+        goto Fail;
+    }
+
+    /* the new call tables and records are allocated before the current
+     * calls are dropped, so that a failure leaves them untouched */
+    if (has_calls) {
+        if (amodem_call_tables_alloc( tables, max_calls ) < 0)
+            goto Fail;
+
+        for (nn = 0; nn < call_count; nn++) {
+            tables->calls[nn] = (AVoiceCall) calloc( 1, sizeof(AVoiceCallRec) );
+            if (tables->calls[nn] == NULL) {
+                while (nn > 0)
+                    free( tables->calls[--nn] );
+                free( tables->calls );
+                free( tables->by_id );
+                free( tables->by_number );
+                goto Fail;
+            }
+        }
+    }
+
+    /* second pass, apply it */
+    if (has_calls) {
+        while (modem->call_count > 0)
+            amodem_free_call( modem, modem->calls[ modem->call_count - 1 ] );
+
+        for (nn = 0; nn < call_count; nn++) {
+            AVoiceCall  vcall = tables->calls[nn];
+
+            vcall->call      = calls[nn].call;
+            vcall->is_remote = calls[nn].is_remote;
+            vcall->modem     = modem;
+            vcall->seq       = ++modem->call_seq;
+        }
+        amodem_call_tables_install( modem, tables, call_count );
+
+        for (nn = 0; nn < call_count; nn++) {
+            AVoiceCall  vcall = modem->calls[nn];
+
+            /* calls that were still being set up resume where they were */
+            if (vcall->call.state == A_CALL_DIALING ||
+                (vcall->call.state == A_CALL_ALERTING && !vcall->is_remote))
+            {
+                int  delay = (vcall->call.state == A_CALL_DIALING) ? CALL_DELAY_DIAL
+                                                                   : CALL_DELAY_ALERT;
+                vcall->timer = sys_timer_create();
+                sys_timer_set( vcall->timer, sys_time_ms() + delay,
+                               voice_call_event, vcall );
+            }
+        }
+    }
+
+    if (has_state) {
+        amodem_load_state( modem, state_r, signal );
+
+        /* keep the configured trace or random walk running */
+        asignal_set_values( modem->signal, signal );
+        amodem_signal_start( modem );
+    }
+
+    if (has_sim)
+        asimcard_load( modem->sim, sim_r );
+
+    amodem_set_sms_receiver( modem, receiver );
+
+    free( calls );
+    asimcard_destroy( sim );
+    free( data );
+
+    /* the guest clock may have moved a lot, send it the time again */
+    android_snapshot_update_time_request = 1;
+    amodem_publish_state( modem );
+    amodem_snapshot_mark_clean( modem );
+    return 0;
+
+Fail:
+    if (receiver != NULL)
+        sms_receiver_destroy( receiver );
+    free( calls );
+    asimcard_destroy( sim );
+    free( data );
+    return -1;
+}
+
 static const char*
 handleSignalStrength( const char*  cmd, AModem  modem )
 {
+    AModemOut  csq;
+
     amodem_begin_line( modem );
 
     /* Sneak time updates into the SignalStrength request, because it's periodic.
@@ -2238,16 +3877,9 @@ handleSignalStrength( const char*  cmd, AModem  modem )
       android_snapshot_update_time_request = 0;
     }
 
-    // rssi = 0 (<-113dBm) 1 (<-111) 2-30 (<-109--53) 31 (>=-51) 99 (?!)
-    // ber (bit error rate) - always 99 (unknown), apparently.
-    // TODO: return 99 if modem->radio_state==A_RADIO_STATE_OFF, once radio_state is in snapshot.
-    signal_t current_signal = NET_PROFILES[modem->signal];
-    amodem_add_line(modem, "+CSQ: %i,%i,%i,%i,%i,%i,%i,%i,%i,%i,%i,%i\r\n",
-                    current_signal.gsm_rssi, current_signal.gsm_ber,
-                    current_signal.cdma_dbm, current_signal.cdma_ecio,
-                    current_signal.evdo_dbm, current_signal.evdo_ecio, current_signal.evdo_snr,
-                    current_signal.lte_rssi, current_signal.lte_rsrp, current_signal.lte_rsrq,
-                    current_signal.lte_rssnr, current_signal.lte_cqi, current_signal.lte_timing);
+    csq = amodem_signal_csq( modem );
+    amodem_out_add( modem->out, csq->data, csq->size );
+    amodem_out_add_str( modem->out, "\r\n" );
     return amodem_end_line( modem );
 }
 
@@ -2260,7 +3892,7 @@ handleHangup( const char*  cmd, AModem  modem )
         switch (cmd[0]) {
             case '0':  /* release all held, and set busy for waiting calls */
                 for (nn = 0; nn < modem->call_count; nn++) {
-                    AVoiceCall  vcall = modem->calls + nn;
+                    AVoiceCall  vcall = modem->calls[nn];
                     ACall       call  = &vcall->call;
                     if (call->mode != A_CALL_VOICE)
                         continue;
@@ -2276,7 +3908,7 @@ handleHangup( const char*  cmd, AModem  modem )
             case '1':
                 if (cmd[1] == 0) { /* release all active, accept held one */
                     for (nn = 0; nn < modem->call_count; nn++) {
-                        AVoiceCall  vcall = modem->calls + nn;
+                        AVoiceCall  vcall = modem->calls[nn];
                         ACall       call  = &vcall->call;
                         if (call->mode != A_CALL_VOICE)
                             continue;
@@ -2290,7 +3922,7 @@ handleHangup( const char*  cmd, AModem  modem )
                         }
                     }
                 } else {  /* release specific call */
-                    int  id = cmd[1] - '0';
+                    int  id = atoi( cmd + 1 );
                     AVoiceCall  vcall = amodem_find_call( modem, id );
                     if (vcall != NULL)
                         amodem_free_call( modem, vcall );
@@ -2300,7 +3932,7 @@ handleHangup( const char*  cmd, AModem  modem )
             case '2':
                 if (cmd[1] == 0) {  /* place all active on hold, accept held or waiting one */
                     for (nn = 0; nn < modem->call_count; nn++) {
-                        AVoiceCall  vcall = modem->calls + nn;
+                        AVoiceCall  vcall = modem->calls[nn];
                         ACall       call  = &vcall->call;
                         if (call->mode != A_CALL_VOICE)
                             continue;
@@ -2313,9 +3945,9 @@ handleHangup( const char*  cmd, AModem  modem )
                         }
                     }
                 } else {  /* place all active on hold, except a specific one */
-                    int   id = cmd[1] - '0';
+                    int   id = atoi( cmd + 1 );
                     for (nn = 0; nn < modem->call_count; nn++) {
-                        AVoiceCall  vcall = modem->calls + nn;
+                        AVoiceCall  vcall = modem->calls[nn];
                         ACall       call  = &vcall->call;
                         if (call->mode != A_CALL_VOICE)
                             continue;
@@ -2328,7 +3960,7 @@ handleHangup( const char*  cmd, AModem  modem )
 
             case '3':  /* add a held call to the conversation */
                 for (nn = 0; nn < modem->call_count; nn++) {
-                    AVoiceCall  vcall = modem->calls + nn;
+                    AVoiceCall  vcall = modem->calls[nn];
                     ACall       call  = &vcall->call;
                     if (call->mode != A_CALL_VOICE)
                         continue;
@@ -2341,7 +3973,7 @@ handleHangup( const char*  cmd, AModem  modem )
 
             case '4':  /* connect the two calls */
                 for (nn = 0; nn < modem->call_count; nn++) {
-                    AVoiceCall  vcall = modem->calls + nn;
+                    AVoiceCall  vcall = modem->calls[nn];
                     ACall       call  = &vcall->call;
                     if (call->mode != A_CALL_VOICE)
                         continue;
@@ -2361,7 +3993,9 @@ handleHangup( const char*  cmd, AModem  modem )
 
 
 /* a function used to deal with a non-trivial request */
-typedef const char*  (*ResponseHandler)(const char*  cmd, AModem  modem);
+typedef AModemHandler  ResponseHandler;
+
+static const char*  handleCommandStats( const char*  cmd, AModem  modem );
 
 static const struct {
     const char*      cmd;     /* command coming from libreference-ril.so, if first
@@ -2491,19 +4125,567 @@ static const struct {
     { "%CPI=3", NULL, NULL },
     { "%CSTAT=1", NULL, NULL },
 
+    /* per-command statistics, see amodem_get_command_stats() */
+    { "!%STATS", NULL, handleCommandStats },
+
     /* end of list */
     {NULL, NULL, NULL}
 };
 
+#define  DEFAULT_RESPONSES_COUNT  (sizeof(sDefaultResponses)/sizeof(sDefaultResponses[0]) - 1)
+
+/* the runtime command table: the entries of sDefaultResponses followed by
+ * the ones added through amodem_register_handler(), in match order */
+typedef struct {
+    const char*      cmd;     /* without the '!' prefix marker */
+    int              len;
+    int              prefix;  /* 1 if 'cmd' is only a prefix */
+    const char*      answer;
+    ResponseHandler  handler;
+    const char*      reply;   /* 'answer' rendered with its final OK, or NULL */
+
+    /* statistics, see amodem_get_command_stats() */
+    unsigned            calls;
+    unsigned            errors;
+    unsigned long long  bytes_out;
+    unsigned long long  total_ns;
+    unsigned            latency[ AMODEM_STATS_BUCKETS ];
+} AModemCommandRec, *AModemCommand;
+
+static AModemCommandRec*  sCommands;
+static int                sCommandsCount;
+static int                sCommandsMax;
+static char*              sDefaultRepliesData;
+
+/* the dispatch index, an open-addressing hash table of command indices
+ * keyed on (cmd, len, prefix), -1 marks empty slots. since a prefix entry
+ * can only match the first 'len' characters of a command, the lookup probes
+ * once per distinct prefix length, recorded as bits of sPrefixLengths */
+#define  MAX_PREFIX_LENGTH  64
+
+static int*               sCommandIndex;
+static unsigned           sCommandIndexMask;
+static uint64_t           sPrefixLengths;
+
+static unsigned
+amodem_command_hash( const char*  cmd, int  len, int  prefix )
+{
+    unsigned  h = 2166136261U ^ (unsigned)prefix;
+
+    while (len-- > 0)
+        h = (h ^ (unsigned char)*cmd++) * 16777619U;
+
+    return h;
+}
+
+static int
+amodem_index_rebuild( void )
+{
+    unsigned  size = 16;
+    int*      index;
+    int       nn;
+
+    while (size < (unsigned)sCommandsCount * 2)
+        size <<= 1;
+
+    index = (int*) malloc( size * sizeof(int) );
+    if (index == NULL)
+        return -1;
+
+    memset( index, 0xff, size * sizeof(int) );
+    sPrefixLengths = 0;
+
+    /* entries are inserted in table order, so the first one found along
+     * a probe sequence is also the first one in the table */
+    for (nn = 0; nn < sCommandsCount; nn++) {
+        AModemCommand  c = &sCommands[nn];
+        unsigned       h = amodem_command_hash( c->cmd, c->len, c->prefix ) & (size - 1);
+
+        while (index[h] >= 0)
+            h = (h + 1) & (size - 1);
+
+        index[h] = nn;
+        if (c->prefix)
+            sPrefixLengths |= (uint64_t)1 << c->len;
+    }
+
+    free( sCommandIndex );
+    sCommandIndex     = index;
+    sCommandIndexMask = size - 1;
+    return 0;
+}
+
+static int
+amodem_index_find( const char*  cmd, int  len, int  prefix )
+{
+    unsigned  h;
+    int       nn;
+
+    if (sCommandIndex == NULL)
+        return -1;
+
+    h = amodem_command_hash( cmd, len, prefix ) & sCommandIndexMask;
+    while ((nn = sCommandIndex[h]) >= 0) {
+        AModemCommand  c = &sCommands[nn];
+
+        if (c->len == len && c->prefix == prefix && !memcmp( c->cmd, cmd, len ))
+            return nn;
+
+        h = (h + 1) & sCommandIndexMask;
+    }
+    return -1;
+}
+
+/* build the runtime command table from sDefaultResponses, and render the
+ * fixed answers together with their final OK so that amodem_send() can
+ * return them as-is */
+static int
+amodem_init_commands( void )
+{
+    unsigned  nn;
+    int       total = 0;
+    char*     p;
+
+    if (sCommands != NULL)
+        return 0;
+
+    sCommandsMax = DEFAULT_RESPONSES_COUNT + 16;
+    sCommands    = (AModemCommandRec*) calloc( sCommandsMax, sizeof(AModemCommandRec) );
+    if (sCommands == NULL)
+        return -1;
+
+    for (nn = 0; nn < DEFAULT_RESPONSES_COUNT; nn++) {
+        AModemCommand  c    = &sCommands[nn];
+        const char*    scmd = sDefaultResponses[nn].cmd;
+
+        c->prefix  = (scmd[0] == '!');
+        c->cmd     = scmd + c->prefix;
+        c->len     = strlen( c->cmd );
+        c->answer  = sDefaultResponses[nn].answer;
+        c->handler = sDefaultResponses[nn].handler;
+
+        if (c->answer != NULL)
+            total += strlen( c->answer ) + sizeof(AMODEM_OK_SUFFIX);
+    }
+    sCommandsCount = DEFAULT_RESPONSES_COUNT;
+
+    sDefaultRepliesData = p = (char*) malloc( total + 1 );
+    if (p != NULL) {
+        for (nn = 0; nn < DEFAULT_RESPONSES_COUNT; nn++) {
+            AModemCommand  c = &sCommands[nn];
+            int            len;
+
+            if (c->answer == NULL)
+                continue;
+
+            len = strlen( c->answer );
+            memcpy( p, c->answer, len );
+            memcpy( p + len, AMODEM_OK_SUFFIX, sizeof(AMODEM_OK_SUFFIX) );
+
+            c->reply = p;
+            p       += len + sizeof(AMODEM_OK_SUFFIX);
+        }
+    }
+
+    return amodem_index_rebuild();
+}
+
+int
+amodem_register_handler( const char*  cmd, AModemHandler  handler, int  flags )
+{
+    int            prefix = (flags & AMODEM_HANDLER_PREFIX) != 0;
+    int            len, nn;
+    AModemCommand  c;
+
+    if (cmd == NULL || handler == NULL || amodem_init_commands() < 0)
+        return -1;
+
+    len = strlen( cmd );
+    if (prefix && len >= MAX_PREFIX_LENGTH) {
+        D( "%s: prefix too long: %s", __FUNCTION__, cmd );
+        return -1;
+    }
+
+    nn = amodem_index_find( cmd, len, prefix );
+    if (nn >= 0) {
+        if ( !(flags & AMODEM_HANDLER_REPLACE) ) {
+            D( "%s: a handler already exists for %s%s", __FUNCTION__, prefix ? "!" : "", cmd );
+            return -1;
+        }
+        c          = &sCommands[nn];
+        c->answer  = NULL;
+        c->reply   = NULL;
+        c->handler = handler;
+        return 0;
+    }
+
+    if (sCommandsCount >= sCommandsMax) {
+        int                new_max = sCommandsMax + (sCommandsMax >> 1) + 4;
+        AModemCommandRec*  new_commands;
+
+        new_commands = (AModemCommandRec*) realloc( sCommands, new_max * sizeof(AModemCommandRec) );
+        if (new_commands == NULL)
+            return -1;
+
+        sCommands    = new_commands;
+        sCommandsMax = new_max;
+    }
+
+    c = &sCommands[ sCommandsCount ];
+    memset( c, 0, sizeof(*c) );
+    c->cmd = strdup( cmd );
+    if (c->cmd == NULL)
+        return -1;
+
+    c->len     = len;
+    c->prefix  = prefix;
+    c->handler = handler;
+    sCommandsCount += 1;
+
+    if (amodem_index_rebuild() < 0) {
+        sCommandsCount -= 1;
+        free( (char*) c->cmd );
+        return -1;
+    }
+    return 0;
+}
+
+int
+amodem_load_plugin( const char*  path )
+{
+    void*                 lib;
+    AModemPluginInitFunc  init;
+
+    lib = dlopen( path, RTLD_NOW | RTLD_LOCAL );
+    if (lib == NULL) {
+        D( "%s: could not load %s: %s", __FUNCTION__, path, dlerror() );
+        return -1;
+    }
+
+    init = (AModemPluginInitFunc) dlsym( lib, AMODEM_PLUGIN_INIT );
+    if (init == NULL) {
+        D( "%s: %s has no %s()", __FUNCTION__, path, AMODEM_PLUGIN_INIT );
+        dlclose( lib );
+        return -1;
+    }
+
+    /* the library stays loaded even if its init fails, since it may
+     * already have registered some of its handlers */
+    if (init( amodem_register_handler ) < 0) {
+        D( "%s: %s failed to initialize", __FUNCTION__, path );
+        return -1;
+    }
+
+    D( "%s: loaded %s", __FUNCTION__, path );
+    return 0;
+}
+
+int
+amodem_load_plugins( const char*  paths )
+{
+    char*  list;
+    char*  p;
+    int    count = 0;
+
+    if (paths == NULL || (list = strdup( paths )) == NULL)
+        return 0;
+
+    for (p = list; *p; ) {
+        char*  path = p;
+        char*  end  = strchr( p, ':' );
+
+        if (end != NULL) {
+            *end = 0;
+            p    = end + 1;
+        } else {
+            p   += strlen(p);
+        }
+
+        if (path[0] != 0 && amodem_load_plugin( path ) == 0)
+            count += 1;
+    }
+    free( list );
+    return count;
+}
+
+/* find the command table entry for a command (without its AT prefix), i.e.
+ * the first entry that is either a full match or a prefix of it. returns -1
+ * if the command is not supported */
+static int
+amodem_find_response( const char*  cmd )
+{
+    int       len     = strlen( cmd );
+    int       best    = amodem_index_find( cmd, len, 0 );
+    uint64_t  lengths = sPrefixLengths;
+    int       n;
+
+    for (n = 0; lengths != 0 && n <= len; n++, lengths >>= 1) {
+        int  nn;
+
+        if ( !(lengths & 1) )
+            continue;
+
+        nn = amodem_index_find( cmd, n, 1 );
+        if (nn >= 0 && (best < 0 || nn < best))
+            best = nn;
+    }
+    return best;
+}
+
+/* returns 1 if a handler answer must be sent back as-is, without a final OK */
+static int
+amodem_answer_is_final( const char*  answer )
+{
+    return !memcmp( answer, "> ", 2 )     ||
+           !memcmp( answer, "ERROR", 5 )  ||
+           !memcmp( answer, "+CME ERROR", 6 );
+}
+
+static unsigned long long
+amodem_clock_ns( void )
+{
+    struct timespec  ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* account for one execution of sCommands[nn] */
+static void
+amodem_command_record( AModemCommand  c, const char*  answer, unsigned long long  ns )
+{
+    unsigned long long  us     = ns >> 10;
+    int                 bucket = 0;
+
+    while (us != 0 && bucket < AMODEM_STATS_BUCKETS-1) {
+        us    >>= 1;
+        bucket += 1;
+    }
+
+    c->calls    += 1;
+    c->total_ns += ns;
+    c->latency[bucket] += 1;
+
+    if (answer != NULL) {
+        c->bytes_out += strlen(answer);
+        if (answer[0] != '>' && amodem_answer_is_final( answer ))
+            c->errors += 1;
+    }
+}
+
+/* execute the command matching sCommands[nn] and return its answer
+ * without the final OK, or NULL if a plain OK is enough */
+static const char*
+amodem_execute( AModem  modem, const char*  cmd, int  nn )
+{
+    AModemCommand        c;
+    const char*          answer;
+    unsigned long long   start;
+
+    if (nn < 0)
+        return "ERROR: UNSUPPORTED";
+
+    c     = &sCommands[nn];
+    start = amodem_clock_ns();
+
+    if (c->answer != NULL)
+        answer = c->answer;
+    else if (c->handler == NULL)
+        answer = NULL;
+    else
+        answer = c->handler( cmd, modem );
+
+    amodem_command_record( c, answer, amodem_clock_ns() - start );
+    return answer;
+}
+
+int
+amodem_get_command_count( void )
+{
+    if (amodem_init_commands() < 0)
+        return 0;
+
+    return sCommandsCount;
+}
+
+int
+amodem_get_command_stats( int  index, AModemCommandStats  stats )
+{
+    AModemCommand  c;
+
+    if (index < 0 || index >= sCommandsCount)
+        return -1;
+
+    c = &sCommands[index];
+    stats->cmd       = c->cmd;
+    stats->prefix    = c->prefix;
+    stats->calls     = c->calls;
+    stats->errors    = c->errors;
+    stats->bytes_out = c->bytes_out;
+    stats->total_ns  = c->total_ns;
+    memcpy( stats->latency, c->latency, sizeof(stats->latency) );
+    return 0;
+}
+
+void
+amodem_reset_command_stats( void )
+{
+    int  nn;
+
+    for (nn = 0; nn < sCommandsCount; nn++) {
+        AModemCommand  c = &sCommands[nn];
+
+        c->calls     = 0;
+        c->errors    = 0;
+        c->bytes_out = 0;
+        c->total_ns  = 0;
+        memset( c->latency, 0, sizeof(c->latency) );
+    }
+}
+
+/* AT%STATS? lists the statistics of every command called since the last
+ * AT%STATS=0, as: %STATS: "<cmd>",<calls>,<errors>,<bytes>,<total_us>,<latency...> */
+static const char*
+handleCommandStats( const char*  cmd, AModem  modem )
+{
+    AModemOut  out = modem->out;
+    int        nn, mm;
+
+    if ( !strcmp( cmd, "%STATS=0" ) ) {
+        amodem_reset_command_stats();
+        return NULL;
+    }
+    if ( strcmp( cmd, "%STATS?" ) )
+        return "ERROR: BAD COMMAND";
+
+    amodem_out_reset( out );
+    for (nn = 0; nn < sCommandsCount; nn++) {
+        AModemCommand  c = &sCommands[nn];
+
+        if (c->calls == 0)
+            continue;
+
+        if (out->size > 0)
+            amodem_out_add_c( out, '\r' );
+
+        amodem_out_add_str( out, c->prefix ? "%STATS: \"!" : "%STATS: \"" );
+        amodem_out_add( out, c->cmd, c->len );
+        amodem_out_add_c( out, '"' );
+        amodem_out_add_c( out, ',' );
+        amodem_out_add_int( out, c->calls );
+        amodem_out_add_c( out, ',' );
+        amodem_out_add_int( out, c->errors );
+        amodem_out_printf( out, ",%llu,%llu", c->bytes_out, c->total_ns / 1000 );
+        for (mm = 0; mm < AMODEM_STATS_BUCKETS; mm++) {
+            amodem_out_add_c( out, ',' );
+            amodem_out_add_int( out, c->latency[mm] );
+        }
+    }
+    if (out->size == 0)
+        return NULL;
+
+    return amodem_out_end( out );
+}
+
+/* find the end of the first command of a ';'-separated chain. separators
+ * inside quoted strings don't count, and a dial command takes the rest of
+ * the line since its own trailing ';' selects a voice call */
+static char*
+amodem_chain_next( char*  p )
+{
+    int  quoted = 0;
+
+    if (*p == 'D')
+        return p + strlen(p);
+
+    for ( ; *p; p++ ) {
+        if (*p == '"')
+            quoted = !quoted;
+        else if (*p == ';' && !quoted)
+            break;
+    }
+    return p;
+}
+
+/* execute a chain such as "+CSQ;+CREG?;+COPS?" one command at a time.
+ * intermediate answers are joined with \r and followed by a single OK,
+ * the first error (or SMS prompt) stops the chain and becomes the final
+ * result code */
+static const char*
+amodem_execute_chain( AModem  modem, const char*  cmd )
+{
+    AModemOutRec  line[1];
+    AModemOutRec  result[1];
+    const char*   answer = NULL;
+    char*         p;
+    int           nn;
+
+    amodem_out_init( line );
+    amodem_out_init( result );
+    amodem_out_add_str( line, cmd );
+    p = (char*) amodem_out_end( line );
+
+    while (*p) {
+        char*  start = p;
+        char*  end   = amodem_chain_next( p );
+
+        p = (*end) ? end + 1 : end;
+        *end = 0;
+        if (start == end)   /* empty command, e.g. trailing ';' */
+            continue;
+
+        nn     = amodem_find_response( start );
+        answer = amodem_execute( modem, start, nn );
+        if (nn < 0)
+            D( "** UNSUPPORTED COMMAND IN CHAIN: %s **\n", quote(start) );
+
+        if (answer == NULL)
+            continue;
+
+        if (result->size > 0)
+            amodem_out_add_c( result, '\r' );
+        amodem_out_add_str( result, answer );
+
+        if (amodem_answer_is_final( answer ))
+            break;
+
+        answer = NULL;
+    }
+
+    if (answer == NULL) {
+        if (result->size > 0)
+            amodem_out_add_c( result, '\r' );
+        amodem_out_add( result, "OK", 2 );
+    }
+
+    amodem_out_reset( modem->out );
+    amodem_out_add( modem->out, result->data, result->size );
+
+    amodem_out_done( result );
+    amodem_out_done( line );
+    return amodem_out_end( modem->out );
+}
+
+/* returns 1 if a command line contains several ';'-separated commands */
+static int
+amodem_is_chain( const char*  cmd )
+{
+    const char*  end = amodem_chain_next( (char*) cmd );
+
+    return *end == ';';
+}
 
 #define  REPLY(str)  do { const char*  s = (str); R(">> %s\n", quote(s)); return s; } while (0)
 
-const char*  amodem_send( AModem  modem, const char*  cmd )
+static const char*
+amodem_send_line( AModem  modem, const char*  cmd )
 {
     const char*  answer;
+    int          nn;
 
     if ( modem->wait_sms != 0 ) {
         modem->wait_sms = 0;
+        amodem_snapshot_changed( modem );
         R( "SMS<< %s\n", quote(cmd) );
         answer = handleSendSMSText( cmd, modem );
         REPLY(answer);
@@ -2518,65 +4700,79 @@ const char*  amodem_send( AModem  modem, const char*  cmd )
 
     cmd += 2;
 
-    /* TODO: implement command handling */
-    {
-        int  nn, found = 0;
+    /* a full match in the table wins over splitting the line, this keeps
+     * the literal chains listed there working as before */
+    nn = amodem_find_response( cmd );
+    if ( (nn < 0 || sCommands[nn].prefix) && amodem_is_chain( cmd ) ) {
+        answer = amodem_execute_chain( modem, cmd );
+        /* hooks started in a chain don't delay its answer */
+        modem->hook_started = 0;
+        REPLY( answer );
+    }
 
-        for (nn = 0; ; nn++) {
-            const char*  scmd = sDefaultResponses[nn].cmd;
+    answer = amodem_execute( modem, cmd, nn );
 
-            if (!scmd) /* end of list */
-                break;
+    /* the final result of a hook is passed to the answer function once
+     * it exits, so that the event loop is never blocked by it */
+    if (modem->hook_started) {
+        modem->hook_started = 0;
+        if (answer == NULL && modem->hook != NULL && modem->answer_func != NULL) {
+            modem->hook_answer        = modem->answer_func;
+            modem->hook_answer_opaque = modem->answer_opaque;
+            R( ">> (deferred)\n" );
+            return NULL;
+        }
+    }
+    if (nn < 0) {
+        D( "** UNSUPPORTED COMMAND **\n" );
+        REPLY( answer );
+    }
 
-            if (scmd[0] == '!') { /* prefix match */
-                int  len = strlen(++scmd);
+    if (sCommands[nn].reply != NULL)
+        REPLY( sCommands[nn].reply );
 
-                if ( !memcmp( scmd, cmd, len ) ) {
-                    found = 1;
-                    break;
-                }
-            } else { /* full match */
-                if ( !strcmp( scmd, cmd ) ) {
-                    found = 1;
-                    break;
-                }
-            }
-        }
+    if (answer == NULL)
+        REPLY( "OK" );
 
-        if ( !found )
-        {
-            D( "** UNSUPPORTED COMMAND **\n" );
-            REPLY( "ERROR: UNSUPPORTED" );
-        }
-        else
-        {
-            const char*      answer  = sDefaultResponses[nn].answer;
-            ResponseHandler  handler = sDefaultResponses[nn].handler;
+    if (amodem_answer_is_final( answer ))
+        REPLY( answer );
 
-            if ( answer != NULL ) {
-                REPLY( amodem_printf( modem, "%s\rOK", answer ) );
-            }
+    if (answer != modem->out->data)
+        REPLY( amodem_copy_ok( modem, answer ) );
 
-            if (handler == NULL) {
-                REPLY( "OK" );
-            }
+    REPLY( amodem_end_ok( modem ) );
+}
 
-            answer = handler( cmd, modem );
-            if (answer == NULL)
-                REPLY( "OK" );
+const char*  amodem_send( AModem  modem, const char*  cmd )
+{
+    return amodem_send_async( modem, cmd, NULL, NULL );
+}
 
-            if ( !memcmp( answer, "> ", 2 )     ||
-                 !memcmp( answer, "ERROR", 5 )  ||
-                 !memcmp( answer, "+CME ERROR", 6 ) )
-            {
-                REPLY( answer );
-            }
+const char*  amodem_send_async( AModem  modem, const char*  cmd,
+                                AModemAnswerFunc  func, void*  opaque )
+{
+    const char*  answer;
 
-            if (answer != modem->out_buff)
-                REPLY( amodem_printf( modem, "%s\rOK", answer ) );
+    modem->answer_func   = func;
+    modem->answer_opaque = opaque;
+    answer = amodem_send_line( modem, cmd );
+    modem->answer_func   = NULL;
+    modem->answer_opaque = NULL;
 
-            strcat( modem->out_buff, "\rOK" );
-            REPLY( answer );
-        }
-    }
+    /* each command line is one mutation batch */
+    amodem_publish_state( modem );
+    return answer;
+}
+
+int
+amodem_answer_pending( AModem  modem, void*  opaque )
+{
+    return modem->hook_answer != NULL && modem->hook_answer_opaque == opaque;
+}
+
+void
+amodem_cancel_answer( AModem  modem, void*  opaque )
+{
+    if (amodem_answer_pending( modem, opaque ))
+        modem->hook_answer = NULL;
 }
@@ -22,13 +22,112 @@ typedef struct AModemRec_*    AModem;
 /* a function used by the modem to send unsolicited messages to the channel controller */
 typedef void (*AModemUnsolFunc)( void*  opaque, const char*  message );
 
+/* a function receiving the delayed final result of a command, see amodem_send_async() */
+typedef void (*AModemAnswerFunc)( void*  opaque, const char*  answer );
+
+/* each modem is independent, with its own SIM card and NVRAM file. the one
+ * created by amodem_create() keeps its NVRAM in "modem_config" */
 extern AModem      amodem_create( int  base_port, AModemUnsolFunc  unsol_func, void*  unsol_opaque );
+extern AModem      amodem_create_with_nvram( int  base_port, const char*  nvram_path,
+                                             AModemUnsolFunc  unsol_func, void*  unsol_opaque );
 extern void        amodem_set_legacy( AModem  modem );
+
+/* coalesce the +CREG, +CGREG, +CTEC and +CSQ unsolicited messages: within
+ * 'window_ms' of the first one, only the latest line of each type is kept,
+ * and they are all sent in a single write. 0 (the default, or the NVRAM
+ * value of "unsol_coalesce_ms") sends them immediately */
+extern void        amodem_set_unsol_coalescing( AModem  modem, int  window_ms );
+
+/* network interface carrying the data connection, whose address is reported
+ * by +CGDCONT?. defaults to the NVRAM value of "network_interface", or "eth2".
+ * returns -1 if the name is invalid */
+extern int         amodem_set_network_interface( AModem  modem, const char*  name );
+
+/* rewrite the NVRAM file right away as a binary image if 'image' is set,
+ * or as text otherwise. images are loaded without lexing, which matters
+ * when starting many modems. returns -1 if the file can't be written,
+ * or if it exists but couldn't be loaded: such a file is never overwritten */
+extern int         amodem_set_nvram_image( AModem  modem, int  image );
 extern void        amodem_destroy( AModem  modem );
 
-/* send a command to the modem */
+/* save the whole modem state (registration, calls, data contexts, SIM and
+ * partially received SMS) to a binary snapshot file, written atomically.
+ * amodem_snapshot_load() restores it, or returns -1 and leaves the modem
+ * untouched if the file is missing or invalid */
+extern int         amodem_snapshot_save( AModem  modem, const char*  path );
+extern int         amodem_snapshot_load( AModem  modem, const char*  path );
+
+/* 1 if the state changed since the last snapshot saved or loaded, so that
+ * commands that only read it don't cause a new save. only compares change
+ * counters, cheap enough to call after each command */
+extern int         amodem_snapshot_is_dirty( AModem  modem );
+
+/* send a command to the modem, returns its answer or NULL if the line is
+ * not a command */
 extern const char*  amodem_send( AModem  modem, const char*  cmd );
 
+/* same, but a command whose final result is delayed until a background
+ * action completes (e.g. the netcfg hooks of PDP contexts) returns NULL,
+ * its result is passed to 'func' with 'opaque' once available */
+extern const char*  amodem_send_async( AModem  modem, const char*  cmd,
+                                       AModemAnswerFunc  func, void*  opaque );
+
+/* 1 if a delayed final result is still due to 'opaque' */
+extern int          amodem_answer_pending( AModem  modem, void*  opaque );
+
+/* forget the delayed final result due to 'opaque', e.g. when it disconnects */
+extern void         amodem_cancel_answer( AModem  modem, void*  opaque );
+
+/** COMMAND HANDLERS
+ **/
+/* a function used to answer a command, 'cmd' doesn't include the AT prefix. it
+ * returns NULL if OK is good enough, an answer to be followed by OK, or an
+ * "ERROR" / "+CME ERROR" result code */
+typedef const char*  (*AModemHandler)( const char*  cmd, AModem  modem );
+
+#define  AMODEM_HANDLER_PREFIX   (1 << 0)   /* 'cmd' is a prefix, not a full command */
+#define  AMODEM_HANDLER_REPLACE  (1 << 1)   /* replace the existing handler of 'cmd' */
+
+/* add a handler to the command table, after the built-in ones. returns 0 on
+ * success, or -1 if 'cmd' already has one and AMODEM_HANDLER_REPLACE is not set */
+extern int   amodem_register_handler( const char*  cmd, AModemHandler  handler, int  flags );
+
+/* handler plugins are shared objects exporting an extern "C" function named
+ * AMODEM_PLUGIN_INIT, which registers their handlers through 'reg' and
+ * returns 0, or -1 on failure */
+typedef int  (*AModemRegisterFunc)( const char*  cmd, AModemHandler  handler, int  flags );
+typedef int  (*AModemPluginInitFunc)( AModemRegisterFunc  reg );
+
+#define  AMODEM_PLUGIN_INIT  "amodem_plugin_init"
+
+/* load one plugin, returns 0 on success or -1 */
+extern int   amodem_load_plugin( const char*  path );
+
+/* load a ':'-separated list of plugins, returns the number of plugins loaded */
+extern int   amodem_load_plugins( const char*  paths );
+
+/** COMMAND STATISTICS
+ **/
+/* latency histogram buckets, bucket N counts the calls that took less than
+ * 2^N microseconds (in 1024ns units), the last one counts all slower calls */
+#define  AMODEM_STATS_BUCKETS  16
+
+typedef struct {
+    const char*         cmd;        /* command, or command prefix */
+    int                 prefix;     /* 1 if 'cmd' is a prefix */
+    unsigned            calls;
+    unsigned            errors;     /* calls answered with an error */
+    unsigned long long  bytes_out;  /* answer bytes, without the final OK */
+    unsigned long long  total_ns;
+    unsigned            latency[ AMODEM_STATS_BUCKETS ];
+} AModemCommandStatsRec, *AModemCommandStats;
+
+/* the statistics are kept per command table entry, and shared by all modems.
+ * they can also be read with AT%STATS? and reset with AT%STATS=0 */
+extern int   amodem_get_command_count( void );
+extern int   amodem_get_command_stats( int  index, AModemCommandStats  stats );
+extern void  amodem_reset_command_stats( void );
+
 /* simulate the receipt on an incoming SMS message */
 extern void         amodem_receive_sms( AModem  modem, SmsPDU  pdu );
 
@@ -45,6 +144,12 @@ extern void         amodem_set_radio_state( AModem modem, ARadioState  state );
 /* Set the received signal strength indicator and bit error rate */
 extern void         amodem_set_signal_strength( AModem modem, int value);
 
+/* drive the signal from a trace file or a random walk, see signal_engine.h.
+ * they can also be set in the NVRAM with "signal_trace", "signal_trace_loop"
+ * and "signal_walk_ms". amodem_set_signal_strength() stops them */
+extern int          amodem_set_signal_trace( AModem  modem, const char*  path, int  loop );
+extern int          amodem_set_signal_walk( AModem  modem, int  interval_ms );
+
 /** SIM CARD STATUS
  **/
 extern ASimCard    amodem_get_sim( AModem  modem );
@@ -161,6 +266,9 @@ typedef struct {
     char        number[ A_CALL_NUMBER_MAX_SIZE+1 ];
 } ACallRec, *ACall;
 
+/* change the capacity of the call table (4 by default, or "max_calls" in the
+ * NVRAM), returns -1 if it is above 1024 or the current calls would not fit */
+extern int    amodem_set_max_calls( AModem  modem, int  max_calls );
 extern int    amodem_get_call_count( AModem  modem );
 extern ACall  amodem_get_call( AModem  modem,  int  index );
 extern ACall  amodem_find_call_by_number( AModem  modem, const char*  number );
@@ -168,6 +276,51 @@ extern int    amodem_add_inbound_call( AModem  modem, const char*  number );
 extern int    amodem_update_call( AModem  modem, const char*  number, ACallState  state );
 extern int    amodem_disconnect_call( AModem  modem, const char*  number );
 
+/** STATE SNAPSHOTS
+ **
+ ** the modem publishes an immutable copy of its state after each AT command,
+ ** timer event or call to the functions above. other threads can read it
+ ** without locking and without going through the event loop: open a reader
+ ** slot once, then bracket each access with acquire/release. a state stays
+ ** valid until the reader releases it, old copies are recycled once no
+ ** reader can still see them.
+ **/
+#define  AMODEM_STATE_READERS       16   /* max. number of concurrent reader threads */
+#define  AMODEM_STATE_MAX_CONTEXTS  4
+#define  AMODEM_STATE_APN_SIZE      32
+
+typedef struct {
+    int   id;
+    int   active;
+    char  apn[ AMODEM_STATE_APN_SIZE ];
+} AModemStateContextRec;
+
+typedef struct {
+    unsigned                generation;   /* incremented each time the state changes */
+    ARadioState             radio_state;
+    ARegistrationState      voice_state;
+    ARegistrationState      data_state;
+    ADataNetworkType        data_network;
+    AModemTech              technology;
+    int                     signal;       /* 0 (none) to 4 (great) */
+    int                     area_code;
+    int                     cell_id;
+    char                    oper_name[ A_NAME_MAX ][ 16 ];  /* empty without network */
+    AModemStateContextRec   contexts[ AMODEM_STATE_MAX_CONTEXTS ];
+    int                     call_count;
+    ACallRec                calls[ 1 ];   /* 'call_count' entries */
+} AModemStateRec;
+
+typedef const AModemStateRec*  AModemState;
+
+/* claim a reader slot for the calling thread, returns its index or -1 */
+extern int          amodem_state_reader_open( void );
+extern void         amodem_state_reader_close( int  reader );
+
+/* each reader can hold one state at a time, the modem must outlive it */
+extern AModemState  amodem_state_acquire( AModem  modem, int  reader );
+extern void         amodem_state_release( int  reader );
+
 /**/
 
 #endif /* _android_modem_h_ */
@@ -0,0 +1,509 @@
+/* Copyright (C) 2007-2008 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+
+/* a host benchmark for the AT command path. it replays a RIL trace, either
+ * in process through amodem_send() or end to end over the gsmd AT port, and
+ * reports the time and allocations spent per command:
+ *
+ *    gsmd_bench [-n rounds] [-t port] [trace-file]
+ *
+ * a trace file lists one command per line, '#' starts a comment. without
+ * one, a built-in trace of a typical RIL session is used */
+#include "android_modem.h"
+#include "sysdeps.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/** ALLOCATION COUNTING
+ **/
+/* with glibc, malloc() and friends can be interposed to count allocations,
+ * including the ones made inside the C library itself */
+static long  s_alloc_count;
+
+#ifdef __GLIBC__
+#define  HAVE_ALLOC_COUNT  1
+
+extern "C" void*  __libc_malloc( size_t  size );
+extern "C" void*  __libc_calloc( size_t  count, size_t  size );
+extern "C" void*  __libc_realloc( void*  ptr, size_t  size );
+extern "C" void   __libc_free( void*  ptr );
+
+extern "C" void*  malloc( size_t  size )
+{
+    s_alloc_count += 1;
+    return __libc_malloc( size );
+}
+
+extern "C" void*  calloc( size_t  count, size_t  size )
+{
+    s_alloc_count += 1;
+    return __libc_calloc( count, size );
+}
+
+extern "C" void*  realloc( void*  ptr, size_t  size )
+{
+    s_alloc_count += 1;
+    return __libc_realloc( ptr, size );
+}
+
+extern "C" void  free( void*  ptr )
+{
+    __libc_free( ptr );
+}
+#else
+#define  HAVE_ALLOC_COUNT  0
+#endif
+
+/** TRACE
+ **/
+/* a RIL session: boot and SIM init, polling, SMS sending, dial and hangup */
+static const char*  s_default_trace[] = {
+    "ATE0Q0V1",
+    "AT+CMEE=1",
+    "AT+CREG=2",
+    "AT+CGREG=2",
+    "AT+CCWA=1",
+    "AT+CMOD=0",
+    "AT+CMUT=0",
+    "AT+CSSN=0,1",
+    "AT+COLP=0",
+    "AT+CSCS=\"HEX\"",
+    "AT+CUSD=1",
+    "AT+CGEREP=1,0",
+    "AT+CMGF=0",
+    "AT+CFUN?",
+    "AT+CFUN=1",
+    "AT+CPIN?",
+    "AT+CIMI",
+    "AT+CGSN",
+    "AT+CTEC=?",
+    "AT+CTEC?",
+    "AT+CSMS=1",
+    "AT+CNMI=1,2,2,1,1",
+    "AT+CRSM=192,28436,0,0,15",
+    "AT+CRSM=176,28436,0,0,20",
+    "AT+CRSM=178,28480,1,4,32",
+    "AT+COPS=3,0;+COPS?;+COPS=3,1;+COPS?;+COPS=3,2;+COPS?",
+    "AT+COPS?",
+    "AT+CSQ",
+    "AT+CREG?",
+    "AT+CGREG?",
+    "AT+CLCC",
+    "AT+CSQ",
+    "AT+CREG?",
+    "AT+CGREG?",
+    "AT+CGDCONT=1,\"IP\",\"internet\",,0,0",
+    "AT+CGQREQ=1",
+    "AT+CGQMIN=1",
+    "AT+CGACT?",
+    "AT+CGDCONT?",
+    "AT+CMGS=20",
+    "0001000b915155255655f600000ad4f29c9e769f4161",
+    "AT+CSQ",
+    "AT+CLCC",
+    "ATD0612345678;",
+    "AT+CLCC",
+    "AT+CSQ",
+    "ATH",
+    "AT+CHLD=11",
+    "AT+CLCC",
+    "AT+CSQ",
+    "AT+CREG?",
+    NULL
+};
+
+typedef struct {
+    char**  lines;
+    int     count;
+} TraceRec, *Trace;
+
+static void
+trace_add( Trace  trace, const char*  line )
+{
+    trace->lines = (char**) realloc( trace->lines, (trace->count+1)*sizeof(char*) );
+    trace->lines[ trace->count++ ] = strdup( line );
+}
+
+static int
+trace_load( Trace  trace, const char*  path )
+{
+    char   line[1024];
+    FILE*  f;
+
+    if (path == NULL) {
+        int  nn;
+        for (nn = 0; s_default_trace[nn] != NULL; nn++)
+            trace_add( trace, s_default_trace[nn] );
+        return 0;
+    }
+
+    f = fopen( path, "r" );
+    if (f == NULL) {
+        fprintf( stderr, "could not open %s: %s\n", path, strerror(errno) );
+        return -1;
+    }
+
+    while (fgets( line, sizeof(line), f ) != NULL) {
+        int  len = strlen(line);
+
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+            line[--len] = 0;
+
+        if (len > 0 && line[0] != '#')
+            trace_add( trace, line );
+    }
+    fclose( f );
+    return 0;
+}
+
+/** STATISTICS
+ **/
+/* samples are grouped by command name, i.e. the command without its
+ * arguments, so that they roughly match the handlers of the command table */
+typedef struct {
+    char      name[32];
+    long      count;
+    long      allocs;
+    double    total_ns;
+    double*   samples;
+    int       max_samples;
+} StatRec, *Stat;
+
+static StatRec*  s_stats;
+static int       s_stats_count;
+
+static void
+stat_name( const char*  line, char*  name, int  size )
+{
+    int  len = 0;
+
+    if (line[0] != 'A' || line[1] != 'T') {
+        snprintf( name, size, "<pdu>" );
+        return;
+    }
+
+    line += 2;
+    if (line[0] == 'D') {
+        snprintf( name, size, "D" );
+        return;
+    }
+
+    while (line[len] && line[len] != '=' && line[len] != ';' && len < size-1)
+        len++;
+
+    if (line[len] == '=' && line[len+1] == '?' && len < size-3) {
+        memcpy( name, line, len+2 );
+        name[len+2] = 0;
+        return;
+    }
+    memcpy( name, line, len );
+    name[len] = 0;
+    if (line[len] == ';')
+        snprintf( name + len, size - len, ";..." );
+}
+
+/* returns the index of the statistics of a command, since s_stats moves as it grows */
+static int
+stat_find( const char*  line )
+{
+    char  name[32];
+    int   nn;
+
+    stat_name( line, name, sizeof(name) );
+    for (nn = 0; nn < s_stats_count; nn++) {
+        if (!strcmp( s_stats[nn].name, name ))
+            return nn;
+    }
+
+    s_stats = (StatRec*) realloc( s_stats, (s_stats_count+1)*sizeof(StatRec) );
+    memset( &s_stats[s_stats_count], 0, sizeof(StatRec) );
+    snprintf( s_stats[s_stats_count].name, sizeof(s_stats[0].name), "%s", name );
+    return s_stats_count++;
+}
+
+static void
+stat_add( Stat  stat, double  ns, long  allocs )
+{
+    if (stat->count >= stat->max_samples) {
+        stat->max_samples = stat->max_samples*2 + 64;
+        stat->samples     = (double*) realloc( stat->samples, stat->max_samples*sizeof(double) );
+    }
+    stat->samples[ stat->count++ ] = ns;
+    stat->total_ns += ns;
+    stat->allocs   += allocs;
+}
+
+static int
+compare_double( const void*  a, const void*  b )
+{
+    double  x = *(const double*)a;
+    double  y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double
+stat_percentile( Stat  stat, int  percent )
+{
+    long  index = (stat->count * percent + 99) / 100 - 1;
+
+    if (index < 0)
+        index = 0;
+    return stat->samples[index];
+}
+
+static void
+stat_print_all( const char*  mode, int  with_allocs )
+{
+    long    count = 0, allocs = 0;
+    double  total = 0.;
+    int     nn;
+
+    printf( "%s: %-22s %8s %11s %11s %11s %10s\n", mode, "command", "count",
+            "ns/cmd", "p50", "p99", "allocs/cmd" );
+
+    for (nn = 0; nn < s_stats_count; nn++) {
+        Stat  stat = &s_stats[nn];
+
+        qsort( stat->samples, stat->count, sizeof(double), compare_double );
+        printf( "%s: %-22s %8ld %11.0f %11.0f %11.0f", mode, stat->name, stat->count,
+                stat->total_ns / stat->count, stat_percentile( stat, 50 ),
+                stat_percentile( stat, 99 ) );
+        if (with_allocs)
+            printf( " %10.2f\n", (double)stat->allocs / stat->count );
+        else
+            printf( " %10s\n", "n/a" );
+
+        count  += stat->count;
+        allocs += stat->allocs;
+        total  += stat->total_ns;
+    }
+
+    printf( "%s: %-22s %8ld %11.0f", mode, "TOTAL", count, count ? total / count : 0. );
+    if (with_allocs)
+        printf( " %35.2f\n", count ? (double)allocs / count : 0. );
+    else
+        printf( " %35s\n", "n/a" );
+}
+
+static double
+now_ns( void )
+{
+    struct timespec  ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/** IN PROCESS MODE
+ **/
+static void
+unsol_func( void*  opaque, const char*  message )
+{
+    opaque=opaque;
+    message=message;
+}
+
+/* the statistics recorded by the modem itself, per command table entry */
+static void
+handler_print_all( void )
+{
+    AModemCommandStatsRec  stats[1];
+    int                    nn, count = amodem_get_command_count();
+
+    printf( "handler: %-22s %8s %11s %8s %10s\n", "entry", "calls", "ns/call",
+            "errors", "bytes/call" );
+
+    for (nn = 0; nn < count; nn++) {
+        if (amodem_get_command_stats( nn, stats ) < 0 || stats->calls == 0)
+            continue;
+
+        printf( "handler: %s%-*s %8u %11.0f %8u %10.1f\n", stats->prefix ? "!" : "",
+                stats->prefix ? 21 : 22, stats->cmd, stats->calls,
+                (double)stats->total_ns / stats->calls, stats->errors,
+                (double)stats->bytes_out / stats->calls );
+    }
+}
+
+static void
+bench_local( Trace  trace, int  rounds )
+{
+    AModem  modem;
+    int     round, nn;
+    int*    stats;
+
+    sys_main_init();
+    modem = amodem_create( 0, unsol_func, NULL );
+
+    stats = (int*) malloc( trace->count * sizeof(int) );
+    for (nn = 0; nn < trace->count; nn++)
+        stats[nn] = stat_find( trace->lines[nn] );
+
+    /* the samples buffers grow while recording, reserve them beforehand so
+     * that their reallocations are not counted */
+    for (nn = 0; nn < s_stats_count; nn++) {
+        Stat  stat = &s_stats[nn];
+        int   mm, uses = 0;
+
+        for (mm = 0; mm < trace->count; mm++)
+            uses += (stats[mm] == nn);
+
+        stat->max_samples = uses * rounds;
+        stat->samples     = (double*) malloc( stat->max_samples * sizeof(double) );
+    }
+
+    for (round = 0; round < rounds; round++) {
+        for (nn = 0; nn < trace->count; nn++) {
+            long    allocs = s_alloc_count;
+            double  start  = now_ns();
+
+            amodem_send( modem, trace->lines[nn] );
+
+            allocs = s_alloc_count - allocs;
+            stat_add( &s_stats[ stats[nn] ], now_ns() - start, allocs );
+        }
+    }
+
+    free( stats );
+    amodem_destroy( modem );
+    stat_print_all( "local", HAVE_ALLOC_COUNT );
+    handler_print_all();
+}
+
+/** TCP MODE
+ **/
+/* returns 1 if 'line' is a final result code, or the SMS text prompt */
+static int
+is_final_line( const char*  line )
+{
+    return !strncmp( line, "OK", 2 )          ||
+           !strncmp( line, "ERROR", 5 )       ||
+           !strncmp( line, "+CME ERROR", 10 ) ||
+           !strncmp( line, "+CMS ERROR", 10 ) ||
+           !strncmp( line, "> ", 2 );
+}
+
+/* read an answer until its final result code */
+static int
+read_answer( int  fd )
+{
+    char  line[1024];
+    int   len = 0;
+
+    for (;;) {
+        char  c;
+        int   ret = read( fd, &c, 1 );
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+
+        if (c == '\r' || c == '\n') {
+            line[len] = 0;
+            if (len > 0 && is_final_line( line ))
+                return 0;
+            len = 0;
+        } else if (len < (int)sizeof(line) - 1) {
+            line[len++] = c;
+            /* the prompt is not followed by a line terminator in every case */
+            if (len == 2 && line[0] == '>' && line[1] == ' ')
+                return 0;
+        }
+    }
+}
+
+static int
+bench_tcp( Trace  trace, int  rounds, int  port )
+{
+    struct sockaddr_in  addr;
+    int                 fd, round, nn, opt = 1;
+
+    fd = socket( AF_INET, SOCK_STREAM, 0 );
+    if (fd < 0) {
+        fprintf( stderr, "socket: %s\n", strerror(errno) );
+        return -1;
+    }
+
+    memset( &addr, 0, sizeof(addr) );
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons( port );
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    if (connect( fd, (struct sockaddr*)&addr, sizeof(addr) ) < 0) {
+        fprintf( stderr, "could not connect to port %d: %s\n", port, strerror(errno) );
+        close( fd );
+        return -1;
+    }
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt) );
+
+    for (nn = 0; nn < trace->count; nn++)
+        stat_find( trace->lines[nn] );
+
+    for (round = 0; round < rounds; round++) {
+        for (nn = 0; nn < trace->count; nn++) {
+            const char*  line  = trace->lines[nn];
+            int          len   = strlen(line);
+            double       start = now_ns();
+
+            if (write( fd, line, len ) != len || write( fd, "\r", 1 ) != 1 ||
+                read_answer( fd ) < 0)
+            {
+                fprintf( stderr, "connection lost at '%s'\n", line );
+                close( fd );
+                return -1;
+            }
+            stat_add( &s_stats[ stat_find( line ) ], now_ns() - start, 0 );
+        }
+    }
+    close( fd );
+
+    /* allocations happen in the server, they can't be counted here */
+    stat_print_all( "tcp", 0 );
+    return 0;
+}
+
+int  main( int  argc, char**  argv )
+{
+    TraceRec  trace[1];
+    int       rounds = 1000;
+    int       port   = 0;
+    int       opt;
+
+    while ((opt = getopt( argc, argv, "n:t:" )) != -1) {
+        switch (opt) {
+            case 'n': rounds = atoi( optarg ); break;
+            case 't': port   = atoi( optarg ); break;
+            default:
+                fprintf( stderr, "usage: %s [-n rounds] [-t port] [trace-file]\n", argv[0] );
+                return 1;
+        }
+    }
+    if (rounds <= 0)
+        rounds = 1;
+
+    memset( trace, 0, sizeof(trace) );
+    if (trace_load( trace, optind < argc ? argv[optind] : NULL ) < 0 || trace->count == 0)
+        return 1;
+
+    if (port > 0)
+        return bench_tcp( trace, rounds, port ) < 0;
+
+    bench_local( trace, rounds );
+    return 0;
+}
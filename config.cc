@@ -347,6 +347,220 @@ aconfig_load_file(AConfig *root, const char *fn)
 }
 
 
+/** CONFIGURATION DOCUMENTS
+ **/
+
+struct AConfigDocRec_
+{
+    AConfigNode*  nodes;
+    int           count;
+    int           max;
+};
+
+typedef struct
+{
+    const char*  p;
+    const char*  end;
+    AConfigSpan  text;
+} dstate;
+
+/* same tokens as _lex(), but the buffer is left untouched */
+static int
+_doc_lex(dstate *ds, int value)
+{
+    const char *p = ds->p;
+    const char *end = ds->end;
+    const char *s;
+    char c;
+
+    for(;;) {
+        if(p == end) {
+            ds->p = p;
+            return T_EOF;
+        }
+        c = *p++;
+        if(isspace((unsigned char)c)) continue;
+
+        switch(c) {
+        case 0:
+            ds->p = p - 1;
+            return T_EOF;
+
+        case '#':
+            while(p < end && *p != '\n' && *p != 0)
+                p++;
+            continue;
+
+        case '.':
+            ds->p = p;
+            return T_DOT;
+
+        case '{':
+            ds->p = p;
+            return T_OBRACE;
+
+        case '}':
+            ds->p = p;
+            return T_CBRACE;
+
+        default:
+            s = p - 1;
+
+            if(value) {
+                /* anything until the end of line, stripped from
+                 * trailing whitespace */
+                while(p < end && *p != '\n' && *p != 0)
+                    p++;
+                ds->p = (p < end && *p == '\n') ? p + 1 : p;
+
+                while(p > s + 1 && isspace((unsigned char)p[-1]))
+                    p--;
+            } else {
+                while(p < end && *p != 0 && *p != '.' && *p != '{' && *p != '}' &&
+                      !isspace((unsigned char)*p))
+                    p++;
+                ds->p = p;
+            }
+            ds->text.str = s;
+            ds->text.len = p - s;
+            return T_TEXT;
+        }
+    }
+}
+
+/* return the index of a named child of node 'parent', creating it if needed,
+ * or -1 if memory is exhausted */
+static int
+_doc_child(AConfigDoc doc, int parent, const AConfigSpan *name)
+{
+    AConfigNode *node;
+    int n;
+
+    for(n = doc->nodes[parent].first_child; n >= 0; n = doc->nodes[n].next) {
+        node = doc->nodes + n;
+        if(node->name.len == name->len && !memcmp(node->name.str, name->str, name->len))
+            return n;
+    }
+
+    if(doc->count == doc->max) {
+        int max = doc->max * 2;
+        node = (AConfigNode*) realloc(doc->nodes, max * sizeof(AConfigNode));
+        if(node == NULL)
+            return -1;
+        doc->nodes = node;
+        doc->max = max;
+    }
+
+    n = doc->count++;
+    node = doc->nodes + n;
+    node->name = *name;
+    node->value.str = "";
+    node->value.len = 0;
+    node->first_child = node->last_child = node->next = -1;
+
+    node = doc->nodes + parent;
+    if(node->last_child >= 0) {
+        doc->nodes[node->last_child].next = n;
+    } else {
+        node->first_child = n;
+    }
+    node->last_child = n;
+    return n;
+}
+
+static int doc_parse_expr(dstate *ds, AConfigDoc doc, int node);
+
+static int
+doc_parse_block(dstate *ds, AConfigDoc doc, int node)
+{
+    for(;;){
+        switch(_doc_lex(ds, 0)){
+        case T_TEXT:
+            if(doc_parse_expr(ds, doc, node)) return -1;
+            continue;
+
+        case T_CBRACE:
+            return 0;
+
+        default:
+            return -1;
+        }
+    }
+}
+
+static int
+doc_parse_expr(dstate *ds, AConfigDoc doc, int node)
+{
+        /* last token was T_TEXT */
+    node = _doc_child(doc, node, &ds->text);
+
+    for(;;) {
+        if(node < 0) return -1;
+
+        switch(_doc_lex(ds, 1)) {
+        case T_DOT:
+            if(_doc_lex(ds, 0) != T_TEXT) return -1;
+            node = _doc_child(doc, node, &ds->text);
+            continue;
+
+        case T_TEXT:
+            doc->nodes[node].value = ds->text;
+            return 0;
+
+        case T_OBRACE:
+            return doc_parse_block(ds, doc, node);
+
+        default:
+            return -1;
+        }
+    }
+}
+
+AConfigDoc
+aconfig_doc_parse(const char *data, int len)
+{
+    AConfigDoc doc;
+    dstate ds;
+
+    doc = (AConfigDoc) calloc(sizeof(*doc), 1);
+    if(doc == NULL)
+        return NULL;
+
+    doc->max = 32;
+    doc->nodes = (AConfigNode*) malloc(doc->max * sizeof(AConfigNode));
+    if(doc->nodes == NULL) {
+        free(doc);
+        return NULL;
+    }
+    doc->count = 1;
+    doc->nodes[0].name.str = doc->nodes[0].value.str = "";
+    doc->nodes[0].name.len = doc->nodes[0].value.len = 0;
+    doc->nodes[0].first_child = doc->nodes[0].last_child = doc->nodes[0].next = -1;
+
+    /* like aconfig_load(), keep what was parsed before an error */
+    ds.p = data;
+    ds.end = data + len;
+    while(_doc_lex(&ds, 0) == T_TEXT) {
+        if(doc_parse_expr(&ds, doc, 0)) break;
+    }
+    return doc;
+}
+
+void
+aconfig_doc_free(AConfigDoc doc)
+{
+    free(doc->nodes);
+    free(doc);
+}
+
+const AConfigNode*
+aconfig_doc_nodes(AConfigDoc doc, int *pcount)
+{
+    *pcount = doc->count;
+    return doc->nodes;
+}
+
+
 typedef struct
 {
     char   buff[1024];
@@ -54,4 +54,37 @@ extern unsigned     aconfig_unsigned(AConfig *root, const char *name, unsigned _
 extern int          aconfig_int     (AConfig *root, const char *name, int _default);
 extern const char*  aconfig_str     (AConfig *root, const char *name, const char *_default);
 
+
+/** CONFIGURATION DOCUMENTS
+ **
+ ** the same syntax, parsed without modifying or copying the text. the
+ ** nodes are stored in a single array and reference each other by index,
+ ** their names and values are spans of the source buffer. a document is
+ ** released at once by aconfig_doc_free().
+ **/
+typedef struct {
+    const char*  str;          /* not zero-terminated */
+    int          len;
+} AConfigSpan;
+
+typedef struct {
+    AConfigSpan  name;
+    AConfigSpan  value;        /* empty if the node has children */
+    int          first_child;  /* indices in the node array, or -1 */
+    int          last_child;
+    int          next;         /* next sibling */
+} AConfigNode;
+
+typedef struct AConfigDocRec_*  AConfigDoc;
+
+/* parse 'len' bytes of 'data', which must outlive the document. returns
+ * NULL if memory is exhausted */
+extern AConfigDoc   aconfig_doc_parse( const char*  data, int  len );
+
+extern void         aconfig_doc_free( AConfigDoc  doc );
+
+/* return the node array and its size. the first node is the root, with
+ * an empty name and the top-level keys as children */
+extern const AConfigNode*  aconfig_doc_nodes( AConfigDoc  doc, int*  pcount );
+
 #endif /* ANDROID_CONFIG_H */
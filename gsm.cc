@@ -10,6 +10,7 @@
 ** GNU General Public License for more details.
 */
 #include "gsm.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -104,16 +105,49 @@ gsm_bcdi_from_ascii( cbytes_t  ascii, int  asciilen, bytes_t  dst )
 }
 #endif
 
+/* the value of each hex char, or -1 */
+static const signed char  hex_values[256] = {
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+   0, 1, 2, 3, 4, 5, 6, 7, 8, 9,-1,-1,-1,-1,-1,-1,
+  -1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+};
+
+/* the two lowercase hex chars of each byte value */
+static const char  hex_pairs[512+1] =
+    "000102030405060708090a0b0c0d0e0f"
+    "101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f"
+    "303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f"
+    "505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f"
+    "707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f"
+    "909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeaf"
+    "b0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecf"
+    "d0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeef"
+    "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
 int
 gsm_hexchar_to_int( char  c )
 {
-    if ((unsigned)(c - '0') < 10)
-        return c - '0';
-    if ((unsigned)(c - 'a') < 6)
-        return 10 + (c - 'a');
-    if ((unsigned)(c - 'A') < 6)
-        return 10 + (c - 'A');
-    return -1;
+    return hex_values[(byte_t)c];
 }
 
 int
@@ -127,10 +161,10 @@ gsm_hexchar_to_int0( char  c )
 int
 gsm_hex2_to_byte( const char*  hex )
 {
-    int  hi = gsm_hexchar_to_int(hex[0]);
-    int  lo = gsm_hexchar_to_int(hex[1]);
+    int  hi = hex_values[(byte_t)hex[0]];
+    int  lo = hex_values[(byte_t)hex[1]];
 
-    if (hi < 0 || lo < 0)
+    if ((hi | lo) < 0)
         return -1;
 
     return ( (hi << 4) | lo );
@@ -160,10 +194,7 @@ gsm_hex2_to_byte0( const char*  hex )
 void
 gsm_hex_from_byte( char*  hex, int val )
 {
-    static const char  hexdigits[] = "0123456789abcdef";
-
-    hex[0] = hexdigits[(val >> 4) & 15];
-    hex[1] = hexdigits[val & 15];
+    memcpy( hex, hex_pairs + 2*(val & 255), 2 );
 }
 
 void
@@ -175,15 +206,134 @@ gsm_hex_from_short( char*  hex, int  val )
 
 
 
+/** WORDS
+ **
+ ** the hex and septet codecs below process 8 bytes at once in a 64-bit
+ ** word, with masks and adds that act on each byte separately.
+ **/
+/* read/write 8 bytes as a word, first byte lowest. the compiler turns the
+ * memcpy() into a single unaligned access on little-endian hosts */
+static __inline__ uint64_t
+word_load64( cbytes_t  p )
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t  w;
+
+    memcpy( &w, p, 8 );
+    return w;
+#else
+    return  (uint64_t)p[0]       | ((uint64_t)p[1] << 8)  |
+           ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+           ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+           ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+#endif
+}
+
+static __inline__ void
+word_store64( bytes_t  p, uint64_t  w )
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy( p, &w, 8 );
+#else
+    byte_t  temp[8];
+    int     nn;
+
+    for (nn = 0; nn < 8; nn++, w >>= 8)
+        temp[nn] = (byte_t) w;
+    memcpy( p, temp, 8 );
+#endif
+}
+
+#define  BYTES_1     0x0101010101010101ULL
+#define  BYTES_80    0x8080808080808080ULL
+
+/* set the high bit of each byte of 'w' that is 'n' or more, all bytes
+ * must be below 0x80 */
+#define  BYTES_GE(w,n)   (((w) + (0x80 - (n))*BYTES_1) & BYTES_80)
+
+/* set the high bit of each byte of 'w' that isn't 0 */
+#define  BYTES_NZ(w)   (((((w) & ~BYTES_80) + 0x7f*BYTES_1) | (w)) & BYTES_80)
+
+/* the number of high bits set in the bytes of 'w' */
+#define  BYTES_COUNT80(w)   ((int)(((((w) >> 7) * BYTES_1) >> 56) & 15))
+
+
 /** HEX
+ **
+ ** PDUs cross the AT channel as hex, so long messages are converted 16
+ ** chars / 8 bytes at a time in words. a char is checked with a few
+ ** compares on all bytes, and its value is its low nibble, plus 9 for
+ ** the letters. the nibbles are then gathered into bytes with shifts,
+ ** and the reverse for encoding.
  **/
+
+/* decode 8 hex chars, first one lowest, into 4 bytes in the low half of
+ * the result. the high bit of a byte of '*pbad' is set for an invalid char */
+static __inline__ uint64_t
+hex_decode8( uint64_t  w, uint64_t*  pbad )
+{
+    uint64_t  low   = w | (0x20*BYTES_1);    /* 'A'-'F' to 'a'-'f' */
+    uint64_t  digit = BYTES_GE(w, '0') & ~BYTES_GE(w, '9'+1);
+    uint64_t  alpha = BYTES_GE(low, 'a') & ~BYTES_GE(low, 'f'+1);
+
+    *pbad |= (w | ~(digit | alpha)) & BYTES_80;
+
+    w  = (w & (0x0f*BYTES_1)) + (alpha >> 7)*9;
+    w  = ((w & 0x000F000F000F000FULL) << 4) | ((w >> 8) & 0x000F000F000F000FULL);
+    w  = (w | (w >> 8))  & 0x0000FFFF0000FFFFULL;
+    w  = (w | (w >> 16)) & 0x00000000FFFFFFFFULL;
+    return w;
+}
+
+/* encode the 4 bytes of the low half of 'w' into 8 lowercase hex chars */
+static __inline__ uint64_t
+hex_encode4( uint64_t  w )
+{
+    w  = (w | (w << 16)) & 0x0000FFFF0000FFFFULL;
+    w  = (w | (w << 8))  & 0x00FF00FF00FF00FFULL;
+    w  = ((w >> 4) & 0x000F000F000F000FULL) | ((w & 0x000F000F000F000FULL) << 8);
+    return w + '0'*BYTES_1 + (BYTES_GE(w, 10) >> 7)*('a' - '0' - 10);
+}
+
+/* decode hex pairs until the end or the first invalid char, returns the
+ * number of bytes written */
+static int
+hex_decode( cbytes_t  hex, int  count, bytes_t  dst )
+{
+    int  nn = 0;
+
+    for ( ; nn + 8 <= count; nn += 8 ) {
+        uint64_t  bad = 0;
+        uint64_t  lo  = hex_decode8( word_load64( hex + 2*nn ), &bad );
+        uint64_t  hi  = hex_decode8( word_load64( hex + 2*nn + 8 ), &bad );
+
+        if (bad)
+            break;
+        word_store64( dst + nn, lo | (hi << 32) );
+    }
+    for ( ; nn < count; nn++ ) {
+        int  hi = hex_values[ hex[2*nn] ];
+        int  lo = hex_values[ hex[2*nn+1] ];
+
+        if ((hi | lo) < 0)
+            break;
+        dst[nn] = (byte_t)((hi << 4) | lo);
+    }
+    return nn;
+}
+
 void
 gsm_hex_to_bytes0( cbytes_t  hex, int  hexlen, bytes_t  dst )
 {
-    int  nn;
+    int  count = hexlen/2;
+    int  nn    = 0;
 
-    for (nn = 0; nn < hexlen/2; nn++ ) {
-        dst[nn] = (byte_t) gsm_hex2_to_byte0( (const char*)hex+2*nn );
+    for (;;) {
+        nn += hex_decode( hex + 2*nn, count - nn, dst + nn );
+        if (nn == count)
+            break;
+        dst[nn] = (byte_t) gsm_hex2_to_byte0( (const char*)hex + 2*nn );
+        nn += 1;
     }
     if (hexlen & 1) {
         dst[nn] = gsm_hexchar_to_int0( hex[2*nn] ) << 4;
@@ -193,26 +343,28 @@ gsm_hex_to_bytes0( cbytes_t  hex, int  hexlen, bytes_t  dst )
 int
 gsm_hex_to_bytes( cbytes_t  hex, int  hexlen, bytes_t  dst )
 {
-    int  nn;
-
     if (hexlen & 1)  /* must be even */
         return -1;
 
-    for (nn = 0; nn < hexlen/2; nn++ ) {
-        int  c = gsm_hex2_to_byte( (const char*)hex+2*nn );
-        if (c < 0) return -1;
-        dst[nn] = (byte_t) c;
-    }
+    if (hex_decode( hex, hexlen/2, dst ) < hexlen/2)
+        return -1;
+
     return hexlen/2;
 }
 
 void
 gsm_hex_from_bytes( char*  hex, cbytes_t  src, int  srclen )
 {
-    int  nn;
+    int  nn = 0;
 
-    for (nn = 0; nn < srclen; nn++) {
-        gsm_hex_from_byte( hex + 2*nn, src[nn] );
+    for ( ; nn + 8 <= srclen; nn += 8 ) {
+        uint64_t  w = word_load64( src + nn );
+
+        word_store64( (bytes_t)hex + 2*nn,     hex_encode4( w & 0xFFFFFFFFULL ) );
+        word_store64( (bytes_t)hex + 2*nn + 8, hex_encode4( w >> 32 ) );
+    }
+    for ( ; nn < srclen; nn++ ) {
+        memcpy( hex + 2*nn, hex_pairs + 2*src[nn], 2 );
     }
 }
 
@@ -452,42 +604,106 @@ ucs2_write( bytes_t  ucs2, int  offset, int  v )
     return 2;
 }
 
+/** UTF8 and UCS2 WORDS
+ **
+ ** even non-Latin messages have runs of ASCII (spaces, digits and
+ ** punctuation), so the routines below convert 8 ASCII bytes or 4 UCS2
+ ** characters below 0x80 at once in a word before falling back to one
+ ** character at a time. validation and length computations only look
+ ** at the top bits of each byte, and are done on whole words.
+ **/
+
+/* the number of characters that start in the 8 bytes of 'w', 'prev' being
+ * the byte before them. like utf8_next(), a 10xxxxxx continuation byte
+ * only extends a character if it follows a byte that is not ASCII */
+static __inline__ int
+utf8_count8( uint64_t  w, int  prev )
+{
+    uint64_t  cont  = w & ~(w << 1);
+    uint64_t  after = (w << 8) | (uint64_t)prev;
+    uint64_t  tail  = cont & after & BYTES_80;
+
+    return 8 - BYTES_COUNT80(tail);
+}
+
+/* spread 4 ASCII bytes from the low half of 'w' into 4 UCS2-BE characters */
+static __inline__ uint64_t
+ucs2_from_ascii4( uint64_t  w )
+{
+    w = (w | (w << 16)) & 0x0000FFFF0000FFFFULL;
+    w = (w | (w << 8))  & 0x00FF00FF00FF00FFULL;
+    return w << 8;
+}
+
+/* the reverse, 'w' must hold 4 UCS2-BE characters below 0x80 */
+static __inline__ uint64_t
+ucs2_to_ascii4( uint64_t  w )
+{
+    w = (w >> 8) & 0x00FF00FF00FF00FFULL;
+    w = (w | (w >> 8))  & 0x0000FFFF0000FFFFULL;
+    w = (w | (w >> 16)) & 0x00000000FFFFFFFFULL;
+    return w;
+}
+
+/* the mask of the bits that are 0 in 4 UCS2-BE characters below 0x80 */
+#define  UCS2_NOT_ASCII4   0x80FF80FF80FF80FFULL
+
+/* the number of utf8 bytes needed by 4 UCS2-BE characters, one byte for
+ * each, plus one from 0x80 and another one from 0x800 */
+static __inline__ int
+ucs2_utf8_len4( uint64_t  w )
+{
+    uint64_t  hi = w & 0x00FF00FF00FF00FFULL;
+    uint64_t  lo = (w >> 8) & 0x0080008000800080ULL;
+
+    return 4 + BYTES_COUNT80( BYTES_NZ(hi | lo) )
+             + BYTES_COUNT80( BYTES_NZ(hi & 0x00F800F800F800F8ULL) );
+}
+
+/* check the structure of 8 bytes of utf8: a 110xxxxx, 1110xxxx or 11110xxx
+ * lead byte must be followed by 1 to 3 10xxxxxx continuation bytes, and
+ * these can't appear elsewhere. '*pcarry' holds the continuation bytes
+ * expected at the start of 'w' by the previous word, and is updated for
+ * the next one. returns 0 if the bytes are valid */
+static __inline__ uint64_t
+utf8_check8( uint64_t  w, uint64_t*  pcarry )
+{
+    uint64_t  cont  = w & ~(w << 1);
+    uint64_t  lead  = w &  (w << 1);
+    uint64_t  lead3 = lead  & (w << 2);
+    uint64_t  lead4 = lead3 & (w << 3);
+    uint64_t  need  = (lead << 8) | (lead3 << 16) | (lead4 << 24) | *pcarry;
+
+    *pcarry = ((lead >> 56) | (lead3 >> 48) | (lead4 >> 40)) & BYTES_80;
+    return ((need ^ cont) | (lead4 & (w << 4))) & BYTES_80;
+}
+
 int
 utf8_check( cbytes_t   p, int  utf8len )
 {
-    cbytes_t  end    = p + utf8len;
-    int       result = 0;
+    cbytes_t  end   = p + utf8len;
+    uint64_t  carry = 0;
+    uint64_t  bad   = 0;
+    byte_t    temp[8];
 
-    if (p) {
-        while (p < end) {
-            int  c = *p++;
-            if (c >= 128) {
-                int  len;
-                if ((c & 0xe0) == 0xc0) {
-                    len = 1;
-                }
-                else if ((c & 0xf0) == 0xe0) {
-                    len = 2;
-                }
-                else if ((c & 0xf8) == 0xf0) {
-                    len = 3;
-                }
-                else
-                    goto Exit;  /* malformed utf-8 */
+    if (p == NULL)
+        return 0;
 
-                if (p+len > end) /* string too short */
-                    goto Exit;
+    for ( ; p + 8 <= end; p += 8 ) {
+        uint64_t  w = word_load64(p);
 
-                for ( ; len > 0; len--, p++ ) {
-                    if ((p[0] & 0xc0) != 0x80)
-                        goto Exit;
-                }
-            }
-        }
-        result = 1;
+        if (!((w | carry) & BYTES_80))
+            continue;
+        bad |= utf8_check8( w, &carry );
     }
-Exit:
-    return result;
+
+    /* the last bytes are padded with ASCII, a truncated character
+     * then misses a continuation byte */
+    memset( temp, 0, sizeof(temp) );
+    memcpy( temp, p, end - p );
+    bad |= utf8_check8( word_load64(temp), &carry );
+
+    return !(bad | carry);
 }
 
 /** UCS2 to UTF8
@@ -499,12 +715,49 @@ ucs2_to_utf8( cbytes_t  ucs2,
               int       ucs2len,
               bytes_t   buf )
 {
-    int  nn;
-    int  result = 0;
+    cbytes_t  end    = ucs2 + 2*ucs2len;
+    int       result = 0;
+
+    if (buf == NULL) {
+        for ( ; ucs2 + 8 <= end; ucs2 += 8 )
+            result += ucs2_utf8_len4( word_load64(ucs2) );
+        for ( ; ucs2 < end; ucs2 += 2 ) {
+            int  c = (ucs2[0] << 8) | ucs2[1];
+            result += 1 + (c >= 0x80) + (c >= 0x800);
+        }
+        return result;
+    }
+
+    while (ucs2 < end) {
+        int  c;
+
+        if (ucs2[0] == 0 && ucs2 + 16 <= end) {
+            uint64_t  w0 = word_load64( ucs2 );
+            uint64_t  w1 = word_load64( ucs2 + 8 );
+
+            if (!((w0 | w1) & UCS2_NOT_ASCII4)) {
+                word_store64( buf + result, ucs2_to_ascii4(w0) | (ucs2_to_ascii4(w1) << 32) );
+                result += 8;
+                ucs2   += 16;
+                continue;
+            }
+        }
+        c     = (ucs2[0] << 8) | ucs2[1];
+        ucs2 += 2;
 
-    for (nn = 0; nn < ucs2len; ucs2 += 2, nn++) {
-        int  c= (ucs2[0] << 8) | ucs2[1];
-        result += utf8_write(buf, result, c);
+        if (c < 0x80) {
+            buf[result] = (byte_t) c;
+            result += 1;
+        } else if (c < 0x800) {
+            buf[result+0] = (byte_t)( 0xc0 | (c >> 6) );
+            buf[result+1] = (byte_t)( 0x80 | (c & 0x3f) );
+            result += 2;
+        } else {
+            buf[result+0] = (byte_t)( 0xe0 |  (c >> 12) );
+            buf[result+1] = (byte_t)( 0x80 | ((c >> 6) & 0x3f) );
+            buf[result+2] = (byte_t)( 0x80 |  (c & 0x3f) );
+            result += 3;
+        }
     }
     return result;
 }
@@ -519,15 +772,63 @@ utf8_to_ucs2( cbytes_t  utf8,
     cbytes_t  end    = p + utf8len;
     int       result = 0;
 
+    if (ucs2 == NULL) {
+        int  prev = 0;
+
+        for ( ; p + 8 <= end; p += 8 ) {
+            result += utf8_count8( word_load64(p), prev );
+            prev    = p[7];
+        }
+        for ( ; p < end; prev = *p++ )
+            result += ((p[0] & 0xc0) != 0x80 || prev < 0x80);
+        return result;
+    }
+
     while (p < end) {
-        int  c = utf8_next(&p, end);
+        int  c;
 
-        if (c < 0)
-            break;
+        if (p + 8 <= end) {
+            uint64_t  w = word_load64(p);
 
-        result += ucs2_write(ucs2, result, c);
+            if (!(w & BYTES_80)) {
+                word_store64( ucs2 + 2*result,     ucs2_from_ascii4( w & 0xFFFFFFFFULL ) );
+                word_store64( ucs2 + 2*result + 8, ucs2_from_ascii4( w >> 32 ) );
+                result += 8;
+                p      += 8;
+                continue;
+            }
+            /* well-formed 2 and 3-byte characters, not followed by a stray
+             * continuation byte that utf8_next() would also take. four
+             * 2-byte ones, as in Cyrillic, Greek or Arabic, fill a word */
+            if ((w & 0xC0E0C0E0C0E0C0E0ULL) == 0x80C080C080C080C0ULL &&
+                (p + 8 == end || (p[8] & 0xc0) != 0x80)) {
+                w = ((w & 0x001F001F001F001FULL) << 6) | ((w >> 8) & 0x003F003F003F003FULL);
+                w = ((w >> 8) & 0x00FF00FF00FF00FFULL) | ((w & 0x00FF00FF00FF00FFULL) << 8);
+                word_store64( ucs2 + 2*result, w );
+                result += 4;
+                p      += 8;
+                continue;
+            }
+            if ((w & 0xC0E0) == 0x80C0 && (w & 0xC00000) != 0x800000) {
+                c  = (int)(((w & 0x1f) << 6) | ((w >> 8) & 0x3f));
+                p += 2;
+                ucs2_write(ucs2, 2*result, c);
+                result += 1;
+                continue;
+            }
+            if ((w & 0xC0C0F0) == 0x8080E0 && (w & 0xC0000000) != 0x80000000) {
+                c  = (int)(((w & 0x0f) << 12) | ((w >> 2) & 0xfc0) | ((w >> 16) & 0x3f));
+                p += 3;
+                ucs2_write(ucs2, 2*result, c);
+                result += 1;
+                continue;
+            }
+        }
+        c = utf8_next(&p, end);
+        ucs2_write(ucs2, 2*result, c);
+        result += 1;
     }
-    return result/2;
+    return result;
 }
 
 
@@ -561,46 +862,71 @@ static const unsigned short  gsm7bits_extend_to_unicode[128] = {
 };
 
 
-static int
-unichar_to_gsm7( int  unicode )
-{
-    int  nn;
-    for (nn = 0; nn < 128; nn++) {
-        if (gsm7bits_to_unicode[nn] == unicode) {
-            return nn;
-        }
-    }
-    return -1;
-}
+/* the reverse of the two tables above, so that encoding a character costs a
+ * single lookup. codes are septets of the default alphabet, or of the extension
+ * table when GSM_7BITS_EXTENDED is set. where a character appears twice, the
+ * first occurence wins, as with a linear search */
+#define  GSM_7BITS_EXTENDED  0x80
+#define  GSM_7BITS_NONE      0xff
+
+static const unsigned char  latin1_to_gsm7[256] = {
+  0x1b,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0x0a,0xff,0x8a,0x0d,0xff,0xff,
+  0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+  0x20,0x21,0x22,0x23,0x02,0x25,0x26,0x27,0x28,0x29,0x2a,0x2b,0x2c,0x2d,0x2e,0x2f,
+  0x30,0x31,0x32,0x33,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x3b,0x3c,0x3d,0x3e,0x3f,
+  0x00,0x41,0x42,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x4b,0x4c,0x4d,0x4e,0x4f,
+  0x50,0x51,0x52,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0xbc,0xaf,0xbe,0x94,0x11,
+  0xff,0x61,0x62,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x6b,0x6c,0x6d,0x6e,0x6f,
+  0x70,0x71,0x72,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0xa8,0xc0,0xa9,0xbd,0xff,
+  0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+  0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+  0xff,0x40,0xff,0x01,0x24,0x03,0xff,0x5f,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+  0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0x60,
+  0xff,0xff,0xff,0xff,0x5b,0x0e,0x1c,0x09,0xff,0x1f,0xff,0xff,0xff,0xff,0xff,0xff,
+  0xff,0xff,0xff,0xff,0xff,0xff,0x5c,0xff,0x0b,0xff,0xff,0xff,0x5e,0xff,0xff,0x1e,
+  0x7f,0xff,0xff,0xff,0x7b,0x0f,0x1d,0xff,0x04,0x05,0xff,0xff,0x07,0xff,0xff,0xff,
+  0xff,0x7d,0x08,0xff,0xff,0xff,0x7c,0xff,0x0c,0x06,0xff,0xff,0x7e,0xff,0xff,0xff,
+};
 
-static int
-unichar_to_gsm7_extend( int  unichar )
+/* the few characters above U+00FF, perfectly hashed by GSM7_HASH() */
+#define  GSM7_HASH(u)  (((u) ^ ((u) >> 5)) & 31)
+
+static const struct {
+    unsigned short  unicode;
+    unsigned char   code;
+} unicode_to_gsm7_hash[32] = {
+   {     0,0xff}, {     0,0xff}, { 0x39e,0x1a}, {     0,0xff},
+   { 0x398,0x19}, {     0,0xff}, {     0,0xff}, { 0x39b,0x14},
+   { 0x394,0x10}, {0x20ac,0xe5}, {     0,0xff}, {     0,0xff},
+   {     0,0xff}, { 0x147,0x5d}, {     0,0xff}, { 0x393,0x13},
+   {     0,0xff}, {     0,0xff}, {     0,0xff}, {     0,0xff},
+   { 0x3a9,0x15}, { 0x3a8,0x17}, {     0,0xff}, {     0,0xff},
+   {     0,0xff}, {     0,0xff}, {     0,0xff}, { 0x3a6,0x12},
+   {     0,0xff}, { 0x3a0,0x16}, { 0x3a3,0x18}, {     0,0xff},
+};
+
+static __inline__ int
+unichar_to_gsm7_code( int  unicode )
 {
-    int  nn;
-    for (nn = 0; nn < 128; nn++) {
-        if (gsm7bits_extend_to_unicode[nn] == unichar) {
-            return nn;
-        }
-    }
-    return -1;
-}
+    if ((unsigned)unicode < 256)
+        return latin1_to_gsm7[unicode];
 
+    if (unicode < 0x10000 && unicode_to_gsm7_hash[GSM7_HASH(unicode)].unicode == unicode)
+        return unicode_to_gsm7_hash[GSM7_HASH(unicode)].code;
+
+    return GSM_7BITS_NONE;
+}
 
 /* return the number of septets needed to encode a unicode charcode */
 static int
 unichar_to_gsm7_count( int  unicode )
 {
-    int  nn;
+    int  code = unichar_to_gsm7_code(unicode);
 
-    nn = unichar_to_gsm7(unicode);
-    if (nn >= 0)
-        return 1;
-
-    nn = unichar_to_gsm7_extend(unicode);
-    if (nn >= 0)
-        return 2;
+    if (code == GSM_7BITS_NONE)
+        return 0;
 
-    return 0;
+    return (code & GSM_7BITS_EXTENDED) ? 2 : 1;
 }
 
 
@@ -647,6 +973,186 @@ utf8_check_gsm7( cbytes_t  utf8,
 }
 
 
+typedef struct {
+    GsmSegment  segments;
+    int         count;
+    int         max;
+    int         limit;   /* units per segment */
+    int         total;   /* units in all segments */
+} GsmSplitterRec, *GsmSplitter;
+
+/* add a character of 'units' septets or UCS-2 characters */
+static int
+gsm_splitter_add( GsmSplitter  s, int  offset, int  len, int  units )
+{
+    GsmSegment  seg;
+
+    if (s->count == 0 || s->segments[s->count-1].count + units > s->limit) {
+        if (s->count == s->max) {
+            int  max = s->max ? s->max*2 : 4;
+
+            seg = (GsmSegment) realloc( s->segments, max*sizeof(seg[0]) );
+            if (seg == NULL)
+                return -1;
+
+            s->segments = seg;
+            s->max      = max;
+        }
+        seg = s->segments + s->count++;
+        seg->offset = offset;
+        seg->len    = 0;
+        seg->count  = 0;
+    }
+    seg = s->segments + s->count-1;
+    seg->len   += len;
+    seg->count += units;
+    s->total   += units;
+    return 0;
+}
+
+/* return the segments of 's', merged into a single one if all its units
+ * fit in 'single' */
+static int
+gsm_splitter_finish( GsmSplitter  s, int  single, GsmSegment  *psegments )
+{
+    if (s->count > 1 && s->total <= single) {
+        GsmSegment  last = s->segments + s->count-1;
+
+        s->segments[0].len   = last->offset + last->len - s->segments[0].offset;
+        s->segments[0].count = s->total;
+        s->count             = 1;
+    }
+    *psegments = s->segments;
+    return s->count;
+}
+
+int
+utf8_split_segments( cbytes_t     utf8,
+                     int          utf8len,
+                     int          single_septets,
+                     int          single_ucs2,
+                     int          max_septets,
+                     int          max_ucs2,
+                     int         *pgsm7,
+                     GsmSegment  *psegments )
+{
+    cbytes_t        p    = utf8;
+    cbytes_t        end  = utf8 + utf8len;
+    int             gsm7 = 1;
+    GsmSplitterRec  s7[1], s16[1];
+
+    memset( s7, 0, sizeof(s7) );
+    memset( s16, 0, sizeof(s16) );
+    s7->limit  = max_septets;
+    s16->limit = max_ucs2;
+
+    /* both splits are computed at once, the GSM one is dropped as soon as
+     * a character can't be encoded */
+    while (p < end) {
+        cbytes_t  q = p;
+        int       c = utf8_next( &q, end );
+
+        if (gsm7) {
+            int  len = unichar_to_gsm7_count( c );
+
+            if (len == 0) {
+                gsm7 = 0;
+                free( s7->segments );
+            }
+            else if (gsm_splitter_add( s7, p - utf8, q - p, len ) < 0)
+                goto Fail;
+        }
+        if (gsm_splitter_add( s16, p - utf8, q - p, 1 ) < 0)
+            goto Fail;
+
+        p = q;
+    }
+
+    *pgsm7 = gsm7;
+    if (gsm7) {
+        free( s16->segments );
+        return gsm_splitter_finish( s7, single_septets, psegments );
+    }
+    return gsm_splitter_finish( s16, single_ucs2, psegments );
+
+Fail:
+    if (gsm7)
+        free( s7->segments );
+    free( s16->segments );
+    return -1;
+}
+
+
+/** SEPTET GROUPS
+ **
+ ** 8 septets fill exactly 7 bytes. when a packed string is aligned on such
+ ** a group, the septets are moved between their packed form and one byte
+ ** each of a 64-bit word with a few masks and shifts, instead of one at a
+ ** time. this only relies on 64-bit integers, and works on any host.
+ **/
+
+/* read/write 7 bytes as the low 56 bits of a word, first byte lowest */
+static __inline__ uint64_t
+gsm7_load56( cbytes_t  src )
+{
+    uint64_t  w = 0;
+    int       nn;
+
+    for (nn = 6; nn >= 0; nn--)
+        w = (w << 8) | src[nn];
+    return w;
+}
+
+static __inline__ void
+gsm7_store56( bytes_t  dst, uint64_t  w )
+{
+    byte_t  temp[8];
+    int     nn;
+
+    for (nn = 0; nn < 7; nn++, w >>= 8)
+        temp[nn] = (byte_t) w;
+    memcpy( dst, temp, 7 );
+}
+
+/* spread 8 packed septets to one per byte, first septet in the lowest byte */
+static __inline__ uint64_t
+gsm7_unpack8( uint64_t  w )
+{
+    w = (w & 0x000000000FFFFFFFULL) | ((w & 0x00FFFFFFF0000000ULL) << 4);
+    w = (w & 0x00003FFF00003FFFULL) | ((w & 0x0FFFC0000FFFC000ULL) << 2);
+    w = (w & 0x007F007F007F007FULL) | ((w & 0x3F803F803F803F80ULL) << 1);
+    return w;
+}
+
+/* the reverse, all bytes must be below 0x80 */
+static __inline__ uint64_t
+gsm7_pack8( uint64_t  w )
+{
+    w = (w & 0x007F007F007F007FULL) | ((w & 0x7F007F007F007F00ULL) >> 1);
+    w = (w & 0x00003FFF00003FFFULL) | ((w & 0x3FFF00003FFF0000ULL) >> 2);
+    w = (w & 0x000000000FFFFFFFULL) | ((w & 0x0FFFFFFF00000000ULL) >> 4);
+    return w;
+}
+
+/* return 0 if the 8 bytes of 'w' are ASCII characters that are their own
+ * septet in the default alphabet: space to 'z', except '$', '@', '[' to '`'
+ * and '{' to DEL. this covers most text, and needs no table lookup */
+static __inline__ uint64_t
+gsm7_not_same8( uint64_t  w )
+{
+    uint64_t  bad;
+
+    if (w & BYTES_80)
+        return 1;
+
+    bad  = ~BYTES_GE(w, 0x20);
+    bad |= ~BYTES_GE(w ^ (0x24*BYTES_1), 1);
+    bad |= ~BYTES_GE(w ^ (0x40*BYTES_1), 1);
+    bad |=  BYTES_GE(w, 0x5b) & ~BYTES_GE(w, 0x61);
+    bad |=  BYTES_GE(w, 0x7b);
+    return bad & BYTES_80;
+}
+
 int
 utf8_from_gsm7( cbytes_t  src,
                 int       septet_offset,
@@ -658,17 +1164,32 @@ utf8_from_gsm7( cbytes_t  src,
     int  result  = 0;
 
     src += (septet_offset >> 3);
-    for ( ; septet_count > 0; septet_count-- )
+    while (septet_count > 0)
     {
-        int  c = (src[0] >> shift) & 0x7f;
-        int  v;
+        int  c, v;
+
+        /* 8 septets that decode to themselves */
+        if (shift == 0 && septet_count >= 8 && !escaped) {
+            uint64_t  w = gsm7_unpack8( gsm7_load56( src ) );
+
+            if (!gsm7_not_same8( w )) {
+                if (utf8)
+                    word_store64( utf8 + result, w );
+                result       += 8;
+                src          += 7;
+                septet_count -= 8;
+                continue;
+            }
+        }
 
+        c = (src[0] >> shift) & 0x7f;
         if (shift > 1) {
             c = ((src[1] << (8-shift)) | c) & 0x7f;
         }
 
         if (escaped) {
             v = gsm7bits_extend_to_unicode[c];
+            escaped = 0;
         } else if (c == GSM_7BITS_ESCAPE) {
             escaped = 1;
             goto NextSeptet;
@@ -679,6 +1200,7 @@ utf8_from_gsm7( cbytes_t  src,
         result += utf8_write( utf8, result, v );
 
     NextSeptet:
+        septet_count -= 1;
         shift += 7;
         if (shift >= 8) {
             shift -= 8;
@@ -688,7 +1210,6 @@ utf8_from_gsm7( cbytes_t  src,
     return  result;
 }
 
-
 int
 utf8_from_gsm8( cbytes_t  src, int  count, bytes_t  utf8 )
 {
@@ -746,34 +1267,52 @@ ucs2_from_gsm7( bytes_t   ucs2,
     int                   escaped = 0;
     int                   result  = 0;
 
-    for ( ; septet_count > 0; septet_count-- )
+    while (septet_count > 0)
     {
-        unsigned  val  = (p[0] >> shift) & 0x7f;
+        unsigned  val;
 
+        if (shift == 0 && septet_count >= 8 && !escaped) {
+            uint64_t  w = gsm7_unpack8( gsm7_load56( p ) );
+
+            if (!gsm7_not_same8( w )) {
+                int  nn;
+                for (nn = 0; nn < 8; nn++, w >>= 8)
+                    result += ucs2_write( ucs2, result, (int)(w & 0xff) );
+                p            += 7;
+                septet_count -= 8;
+                continue;
+            }
+        }
+
+        val = (p[0] >> shift) & 0x7f;
         if (shift > 1)
             val = (val | (p[1] << (8-shift))) & 0x7f;
 
         if (escaped) {
-            int  c = gsm7bits_to_unicode[val];
+            val = gsm7bits_extend_to_unicode[val];
+            if (val == 0)
+                val = 0x20;
 
-            result += ucs2_write(ucs2, result, c);
+            result += ucs2_write(ucs2, result, val);
             escaped = 0;
         }
         else if (val == GSM_7BITS_ESCAPE) {
             escaped = 1;
         }
         else {
-            val = gsm7bits_extend_to_unicode[val];
-            if (val == 0)
-                val = 0x20;
+            result += ucs2_write( ucs2, result, gsm7bits_to_unicode[val] );
+        }
 
-            result += ucs2_write( ucs2, result, val );
+        septet_count -= 1;
+        shift += 7;
+        if (shift >= 8) {
+            shift -= 8;
+            p     += 1;
         }
     }
     return result/2;
 }
 
-
 /* count the number of septets required to write a utf8 string */
 static int
 utf8_to_gsm7_count( cbytes_t  utf8, int  utf8len )
@@ -833,6 +1372,19 @@ bwriter_add7( BWriter  writer, unsigned  value )
     writer->offset += 7;
 }
 
+/* add 8 septets at once, packed in the low 56 bits of 'word' */
+static void
+bwriter_add56( BWriter  writer, uint64_t  word )
+{
+    /* the pending bits and the group fit in 63 bits */
+    word = writer->pad | (word << writer->bits);
+
+    gsm7_store56( writer->dst, word );
+    writer->pad     = (unsigned)(word >> 56);
+    writer->dst    += 7;
+    writer->offset += 56;
+}
+
 static int
 bwriter_done( BWriter  writer )
 {
@@ -850,6 +1402,7 @@ int
 utf8_to_gsm7( cbytes_t  utf8, int  utf8len, bytes_t  dst, int offset )
 {
     const unsigned char*  utf8end = utf8 + utf8len;
+    const unsigned char*  retry   = utf8;
     BWriterRec            writer[1];
 
     if (dst == NULL)
@@ -857,27 +1410,33 @@ utf8_to_gsm7( cbytes_t  utf8, int  utf8len, bytes_t  dst, int offset )
 
     bwriter_init( writer, dst, offset );
     while ( utf8 < utf8end ) {
-        int  c = utf8_next( &utf8, utf8end );
-        int  nn;
+        int  c, nn;
 
-        if (c < 0)
-            break;
+        /* 8 ASCII characters that are their own septets */
+        if (utf8 >= retry && utf8end - utf8 >= 8) {
+            uint64_t  w = word_load64( utf8 );
 
-        nn = unichar_to_gsm7(c);
-        if (nn >= 0) {
-            bwriter_add7( writer, nn );
-            continue;
+            if (!gsm7_not_same8( w )) {
+                bwriter_add56( writer, gsm7_pack8( w ) );
+                utf8 += 8;
+                continue;
+            }
+            retry = utf8 + 8;
         }
 
-        nn = unichar_to_gsm7_extend(c);
-        if (nn >= 0) {
+        c = utf8_next( &utf8, utf8end );
+        if (c < 0)
+            break;
+
+        nn = unichar_to_gsm7_code(c);
+        if (nn == GSM_7BITS_NONE) {
+            /* unknown => replaced by space */
+            bwriter_add7( writer, 0x20 );
+        } else if (nn & GSM_7BITS_EXTENDED) {
             bwriter_add7( writer, GSM_7BITS_ESCAPE );
+            bwriter_add7( writer, nn & 0x7f );
+        } else
             bwriter_add7( writer, nn );
-            continue;
-        }
-
-        /* unknown => replaced by space */
-        bwriter_add7( writer, 0x20 );
     }
     return  bwriter_done( writer );
 }
@@ -896,28 +1455,23 @@ utf8_to_gsm8( cbytes_t  utf8, int  utf8len, bytes_t  dst )
         if (c < 0)
             break;
 
-        nn = unichar_to_gsm7(c);
-        if (nn >= 0) {
+        nn = unichar_to_gsm7_code(c);
+        if (nn == GSM_7BITS_NONE) {
+            /* unknown => space */
             if (dst)
-                dst[result] = (byte_t)nn;
+                dst[result] = 0x20;
             result += 1;
-            continue;
-        }
-
-        nn = unichar_to_gsm7_extend(c);
-        if (nn >= 0) {
+        } else if (nn & GSM_7BITS_EXTENDED) {
             if (dst) {
                 dst[result+0] = (byte_t) GSM_7BITS_ESCAPE;
-                dst[result+1] = (byte_t) nn;
+                dst[result+1] = (byte_t)(nn & 0x7f);
             }
             result += 2;
-            continue;
+        } else {
+            if (dst)
+                dst[result] = (byte_t)nn;
+            result += 1;
         }
-
-        /* unknown => space */
-        if (dst)
-            dst[result] = 0x20;
-        result += 1;
     }
     return  result;
 }
@@ -930,29 +1484,17 @@ ucs2_to_gsm7( cbytes_t  ucs2, int  ucs2len, bytes_t  dst, int offset )
     BWriterRec            writer[1];
 
     bwriter_init( writer, dst, offset );
-    while ( ucs2 < ucs2end ) {
-        int  c = *ucs2++;
-        int  nn;
+    for ( ; ucs2 < ucs2end; ucs2 += 2 ) {
+        int  nn = unichar_to_gsm7_code( (ucs2[0] << 8) | ucs2[1] );
 
-        for (nn = 0; nn < 128; nn++) {
-            if ( gsm7bits_to_unicode[nn] == c ) {
-                bwriter_add7( writer, nn );
-                goto NextUnicode;
-            }
-        }
-        for (nn = 0; nn < 128; nn++) {
-            if ( gsm7bits_extend_to_unicode[nn] == c ) {
-                bwriter_add7( writer, GSM_7BITS_ESCAPE );
-                bwriter_add7( writer, nn );
-                goto NextUnicode;
-            }
-        }
-
-        /* unknown */
-        bwriter_add7( writer, 0x20 );
-
-    NextUnicode:
-        ;
+        if (nn == GSM_7BITS_NONE) {
+            /* unknown */
+            bwriter_add7( writer, 0x20 );
+        } else if (nn & GSM_7BITS_EXTENDED) {
+            bwriter_add7( writer, GSM_7BITS_ESCAPE );
+            bwriter_add7( writer, nn & 0x7f );
+        } else
+            bwriter_add7( writer, nn );
     }
     return  bwriter_done( writer );
 }
@@ -964,30 +1506,18 @@ ucs2_to_gsm8( cbytes_t  ucs2, int  ucs2len, bytes_t  dst )
     const unsigned char*  ucs2end = ucs2 + ucs2len*2;
     bytes_t               dst0    = dst;
 
-    while ( ucs2 < ucs2end ) {
-        int  c = *ucs2++;
-        int  nn;
-
-        for (nn = 0; nn < 128; nn++) {
-            if ( gsm7bits_to_unicode[nn] == c ) {
-                *dst++ = (byte_t)nn;
-                goto NextUnicode;
-            }
-        }
-        for (nn = 0; nn < 128; nn++) {
-            if ( gsm7bits_extend_to_unicode[nn] == c ) {
-                dst[0] = (byte_t) GSM_7BITS_ESCAPE;
-                dst[1] = (byte_t) nn;
-                dst   += 2;
-                goto NextUnicode;
-            }
-        }
-
-        /* unknown */
-        *dst++ = 0x20;
-
-    NextUnicode:
-        ;
+    for ( ; ucs2 < ucs2end; ucs2 += 2 ) {
+        int  nn = unichar_to_gsm7_code( (ucs2[0] << 8) | ucs2[1] );
+
+        if (nn == GSM_7BITS_NONE) {
+            /* unknown */
+            *dst++ = 0x20;
+        } else if (nn & GSM_7BITS_EXTENDED) {
+            dst[0] = (byte_t) GSM_7BITS_ESCAPE;
+            dst[1] = (byte_t)(nn & 0x7f);
+            dst   += 2;
+        } else
+            *dst++ = (byte_t)nn;
     }
     return (dst - dst0);
 }
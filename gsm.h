@@ -78,6 +78,25 @@ extern int      utf8_check_gsm7( cbytes_t  utf8, int  utf8len );
 /* try to skip enough utf8 characters to generate gsm7len GSM septets */
 extern cbytes_t utf8_skip_gsm7( cbytes_t  utf8, cbytes_t  utf8end, int  gsm7len );
 
+/* a part of a utf8 string that is sent in a single SMS */
+typedef struct {
+    int  offset;     /* in the utf8 string */
+    int  len;        /* in utf8 bytes */
+    int  count;      /* GSM septets, or UCS-2 characters */
+} GsmSegmentRec, *GsmSegment;
+
+/* split a utf8 string into SMS segments, decoding each character only once. if all
+   characters can be encoded into the GSM alphabet, '*pgsm7' is set to 1 and segments
+   hold up to 'max_septets' septets, escape sequences being never split. otherwise it is
+   set to 0 and they hold up to 'max_ucs2' UCS-2 characters. a string of at most
+   'single_septets' septets (or 'single_ucs2' characters) gives a single segment instead.
+   returns the number of segments and sets '*psegments' to a malloc()-ed array, or
+   returns -1 on error */
+extern int      utf8_split_segments( cbytes_t  utf8, int  utf8len,
+                                     int  single_septets, int  single_ucs2,
+                                     int  max_septets, int  max_ucs2,
+                                     int  *pgsm7, GsmSegment  *psegments );
+
 /* convert a utf-8 string into a GSM septet string, assumes 'dst' is NULL or is properly sized,
    and that all characters are representable. 'offset' is the starting bit offset in 'dst'.
    non-representable characters are replaced by spaces.
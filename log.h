@@ -2,7 +2,9 @@
 #include <stdlib.h>
 #include <errno.h>
 
+#ifndef DEBUG
 #define  DEBUG  1
+#endif
 
 #ifndef HOST_BUILD
 
@@ -0,0 +1,281 @@
+/* Copyright (C) 2007-2008 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#include "net_iface.h"
+#include "sysdeps.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include "log.h"
+
+typedef struct ANetIfaceRec_ {
+    struct ANetIfaceRec_*  next;                        /* in _s_ifaces */
+    char                   name[ IFNAMSIZ ];
+    int                    index;                       /* 0 if the interface doesn't exist */
+    char                   address[ INET_ADDRSTRLEN ];  /* empty if none */
+} ANetIfaceRec;
+
+/* a single rtnetlink socket serves all interfaces, it is opened with the
+ * first one and closed with the last one. NULL if notifications are
+ * unavailable */
+static SysChannel  _s_netlink;
+static ANetIface   _s_ifaces;
+
+
+/* read the index and primary address of the interface from the kernel */
+static void
+anetiface_query( ANetIface  iface )
+{
+    struct ifreq  ifr;
+    int           fd;
+
+    iface->address[0] = 0;
+    iface->index      = if_nametoindex( iface->name );
+    if (iface->index == 0)
+        return;
+
+    fd = socket( AF_INET, SOCK_DGRAM, 0 );
+    if (fd < 0)
+        return;
+
+    memset( &ifr, 0, sizeof(ifr) );
+    ifr.ifr_addr.sa_family = AF_INET;
+    memcpy( ifr.ifr_name, iface->name, strlen(iface->name)+1 );
+
+    if (ioctl( fd, SIOCGIFADDR, &ifr ) == 0)
+        inet_ntop( AF_INET, &((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr,
+                   iface->address, sizeof(iface->address) );
+    close( fd );
+}
+
+static void
+anetiface_on_link( ANetIface  iface, struct nlmsghdr*  nh )
+{
+    struct ifinfomsg*  ifi  = (struct ifinfomsg*) NLMSG_DATA(nh);
+    struct rtattr*     rta  = IFLA_RTA(ifi);
+    int                len  = IFLA_PAYLOAD(nh);
+    const char*        name = NULL;
+
+    for ( ; RTA_OK(rta, len); rta = RTA_NEXT(rta, len) ) {
+        if (rta->rta_type == IFLA_IFNAME) {
+            name = (const char*) RTA_DATA(rta);
+            break;
+        }
+    }
+
+    if (nh->nlmsg_type == RTM_DELLINK) {
+        if (ifi->ifi_index == iface->index) {
+            iface->index      = 0;
+            iface->address[0] = 0;
+        }
+        return;
+    }
+
+    if (name != NULL && !strcmp( name, iface->name )) {
+        /* created, or renamed to our name */
+        if (ifi->ifi_index != iface->index)
+            anetiface_query( iface );
+    } else if (ifi->ifi_index == iface->index) {
+        /* renamed to something else */
+        iface->index      = 0;
+        iface->address[0] = 0;
+    }
+}
+
+static void
+anetiface_on_address( ANetIface  iface, struct nlmsghdr*  nh )
+{
+    struct ifaddrmsg*  ifa  = (struct ifaddrmsg*) NLMSG_DATA(nh);
+    struct rtattr*     rta  = IFA_RTA(ifa);
+    int                len  = IFA_PAYLOAD(nh);
+    const void*        addr = NULL;
+
+    if (ifa->ifa_family != AF_INET || iface->index == 0 ||
+        (int)ifa->ifa_index != iface->index)
+        return;
+
+    if (nh->nlmsg_type == RTM_DELADDR) {
+        /* another address may take over as the primary one */
+        anetiface_query( iface );
+        return;
+    }
+
+    /* secondary addresses are not the ones SIOCGIFADDR returns */
+    if (iface->address[0] != 0 && (ifa->ifa_flags & IFA_F_SECONDARY))
+        return;
+
+    for ( ; RTA_OK(rta, len); rta = RTA_NEXT(rta, len) ) {
+        if (rta->rta_type == IFA_LOCAL) {
+            addr = RTA_DATA(rta);
+            break;
+        }
+        if (rta->rta_type == IFA_ADDRESS)
+            addr = RTA_DATA(rta);
+    }
+    if (addr != NULL)
+        inet_ntop( AF_INET, addr, iface->address, sizeof(iface->address) );
+}
+
+static void
+anetiface_netlink_event( void*  opaque, int  events )
+{
+    ANetIface  iface;
+    int        fd = channel_get_fd( _s_netlink );
+    char       buff[ 8192 ];
+
+    opaque = opaque;
+    events = events;
+
+    for (;;) {
+        struct nlmsghdr*  nh;
+        int               len = recv( fd, buff, sizeof(buff), MSG_DONTWAIT );
+
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == ENOBUFS) {
+                /* notifications were dropped, start over from the kernel state */
+                for (iface = _s_ifaces; iface != NULL; iface = iface->next)
+                    anetiface_query( iface );
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                D( "netlink recv failed: %s", strerror(errno) );
+            return;
+        }
+        if (len == 0)
+            return;
+
+        for (nh = (struct nlmsghdr*) buff; NLMSG_OK(nh, (unsigned)len); nh = NLMSG_NEXT(nh, len)) {
+            switch (nh->nlmsg_type) {
+                case RTM_NEWLINK:
+                case RTM_DELLINK:
+                    for (iface = _s_ifaces; iface != NULL; iface = iface->next)
+                        anetiface_on_link( iface, nh );
+                    break;
+
+                case RTM_NEWADDR:
+                case RTM_DELADDR:
+                    for (iface = _s_ifaces; iface != NULL; iface = iface->next)
+                        anetiface_on_address( iface, nh );
+                    break;
+
+                default: ;
+            }
+        }
+    }
+}
+
+static SysChannel
+anetiface_open_netlink( void )
+{
+    struct sockaddr_nl  addr;
+    SysChannel          channel;
+    int                 fd;
+
+    fd = socket( AF_NETLINK, SOCK_RAW, NETLINK_ROUTE );
+    if (fd < 0)
+        return NULL;
+
+    memset( &addr, 0, sizeof(addr) );
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+    if (bind( fd, (struct sockaddr*) &addr, sizeof(addr) ) < 0) {
+        close( fd );
+        return NULL;
+    }
+
+    channel = sys_channel_create_fd( fd );
+    if (channel == NULL) {
+        close( fd );
+        return NULL;
+    }
+    sys_channel_on( channel, SYS_EVENT_READ, anetiface_netlink_event, NULL );
+    return channel;
+}
+
+ANetIface
+anetiface_create( const char*  name )
+{
+    ANetIface  iface = (ANetIface) calloc( 1, sizeof(*iface) );
+
+    if (iface == NULL)
+        return NULL;
+
+    if (strlen(name) >= sizeof(iface->name)) {
+        free( iface );
+        return NULL;
+    }
+    strcpy( iface->name, name );
+
+    /* subscribe before reading the state, so that no change is missed */
+    if (_s_ifaces == NULL) {
+        _s_netlink = anetiface_open_netlink();
+        if (_s_netlink == NULL)
+            D( "no netlink notifications, interface addresses will be polled" );
+    }
+    iface->next = _s_ifaces;
+    _s_ifaces   = iface;
+
+    anetiface_query( iface );
+    return iface;
+}
+
+void
+anetiface_destroy( ANetIface  iface )
+{
+    ANetIface*  pnode = &_s_ifaces;
+
+    while (*pnode != NULL && *pnode != iface)
+        pnode = &(*pnode)->next;
+    if (*pnode != NULL)
+        *pnode = iface->next;
+
+    if (_s_ifaces == NULL && _s_netlink != NULL) {
+        sys_channel_close( _s_netlink );
+        _s_netlink = NULL;
+    }
+    free( iface );
+}
+
+const char*
+anetiface_get_name( ANetIface  iface )
+{
+    return iface->name;
+}
+
+int
+anetiface_set_name( ANetIface  iface, const char*  name )
+{
+    if (strlen(name) >= sizeof(iface->name))
+        return -1;
+
+    strcpy( iface->name, name );
+    anetiface_query( iface );
+    return 0;
+}
+
+const char*
+anetiface_get_address( ANetIface  iface )
+{
+    if (_s_netlink == NULL)
+        anetiface_query( iface );
+
+    return iface->address;
+}
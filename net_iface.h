@@ -0,0 +1,39 @@
+/* Copyright (C) 2007-2008 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#ifndef _android_net_iface_h
+#define _android_net_iface_h
+
+/** NETWORK INTERFACE
+ **
+ ** tracks the IPv4 address of the network interface that carries the
+ ** emulated data connection. the address is read once, then kept up to
+ ** date by the link and address notifications of an rtnetlink socket
+ ** watched by the event loop, so that reading it costs no system call.
+ ** all interfaces share the same socket. if it can't be opened, the
+ ** address is queried on each read.
+ **/
+
+typedef struct ANetIfaceRec_*  ANetIface;
+
+extern ANetIface    anetiface_create( const char*  name );
+extern void         anetiface_destroy( ANetIface  iface );
+
+extern const char*  anetiface_get_name( ANetIface  iface );
+
+/* switch to another interface, returns -1 if the name is too long */
+extern int          anetiface_set_name( ANetIface  iface, const char*  name );
+
+/* return the dotted IPv4 address of the interface, or an empty string
+ * if it doesn't exist or has no address */
+extern const char*  anetiface_get_address( ANetIface  iface );
+
+#endif /* _android_net_iface_h */
@@ -0,0 +1,657 @@
+/* Copyright (C) 2007-2008 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#include "nvram.h"
+#include "config.h"
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef enum {
+    A_NVRAM_STR = 0,
+    A_NVRAM_INT
+} ANvramType;
+
+typedef struct ANvramEntryRec {
+    struct ANvramEntryRec*  hash_next;
+    struct ANvramEntryRec*  next;          /* in creation order */
+    unsigned                hash;
+    unsigned char           type;
+    unsigned char           dirty;
+    unsigned char           int_valid;     /* 'ival' caches the value of a string */
+    unsigned char           str_valid;     /* 'str' holds the formatted integer */
+    int                     ival;
+    char*                   str;           /* 'small' or malloc()-ed */
+    char                    small[16];
+    char                    key[1];        /* interned, must be last */
+} ANvramEntryRec, *ANvramEntry;
+
+/* entries never move, they are carved from blocks freed with the store */
+typedef struct ANvramBlockRec {
+    struct ANvramBlockRec*  next;
+    int                     used;
+    int                     size;
+    /* followed by the data */
+} ANvramBlockRec, *ANvramBlock;
+
+#define  NVRAM_BLOCK_SIZE    4096
+#define  NVRAM_MIN_BUCKETS   64
+#define  NVRAM_MAX_KEY       128
+
+typedef struct ANvramRec_ {
+    ANvramEntry*  buckets;
+    unsigned      mask;
+    int           count;
+    ANvramEntry   first;
+    ANvramEntry   last;
+    int           dirty;
+    ANvramFormat  format;        /* used by anvram_save_file() */
+    ANvramBlock   blocks;
+} ANvramRec;
+
+
+static void*
+anvram_alloc( ANvram  nv, int  size )
+{
+    ANvramBlock  block = nv->blocks;
+    char*        p;
+
+    size = (size + 7) & ~7;
+    if (block == NULL || block->used + size > block->size) {
+        int  block_size = NVRAM_BLOCK_SIZE;
+
+        if (block_size < size + (int)sizeof(*block))
+            block_size = size + sizeof(*block);
+
+        block = (ANvramBlock) malloc( block_size );
+        if (block == NULL)
+            return NULL;
+
+        block->next = nv->blocks;
+        block->used = (sizeof(*block) + 7) & ~7;
+        block->size = block_size;
+        nv->blocks  = block;
+    }
+    p            = (char*)block + block->used;
+    block->used += size;
+    return p;
+}
+
+static unsigned
+anvram_hash( const char*  key )
+{
+    unsigned  h = 2166136261U;   /* FNV-1a */
+
+    for ( ; *key; key++ )
+        h = (h ^ (unsigned char)*key) * 16777619U;
+    return h;
+}
+
+static int
+anvram_grow( ANvram  nv )
+{
+    unsigned      new_mask    = nv->mask ? nv->mask*2 + 1 : NVRAM_MIN_BUCKETS - 1;
+    ANvramEntry*  new_buckets = (ANvramEntry*) calloc( new_mask + 1, sizeof(ANvramEntry) );
+    ANvramEntry   e;
+
+    if (new_buckets == NULL)
+        return -1;
+
+    for (e = nv->first; e != NULL; e = e->next) {
+        e->hash_next = new_buckets[ e->hash & new_mask ];
+        new_buckets[ e->hash & new_mask ] = e;
+    }
+    free( nv->buckets );
+    nv->buckets = new_buckets;
+    nv->mask    = new_mask;
+    return 0;
+}
+
+static ANvramEntry
+anvram_find( ANvram  nv, const char*  key, int  create )
+{
+    unsigned     hash = anvram_hash( key );
+    ANvramEntry  e;
+    int          len;
+
+    for (e = nv->buckets[ hash & nv->mask ]; e != NULL; e = e->hash_next) {
+        if (e->hash == hash && !strcmp( e->key, key ))
+            return e;
+    }
+    if (!create)
+        return NULL;
+
+    if (nv->count > (int)nv->mask && anvram_grow( nv ) < 0)
+        return NULL;
+
+    len = strlen( key );
+    e   = (ANvramEntry) anvram_alloc( nv, sizeof(*e) + len );
+    if (e == NULL)
+        return NULL;
+
+    memset( e, 0, sizeof(*e) );
+    memcpy( e->key, key, len + 1 );
+    e->hash  = hash;
+    e->type  = A_NVRAM_STR;
+    e->str   = e->small;
+    e->dirty = 1;
+
+    e->hash_next = nv->buckets[ hash & nv->mask ];
+    nv->buckets[ hash & nv->mask ] = e;
+
+    if (nv->last)
+        nv->last->next = e;
+    else
+        nv->first = e;
+    nv->last   = e;
+    nv->count += 1;
+    nv->dirty  = 1;
+    return e;
+}
+
+static void
+anvram_entry_free_str( ANvramEntry  e )
+{
+    if (e->str != e->small)
+        free( e->str );
+    e->str      = e->small;
+    e->small[0] = 0;
+}
+
+static int
+anvram_entry_int( ANvramEntry  e )
+{
+    if (e->type == A_NVRAM_STR && !e->int_valid) {
+        e->ival      = strtol( e->str, NULL, 0 );
+        e->int_valid = 1;
+    }
+    return e->ival;
+}
+
+static const char*
+anvram_entry_str( ANvramEntry  e )
+{
+    if (e->type == A_NVRAM_INT && !e->str_valid) {
+        snprintf( e->small, sizeof(e->small), "%d", e->ival );
+        e->str_valid = 1;
+    }
+    return e->str;
+}
+
+static void
+anvram_entry_set_int( ANvram  nv, ANvramEntry  e, int  value )
+{
+    anvram_entry_free_str( e );
+    e->type      = A_NVRAM_INT;
+    e->ival      = value;
+    e->str_valid = 0;
+    e->int_valid = 1;
+    e->dirty     = 1;
+    nv->dirty    = 1;
+}
+
+static void
+anvram_entry_set_str( ANvram  nv, ANvramEntry  e, const char*  value, int  len )
+{
+    char*  str = e->small;
+
+    if (len >= (int)sizeof(e->small)) {
+        str = (char*) malloc( len + 1 );
+        if (str == NULL)
+            return;
+    }
+    anvram_entry_free_str( e );
+    memcpy( str, value, len );
+    str[len]     = 0;
+    e->str       = str;
+    e->type      = A_NVRAM_STR;
+    e->int_valid = 0;
+    e->str_valid = 0;
+    e->dirty     = 1;
+    nv->dirty    = 1;
+}
+
+static void
+anvram_clean( ANvram  nv )
+{
+    ANvramEntry  e;
+
+    for (e = nv->first; e != NULL; e = e->next)
+        e->dirty = 0;
+    nv->dirty = 0;
+}
+
+ANvram
+anvram_create( void )
+{
+    ANvram  nv = (ANvram) calloc( 1, sizeof(*nv) );
+
+    if (nv == NULL)
+        return NULL;
+
+    if (anvram_grow( nv ) < 0) {
+        free( nv );
+        return NULL;
+    }
+    return nv;
+}
+
+void
+anvram_destroy( ANvram  nv )
+{
+    ANvramEntry  e;
+
+    for (e = nv->first; e != NULL; e = e->next)
+        anvram_entry_free_str( e );
+
+    while (nv->blocks) {
+        ANvramBlock  block = nv->blocks;
+        nv->blocks = block->next;
+        free( block );
+    }
+    free( nv->buckets );
+    free( nv );
+}
+
+int
+anvram_get_int( ANvram  nv, const char*  key, int  defval )
+{
+    ANvramEntry  e = anvram_find( nv, key, 0 );
+
+    return e ? anvram_entry_int( e ) : defval;
+}
+
+const char*
+anvram_get_str( ANvram  nv, const char*  key, const char*  defval )
+{
+    ANvramEntry  e = anvram_find( nv, key, 0 );
+
+    return e ? anvram_entry_str( e ) : defval;
+}
+
+int
+anvram_default_int( ANvram  nv, const char*  key, int  defval )
+{
+    ANvramEntry  e = anvram_find( nv, key, 0 );
+
+    if (e != NULL)
+        return anvram_entry_int( e );
+
+    e = anvram_find( nv, key, 1 );
+    if (e != NULL)
+        anvram_entry_set_int( nv, e, defval );
+    return defval;
+}
+
+const char*
+anvram_default_str( ANvram  nv, const char*  key, const char*  defval )
+{
+    ANvramEntry  e = anvram_find( nv, key, 0 );
+
+    if (e != NULL)
+        return anvram_entry_str( e );
+
+    if (defval == NULL)
+        return NULL;
+
+    e = anvram_find( nv, key, 1 );
+    if (e == NULL)
+        return defval;
+
+    anvram_entry_set_str( nv, e, defval, strlen(defval) );
+    return e->str;
+}
+
+void
+anvram_set_int( ANvram  nv, const char*  key, int  value )
+{
+    ANvramEntry  e = anvram_find( nv, key, 1 );
+
+    if (e == NULL)
+        return;
+    if (e->type == A_NVRAM_INT && e->ival == value)
+        return;
+    anvram_entry_set_int( nv, e, value );
+}
+
+/* 'value' doesn't need to be zero-terminated */
+static void
+anvram_set_strn( ANvram  nv, const char*  key, const char*  value, int  len )
+{
+    ANvramEntry  e = anvram_find( nv, key, 1 );
+
+    if (e == NULL)
+        return;
+    if (e->type == A_NVRAM_STR && e->str[0] != 0 &&
+        !strncmp( e->str, value, len ) && e->str[len] == 0)
+        return;
+    anvram_entry_set_str( nv, e, value, len );
+}
+
+void
+anvram_set_str( ANvram  nv, const char*  key, const char*  value )
+{
+    anvram_set_strn( nv, key, value, strlen(value) );
+}
+
+int
+anvram_is_dirty( ANvram  nv )
+{
+    return nv->dirty;
+}
+
+ANvramFormat
+anvram_get_format( ANvram  nv )
+{
+    return nv->format;
+}
+
+void
+anvram_set_format( ANvram  nv, ANvramFormat  format )
+{
+    if (nv->format != format) {
+        nv->format = format;
+        nv->dirty  = 1;
+    }
+}
+
+/** TEXT FORMAT
+ **/
+
+/* add the leaves under node 'n' of a config document, 'prefix' holds the
+ * names of the parents */
+static void
+anvram_add_tree( ANvram  nv, const AConfigNode*  nodes, int  n, char*  prefix, int  len )
+{
+    for ( ; n >= 0; n = nodes[n].next) {
+        const AConfigNode*  node = nodes + n;
+        int                 nlen = node->name.len;
+
+        if (len + nlen + 2 > NVRAM_MAX_KEY)
+            continue;
+
+        memcpy( prefix + len, node->name.str, nlen );
+        prefix[len + nlen] = 0;
+        if (node->first_child >= 0) {
+            prefix[len + nlen] = '.';
+            anvram_add_tree( nv, nodes, node->first_child, prefix, len + nlen + 1 );
+        } else {
+            anvram_set_strn( nv, prefix, node->value.str, node->value.len );
+        }
+    }
+}
+
+/* parse the text in place, the document only references it */
+static int
+anvram_load_text( ANvram  nv, const char*  data, int  size )
+{
+    AConfigDoc          doc = aconfig_doc_parse( data, size );
+    const AConfigNode*  nodes;
+    int                 count;
+    char                key[ NVRAM_MAX_KEY ];
+
+    if (doc == NULL)
+        return -1;
+
+    nodes = aconfig_doc_nodes( doc, &count );
+    anvram_add_tree( nv, nodes, nodes[0].first_child, key, 0 );
+
+    aconfig_doc_free( doc );
+    return 0;
+}
+
+static void
+anvram_render_text( ANvram  nv, SnapshotWriter  w )
+{
+    ANvramEntry  e;
+
+    /* one "key value" line per entry, empty values can't be written */
+    for (e = nv->first; e != NULL; e = e->next) {
+        const char*  value = anvram_entry_str( e );
+
+        if (value[0] == 0)
+            continue;
+
+        snapshot_put_raw( w, e->key, strlen(e->key) );
+        snapshot_put_raw( w, " ", 1 );
+        snapshot_put_raw( w, value, strlen(value) );
+        snapshot_put_raw( w, "\n", 1 );
+    }
+}
+
+/** BINARY IMAGE
+ **
+ ** a file that is mapped and read through its index, without any lexing,
+ ** its keys and values being copied into the store. all fields are
+ ** little-endian 32-bit values:
+ **
+ **   header    magic "ANVR", version, entry count, size of the file
+ **   entries   key offset, key length, type, value (integer, or offset
+ **             of the string), value length
+ **   strings   keys and string values, each followed by a zero byte
+ **
+ ** offsets are from the start of the file, entries are in creation order.
+ **/
+
+#define  NVRAM_IMAGE_MAGIC     "ANVR"
+#define  NVRAM_IMAGE_VERSION   1
+#define  NVRAM_HEADER_SIZE     16
+#define  NVRAM_ENTRY_SIZE      20
+
+static unsigned
+anvram_get_u32( const unsigned char*  p )
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+static void
+anvram_put_u32( SnapshotWriter  w, unsigned  value )
+{
+    unsigned char  temp[4];
+
+    temp[0] = (unsigned char)(value);
+    temp[1] = (unsigned char)(value >> 8);
+    temp[2] = (unsigned char)(value >> 16);
+    temp[3] = (unsigned char)(value >> 24);
+    snapshot_put_raw( w, temp, 4 );
+}
+
+/* return the zero-terminated string of 'len' bytes at 'offset', or NULL
+ * if it lies outside of the string area */
+static const char*
+anvram_image_str( const unsigned char*  data, unsigned  start, unsigned  size,
+                  unsigned  offset, unsigned  len )
+{
+    if (offset < start || offset > size || len >= size - offset || data[offset + len] != 0)
+        return NULL;
+    return (const char*)data + offset;
+}
+
+static int
+anvram_is_image( const unsigned char*  data, unsigned  size )
+{
+    return size >= NVRAM_HEADER_SIZE && !memcmp( data, NVRAM_IMAGE_MAGIC, 4 );
+}
+
+/* the whole image is checked before the store is touched, so that a
+ * corrupted file leaves it as it was */
+static int
+anvram_load_image( ANvram  nv, const unsigned char*  data, unsigned  size )
+{
+    unsigned  count, start, nn;
+    int       pass;
+
+    if (anvram_get_u32( data + 4 ) != NVRAM_IMAGE_VERSION ||
+        anvram_get_u32( data + 12 ) != size)
+        return -1;
+
+    count = anvram_get_u32( data + 8 );
+    if (count > (size - NVRAM_HEADER_SIZE) / NVRAM_ENTRY_SIZE)
+        return -1;
+    start = NVRAM_HEADER_SIZE + count * NVRAM_ENTRY_SIZE;
+
+    /* pass 0 validates the entries, pass 1 copies them */
+    for (pass = 0; pass < 2; pass++) {
+        for (nn = 0; nn < count; nn++) {
+            const unsigned char*  p     = data + NVRAM_HEADER_SIZE + nn * NVRAM_ENTRY_SIZE;
+            unsigned              type  = anvram_get_u32( p + 8 );
+            unsigned              value = anvram_get_u32( p + 12 );
+            unsigned              len   = anvram_get_u32( p + 16 );
+            const char*           key;
+            const char*           str   = NULL;
+            ANvramEntry           e;
+
+            key = anvram_image_str( data, start, size, anvram_get_u32( p ), anvram_get_u32( p + 4 ) );
+            if (key == NULL || key[0] == 0 || strlen( key ) >= NVRAM_MAX_KEY)
+                return -1;
+
+            if (type == A_NVRAM_STR) {
+                str = anvram_image_str( data, start, size, value, len );
+                if (str == NULL)
+                    return -1;
+            } else if (type != A_NVRAM_INT)
+                return -1;
+
+            if (pass == 0)
+                continue;
+
+            e = anvram_find( nv, key, 1 );
+            if (e == NULL)
+                return -1;
+
+            if (str == NULL) {
+                if (e->type != A_NVRAM_INT || e->ival != (int)value)
+                    anvram_entry_set_int( nv, e, (int)value );
+            } else {
+                if (e->type != A_NVRAM_STR || strcmp( e->str, str ))
+                    anvram_entry_set_str( nv, e, str, len );
+            }
+        }
+    }
+    return 0;
+}
+
+static void
+anvram_render_image( ANvram  nv, SnapshotWriter  w )
+{
+    ANvramEntry  e;
+    unsigned     offset = NVRAM_HEADER_SIZE + nv->count * NVRAM_ENTRY_SIZE;
+    unsigned     size   = offset;
+
+    for (e = nv->first; e != NULL; e = e->next) {
+        size += strlen( e->key ) + 1;
+        if (e->type == A_NVRAM_STR)
+            size += strlen( e->str ) + 1;
+    }
+
+    snapshot_put_raw( w, NVRAM_IMAGE_MAGIC, 4 );
+    anvram_put_u32( w, NVRAM_IMAGE_VERSION );
+    anvram_put_u32( w, nv->count );
+    anvram_put_u32( w, size );
+
+    for (e = nv->first; e != NULL; e = e->next) {
+        unsigned  klen = strlen( e->key );
+
+        anvram_put_u32( w, offset );
+        anvram_put_u32( w, klen );
+        anvram_put_u32( w, e->type );
+        offset += klen + 1;
+
+        if (e->type == A_NVRAM_INT) {
+            anvram_put_u32( w, (unsigned)e->ival );
+            anvram_put_u32( w, 0 );
+        } else {
+            unsigned  vlen = strlen( e->str );
+
+            anvram_put_u32( w, offset );
+            anvram_put_u32( w, vlen );
+            offset += vlen + 1;
+        }
+    }
+
+    for (e = nv->first; e != NULL; e = e->next) {
+        snapshot_put_raw( w, e->key, strlen( e->key ) + 1 );
+        if (e->type == A_NVRAM_STR)
+            snapshot_put_raw( w, e->str, strlen( e->str ) + 1 );
+    }
+}
+
+/** FILES
+ **/
+
+int
+anvram_load_file( ANvram  nv, const char*  path )
+{
+    struct stat  st;
+    void*        map;
+    int          fd, ret;
+
+    fd = open( path, O_RDONLY );
+    if (fd < 0)
+        return -1;
+
+    if (fstat( fd, &st ) < 0) {
+        close( fd );
+        return -1;
+    }
+
+    map = NULL;
+    if (st.st_size > 0) {
+        map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if (map == MAP_FAILED) {
+            close( fd );
+            return -1;
+        }
+    }
+    close( fd );
+
+    if (map != NULL && anvram_is_image( (const unsigned char*)map, st.st_size )) {
+        ret = anvram_load_image( nv, (const unsigned char*)map, st.st_size );
+        if (ret == 0)
+            nv->format = A_NVRAM_IMAGE;
+    } else {
+        ret = anvram_load_text( nv, map ? (const char*)map : "", st.st_size );
+        if (ret == 0)
+            nv->format = A_NVRAM_TEXT;
+    }
+
+    if (map != NULL)
+        munmap( map, st.st_size );
+
+    if (ret == 0)
+        anvram_clean( nv );
+    return ret;
+}
+
+int
+anvram_save_file( ANvram  nv, const char*  path )
+{
+    SnapshotWriterRec  w[1];
+    int                ret;
+
+    snapshot_writer_init( w );
+    if (nv->format == A_NVRAM_IMAGE)
+        anvram_render_image( nv, w );
+    else
+        anvram_render_text( nv, w );
+
+    ret = snapshot_write_file( w, path );
+    snapshot_writer_done( w );
+
+    if (ret == 0)
+        anvram_clean( nv );
+    return ret;
+}
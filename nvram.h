@@ -0,0 +1,73 @@
+/* Copyright (C) 2007-2008 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#ifndef _android_nvram_h
+#define _android_nvram_h
+
+/** NVRAM STORE
+ **
+ ** the non-volatile settings of a modem, a flat set of (key,value) pairs
+ ** saved in the text format of config.h, nested keys being flattened to
+ ** "parent.child". keys are interned in a hash table, and values keep
+ ** their native type so that integers are neither parsed nor formatted
+ ** on each access. entries are allocated from an arena that is released
+ ** at once by anvram_destroy().
+ **
+ ** the file can also be a binary image, an index of offsets followed by
+ ** the strings. it is mapped and its entries are found through the index,
+ ** without any lexing, then copied into the store and unmapped. it is
+ ** detected when loading, and converted by changing the format of the
+ ** store before saving it.
+ **/
+
+typedef struct ANvramRec_*  ANvram;
+
+typedef enum {
+    A_NVRAM_TEXT = 0,
+    A_NVRAM_IMAGE
+} ANvramFormat;
+
+extern ANvram       anvram_create( void );
+extern void         anvram_destroy( ANvram  nv );
+
+/* load a text file or an image, its values replace the current ones and
+ * its format becomes the one of the store. returns 0 on success, or -1 if
+ * the file can't be read or the image is corrupted */
+extern int          anvram_load_file( ANvram  nv, const char*  path );
+
+/* save all values in the format of the store, written to a temporary file that is
+ * synced and renamed over it, so that a crash leaves either the old or the
+ * new content. returns 0 on success, -1 on error */
+extern int          anvram_save_file( ANvram  nv, const char*  path );
+
+/* return the value of 'key', or 'defval' if it is missing. strings that
+ * are not numbers read as 0, integers are formatted in decimal */
+extern int          anvram_get_int( ANvram  nv, const char*  key, int  defval );
+extern const char*  anvram_get_str( ANvram  nv, const char*  key, const char*  defval );
+
+/* same, but a missing key is added with 'defval', so that saved files list
+ * every setting that was used */
+extern int          anvram_default_int( ANvram  nv, const char*  key, int  defval );
+extern const char*  anvram_default_str( ANvram  nv, const char*  key, const char*  defval );
+
+/* the value is copied, setting a key to its current value does nothing */
+extern void         anvram_set_int( ANvram  nv, const char*  key, int  value );
+extern void         anvram_set_str( ANvram  nv, const char*  key, const char*  value );
+
+/* 1 if a value was added or changed since the last save or load */
+extern int          anvram_is_dirty( ANvram  nv );
+
+/* the format used by anvram_save_file(), text unless an image was loaded.
+ * changing it marks the store as dirty */
+extern ANvramFormat anvram_get_format( ANvram  nv );
+extern void         anvram_set_format( ANvram  nv, ANvramFormat  format );
+
+#endif /* _android_nvram_h */
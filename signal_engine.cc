@@ -0,0 +1,481 @@
+/* Copyright (C) 2007-2008 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#include "signal_engine.h"
+#include "sysdeps.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "log.h"
+
+typedef enum {
+    A_SIGNAL_SOURCE_NONE = 0,
+    A_SIGNAL_SOURCE_TRACE,
+    A_SIGNAL_SOURCE_WALK
+} ASignalSource;
+
+typedef struct {
+    int    time;   /* ms from the start of the trace */
+    float  rssi;
+    float  rsrp;
+    float  rsrq;
+    float  snr;
+} ASignalSampleRec, *ASignalSample;
+
+typedef struct ASignalRec_ {
+    /* reported values, and their levels */
+    ASignalValuesRec  values;
+    int               levels[ A_SIGNAL_MAX ];
+
+    /* continuous values, and the ones at the last report */
+    double            rssi;
+    double            rsrp;
+    double            rsrq;
+    double            snr;
+    double            last[4];
+
+    ASignalSource     source;
+    SysTimer          timer;
+
+    /* random walk */
+    int               interval;
+    unsigned          seed;
+
+    /* trace */
+    ASignalSample     samples;
+    int               sample_count;
+    int               sample_pos;
+    int               loop;
+    SysTime           start;
+
+    ASignalFunc       func;
+    void*             opaque;
+} ASignalRec;
+
+/* bounds of the continuous values */
+#define  RSSI_MIN  -113.
+#define  RSSI_MAX   -51.
+#define  RSRP_MIN  -140.
+#define  RSRP_MAX   -44.
+#define  RSRQ_MIN   -20.
+#define  RSRQ_MAX    -3.
+#define  SNR_MIN    -20.
+#define  SNR_MAX     30.
+
+/* samples closer than this (in dB) to the last reported ones are ignored,
+ * so that values hovering around a threshold don't flip the level */
+#define  HYSTERESIS   2.
+
+static double
+absf( double  value )
+{
+    return value < 0 ? -value : value;
+}
+
+static int
+clamp( int  value, int  lo, int  hi )
+{
+    return value < lo ? lo : (value > hi ? hi : value);
+}
+
+static double
+clampf( double  value, double  lo, double  hi )
+{
+    return value < lo ? lo : (value > hi ? hi : value);
+}
+
+/* the thresholds match android.telephony.SignalStrength */
+static int
+asignal_gsm_level( const ASignalValuesRec*  v )
+{
+    int  asu = v->gsm_rssi;
+
+    if (asu <= 2 || asu == 99) return 0;
+    if (asu >= 12)             return 4;
+    if (asu >= 8)              return 3;
+    if (asu >= 5)              return 2;
+    return 1;
+}
+
+static int
+asignal_cdma_level( const ASignalValuesRec*  v )
+{
+    int  dbm  = -v->cdma_dbm;
+    int  ecio = -v->cdma_ecio;
+    int  level_dbm, level_ecio;
+
+    if      (dbm >= -75)  level_dbm = 4;
+    else if (dbm >= -85)  level_dbm = 3;
+    else if (dbm >= -95)  level_dbm = 2;
+    else if (dbm >= -100) level_dbm = 1;
+    else                  level_dbm = 0;
+
+    if      (ecio >= -90)  level_ecio = 4;
+    else if (ecio >= -110) level_ecio = 3;
+    else if (ecio >= -130) level_ecio = 2;
+    else if (ecio >= -150) level_ecio = 1;
+    else                   level_ecio = 0;
+
+    return level_dbm < level_ecio ? level_dbm : level_ecio;
+}
+
+static int
+asignal_evdo_level( const ASignalValuesRec*  v )
+{
+    int  dbm = -v->evdo_dbm;
+    int  snr = v->evdo_snr;
+    int  level_dbm, level_snr;
+
+    if      (dbm >= -65)  level_dbm = 4;
+    else if (dbm >= -75)  level_dbm = 3;
+    else if (dbm >= -90)  level_dbm = 2;
+    else if (dbm >= -105) level_dbm = 1;
+    else                  level_dbm = 0;
+
+    if      (snr >= 7) level_snr = 4;
+    else if (snr >= 5) level_snr = 3;
+    else if (snr >= 3) level_snr = 2;
+    else if (snr >= 1) level_snr = 1;
+    else               level_snr = 0;
+
+    return level_dbm < level_snr ? level_dbm : level_snr;
+}
+
+static int
+asignal_lte_level( const ASignalValuesRec*  v )
+{
+    int  rsrp = -v->lte_rsrp;
+
+    if (rsrp > -44)   return 0;
+    if (rsrp >= -85)  return 4;
+    if (rsrp >= -95)  return 3;
+    if (rsrp >= -105) return 2;
+    if (rsrp >= -140) return 1;
+    return 0;
+}
+
+static void
+asignal_compute_levels( const ASignalValuesRec*  v, int*  levels )
+{
+    levels[A_SIGNAL_GSM]  = asignal_gsm_level( v );
+    levels[A_SIGNAL_CDMA] = asignal_cdma_level( v );
+    levels[A_SIGNAL_EVDO] = asignal_evdo_level( v );
+    levels[A_SIGNAL_LTE]  = asignal_lte_level( v );
+}
+
+/* convert the continuous values into RIL units */
+static void
+asignal_convert( ASignal  sig, ASignalValues  v )
+{
+    int  asu = clamp( (int)((sig->rssi + 113.) / 2.), 0, 31 );
+    int  dbm = clamp( (int)(-sig->rssi), 51, 120 );
+
+    v->gsm_rssi   = asu;
+    v->gsm_ber    = clamp( (int)((20. - sig->snr) / 4.), 0, 7 );
+    v->cdma_dbm   = dbm;
+    v->cdma_ecio  = clamp( (int)(-sig->rsrq * 8.), 0, 160 );
+    v->evdo_dbm   = dbm;
+    v->evdo_ecio  = v->cdma_ecio;
+    v->evdo_snr   = clamp( (int)((sig->snr + 10.) / 4.), 0, 8 );
+    v->lte_rssi   = asu;
+    v->lte_rsrp   = clamp( (int)(-sig->rsrp), 44, 140 );
+    v->lte_rsrq   = clamp( (int)(-sig->rsrq), 3, 20 );
+    v->lte_rssnr  = clamp( (int)(sig->snr * 10.), -200, 300 );
+    v->lte_cqi    = clamp( (int)((sig->snr + 5.) / 2.), 0, 15 );
+    v->lte_timing = sig->values.lte_timing;
+}
+
+/* report new values if one of their levels changed, or always if 'force'.
+ * returns 1 if they were reported */
+static int
+asignal_report( ASignal  sig, const ASignalValuesRec*  values, int  force )
+{
+    int  levels[ A_SIGNAL_MAX ];
+    int  changed;
+
+    asignal_compute_levels( values, levels );
+    changed = memcmp( levels, sig->levels, sizeof(levels) ) != 0;
+
+    if (!changed && !(force && memcmp( values, &sig->values, sizeof(*values) )))
+        return 0;
+
+    sig->values  = *values;
+    sig->last[0] = sig->rssi;
+    sig->last[1] = sig->rsrp;
+    sig->last[2] = sig->rsrq;
+    sig->last[3] = sig->snr;
+    memcpy( sig->levels, levels, sizeof(levels) );
+
+    if (sig->func)
+        sig->func( sig->opaque, changed );
+    return 1;
+}
+
+static void
+asignal_apply_sample( ASignal  sig )
+{
+    ASignalValuesRec  values;
+
+    /* most samples at high rates end here */
+    if (absf( sig->rssi - sig->last[0] ) < HYSTERESIS &&
+        absf( sig->rsrp - sig->last[1] ) < HYSTERESIS &&
+        absf( sig->rsrq - sig->last[2] ) < HYSTERESIS &&
+        absf( sig->snr  - sig->last[3] ) < HYSTERESIS)
+        return;
+
+    asignal_convert( sig, &values );
+    asignal_report( sig, &values, 0 );
+}
+
+
+ASignal
+asignal_create( ASignalFunc  func, void*  opaque )
+{
+    ASignal  sig = (ASignal) calloc( 1, sizeof(*sig) );
+
+    if (sig == NULL)
+        return NULL;
+
+    sig->timer  = sys_timer_create();
+    sig->func   = func;
+    sig->opaque = opaque;
+
+    sig->rssi = -73.;
+    sig->rsrp = -90.;
+    sig->rsrq = -10.;
+    sig->snr  =  10.;
+    asignal_convert( sig, &sig->values );
+    asignal_compute_levels( &sig->values, sig->levels );
+    sig->last[0] = sig->rssi;
+    sig->last[1] = sig->rsrp;
+    sig->last[2] = sig->rsrq;
+    sig->last[3] = sig->snr;
+    return sig;
+}
+
+void
+asignal_destroy( ASignal  sig )
+{
+    asignal_stop( sig );
+    sys_timer_destroy( sig->timer );
+    free( sig );
+}
+
+const ASignalValuesRec*
+asignal_get_values( ASignal  sig )
+{
+    return &sig->values;
+}
+
+int
+asignal_get_level( ASignal  sig, ASignalTech  tech )
+{
+    if ((unsigned)tech >= A_SIGNAL_MAX)
+        return 0;
+
+    return sig->levels[tech];
+}
+
+void
+asignal_set_values( ASignal  sig, const ASignalValuesRec*  values )
+{
+    asignal_stop( sig );
+
+    /* keep the continuous values in sync, for a later random walk */
+    sig->rssi = clampf( values->gsm_rssi * 2. - 113., RSSI_MIN, RSSI_MAX );
+    sig->rsrp = clampf( -values->lte_rsrp, RSRP_MIN, RSRP_MAX );
+    sig->rsrq = clampf( -values->lte_rsrq, RSRQ_MIN, RSRQ_MAX );
+    sig->snr  = clampf( values->lte_rssnr / 10., SNR_MIN, SNR_MAX );
+
+    asignal_report( sig, values, 1 );
+}
+
+void
+asignal_set_sample( ASignal  sig, double  rssi, double  rsrp, double  rsrq, double  snr )
+{
+    sig->rssi = clampf( rssi, RSSI_MIN, RSSI_MAX );
+    sig->rsrp = clampf( rsrp, RSRP_MIN, RSRP_MAX );
+    sig->rsrq = clampf( rsrq, RSRQ_MIN, RSRQ_MAX );
+    sig->snr  = clampf( snr,  SNR_MIN,  SNR_MAX );
+    asignal_apply_sample( sig );
+}
+
+void
+asignal_stop( ASignal  sig )
+{
+    sys_timer_unset( sig->timer );
+
+    free( sig->samples );
+    sig->samples      = NULL;
+    sig->sample_count = 0;
+    sig->sample_pos   = 0;
+    sig->source       = A_SIGNAL_SOURCE_NONE;
+}
+
+/** TRACE REPLAY
+ **/
+static void
+asignal_trace_event( void*  _sig )
+{
+    ASignal  sig  = (ASignal) _sig;
+    SysTime  now  = sys_time_ms();
+    int      last = -1;
+
+    /* catch up with all the samples that are due, only the last one is reported */
+    while (sig->sample_pos < sig->sample_count &&
+           sig->start + sig->samples[ sig->sample_pos ].time <= now)
+        last = sig->sample_pos++;
+
+    if (last >= 0) {
+        ASignalSample  s = &sig->samples[last];
+
+        sig->rssi = s->rssi;
+        sig->rsrp = s->rsrp;
+        sig->rsrq = s->rsrq;
+        sig->snr  = s->snr;
+        asignal_apply_sample( sig );
+    }
+
+    if (sig->sample_pos >= sig->sample_count) {
+        int  period = sig->samples[ sig->sample_count-1 ].time;
+
+        if (!sig->loop || period <= 0) {
+            asignal_stop( sig );
+            return;
+        }
+        /* restart right after the last sample */
+        sig->start     += period;
+        sig->sample_pos = 0;
+    }
+
+    sys_timer_set( sig->timer, sig->start + sig->samples[ sig->sample_pos ].time,
+                   asignal_trace_event, sig );
+}
+
+int
+asignal_start_trace( ASignal  sig, const char*  path, int  loop )
+{
+    FILE*          f = fopen( path, "r" );
+    ASignalSample  samples = NULL;
+    int            count = 0, max = 0, last_time = 0;
+    char           line[ 256 ];
+
+    if (f == NULL) {
+        D( "%s: could not open %s\n", __FUNCTION__, path );
+        return -1;
+    }
+
+    while (fgets( line, sizeof(line), f ) != NULL) {
+        ASignalSampleRec  s;
+
+        if (line[0] == '#')
+            continue;
+
+        if (sscanf( line, "%d %f %f %f %f", &s.time, &s.rssi, &s.rsrp, &s.rsrq, &s.snr ) != 5)
+            continue;
+
+        /* times must not go backwards */
+        if (s.time < last_time)
+            s.time = last_time;
+        last_time = s.time;
+
+        s.rssi = clampf( s.rssi, RSSI_MIN, RSSI_MAX );
+        s.rsrp = clampf( s.rsrp, RSRP_MIN, RSRP_MAX );
+        s.rsrq = clampf( s.rsrq, RSRQ_MIN, RSRQ_MAX );
+        s.snr  = clampf( s.snr,  SNR_MIN,  SNR_MAX );
+
+        if (count >= max) {
+            int            new_max = max + (max >> 1) + 64;
+            ASignalSample  new_samples = (ASignalSample) realloc( samples, new_max*sizeof(*samples) );
+
+            if (new_samples == NULL)
+                break;
+            samples = new_samples;
+            max     = new_max;
+        }
+        samples[count++] = s;
+    }
+    fclose( f );
+
+    if (count == 0) {
+        D( "%s: no samples in %s\n", __FUNCTION__, path );
+        free( samples );
+        return -1;
+    }
+
+    asignal_stop( sig );
+    sig->source       = A_SIGNAL_SOURCE_TRACE;
+    sig->samples      = samples;
+    sig->sample_count = count;
+    sig->sample_pos   = 0;
+    sig->loop         = loop;
+    sig->start        = sys_time_ms();
+
+    D( "%s: replaying %d samples from %s\n", __FUNCTION__, count, path );
+    sys_timer_set( sig->timer, sig->start + samples[0].time, asignal_trace_event, sig );
+    return 0;
+}
+
+/** RANDOM WALK
+ **/
+static double
+asignal_random( ASignal  sig )
+{
+    /* xorshift32, returns a value in [-1,1] */
+    unsigned  x = sig->seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sig->seed = x;
+
+    return (x / 2147483647.5) - 1.;
+}
+
+static double
+asignal_walk( double  value, double  step, double  lo, double  hi )
+{
+    value += step;
+
+    /* bounce on the bounds */
+    if (value < lo) value = 2*lo - value;
+    if (value > hi) value = 2*hi - value;
+    return clampf( value, lo, hi );
+}
+
+static void
+asignal_walk_event( void*  _sig )
+{
+    ASignal  sig = (ASignal) _sig;
+
+    sig->rssi = asignal_walk( sig->rssi, asignal_random( sig ),       RSSI_MIN, RSSI_MAX );
+    sig->rsrp = asignal_walk( sig->rsrp, asignal_random( sig ),       RSRP_MIN, RSRP_MAX );
+    sig->rsrq = asignal_walk( sig->rsrq, asignal_random( sig ) * 0.5, RSRQ_MIN, RSRQ_MAX );
+    sig->snr  = asignal_walk( sig->snr,  asignal_random( sig ),       SNR_MIN,  SNR_MAX );
+    asignal_apply_sample( sig );
+
+    sys_timer_set( sig->timer, sys_time_ms() + sig->interval, asignal_walk_event, sig );
+}
+
+int
+asignal_start_random_walk( ASignal  sig, int  interval_ms, unsigned  seed )
+{
+    if (interval_ms <= 0)
+        return -1;
+
+    asignal_stop( sig );
+    sig->source   = A_SIGNAL_SOURCE_WALK;
+    sig->interval = interval_ms;
+    sig->seed     = seed ? seed : 2463534242U;
+
+    sys_timer_set( sig->timer, sys_time_ms() + interval_ms, asignal_walk_event, sig );
+    return 0;
+}
@@ -0,0 +1,79 @@
+/* Copyright (C) 2007-2008 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#ifndef _android_signal_engine_h
+#define _android_signal_engine_h
+
+/** SIGNAL ENGINE
+ **
+ ** the signal is modeled by four continuous values (RSSI, RSRP, RSRQ, SNR)
+ ** that are either set directly, replayed from a trace file or moved by a
+ ** random walk. they are converted to the values reported by +CSQ, and to
+ ** 0-4 levels per technology using the thresholds of the Android framework.
+ ** the reported values only change when one of the levels does, so that
+ ** high sample rates do not flood the RIL.
+ **/
+
+/* the values reported by +CSQ, in RIL units */
+typedef struct {
+    int gsm_rssi;    /* 0-31, 99 unknown */
+    int gsm_ber;     /* 0-7, 99 unknown */
+    int cdma_dbm;    /* -dBm */
+    int cdma_ecio;   /* -dB * 10 */
+    int evdo_dbm;
+    int evdo_ecio;
+    int evdo_snr;    /* 0-8 */
+    int lte_rssi;    /* 0-31 */
+    int lte_rsrp;    /* -dBm, 44-140 */
+    int lte_rsrq;    /* -dB, 3-20 */
+    int lte_rssnr;   /* dB * 10, -200 to 300 */
+    int lte_cqi;     /* 0-15 */
+    int lte_timing;
+} ASignalValuesRec, *ASignalValues;
+
+typedef enum {
+    A_SIGNAL_GSM = 0,
+    A_SIGNAL_CDMA,
+    A_SIGNAL_EVDO,
+    A_SIGNAL_LTE,
+    A_SIGNAL_MAX   /* don't remove */
+} ASignalTech;
+
+typedef struct ASignalRec_*  ASignal;
+
+/* called when the reported values change, 'levels_changed' is 1 if at
+ * least one of the levels did */
+typedef void  (*ASignalFunc)( void*  opaque, int  levels_changed );
+
+extern ASignal  asignal_create( ASignalFunc  func, void*  opaque );
+extern void     asignal_destroy( ASignal  sig );
+
+/* the last reported values, and their level for one technology (0-4) */
+extern const ASignalValuesRec*  asignal_get_values( ASignal  sig );
+extern int                      asignal_get_level( ASignal  sig, ASignalTech  tech );
+
+/* report fixed values, this stops the trace or random walk */
+extern void     asignal_set_values( ASignal  sig, const ASignalValuesRec*  values );
+
+/* set the continuous values, in dBm (rssi, rsrp) and dB (rsrq, snr) */
+extern void     asignal_set_sample( ASignal  sig, double  rssi, double  rsrp, double  rsrq, double  snr );
+
+/* replay a trace file, each line has the form "<time_ms> <rssi> <rsrp> <rsrq> <snr>"
+ * with times relative to the start. lines starting with '#' are ignored.
+ * returns 0 on success, or -1 if the file can't be read or has no samples */
+extern int      asignal_start_trace( ASignal  sig, const char*  path, int  loop );
+
+/* move the values randomly every 'interval_ms' */
+extern int      asignal_start_random_walk( ASignal  sig, int  interval_ms, unsigned  seed );
+
+extern void     asignal_stop( ASignal  sig );
+
+#endif /* _android_signal_engine_h */
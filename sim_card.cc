@@ -10,6 +10,7 @@
 ** GNU General Public License for more details.
 */
 #include "sim_card.h"
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
@@ -28,18 +29,21 @@ typedef struct ASimCardRec_ {
     char        puk[ A_SIM_PUK_SIZE+1 ];
     int         pin_retries;
     int         port;
+    unsigned    generation;   /* bumped when the state saved by asimcard_save() changes */
 
     char        out_buff[ 256 ];
     int         out_size;
 
 } ASimCardRec;
 
-static ASimCardRec  _s_card[1];
-
 ASimCard
 asimcard_create(int port)
 {
-    ASimCard  card    = _s_card;
+    ASimCard  card    = (ASimCard) calloc( 1, sizeof(*card) );
+
+    if (card == NULL)
+        return NULL;
+
     card->status      = A_SIM_STATUS_READY;
     card->pin_retries = 0;
     strncpy( card->pin, "0000", sizeof(card->pin) );
@@ -51,8 +55,34 @@ asimcard_create(int port)
 void
 asimcard_destroy( ASimCard  card )
 {
-    /* nothing really */
-    card=card;
+    free( card );
+}
+
+void
+asimcard_save( ASimCard  sim, SnapshotWriter  w )
+{
+    snapshot_put_uint( w, sim->status );
+    snapshot_put_str ( w, sim->pin );
+    snapshot_put_str ( w, sim->puk );
+    snapshot_put_int ( w, sim->pin_retries );
+}
+
+int
+asimcard_load( ASimCard  sim, SnapshotReader  r )
+{
+    ASimCardRec  temp = *sim;
+
+    temp.status      = (ASimStatus) snapshot_get_uint( r );
+    snapshot_get_str( r, temp.pin, sizeof(temp.pin) );
+    snapshot_get_str( r, temp.puk, sizeof(temp.puk) );
+    temp.pin_retries = snapshot_get_int( r );
+
+    if (r->error || temp.status > A_SIM_STATUS_NETWORK_PERSONALIZATION)
+        return -1;
+
+    temp.generation += 1;
+    *sim = temp;
+    return 0;
 }
 
 static __inline__ int
@@ -61,6 +91,12 @@ asimcard_ready( ASimCard  card )
     return card->status == A_SIM_STATUS_READY;
 }
 
+unsigned
+asimcard_get_generation( ASimCard  sim )
+{
+    return sim->generation;
+}
+
 ASimStatus
 asimcard_get_status( ASimCard  sim )
 {
@@ -70,7 +106,10 @@ asimcard_get_status( ASimCard  sim )
 void
 asimcard_set_status( ASimCard  sim, ASimStatus  status )
 {
-    sim->status = status;
+    if (sim->status != status) {
+        sim->status      = status;
+        sim->generation += 1;
+    }
 }
 
 const char*
@@ -90,6 +129,7 @@ asimcard_set_pin( ASimCard  sim, const char*  pin )
 {
     strncpy( sim->pin, pin, A_SIM_PIN_SIZE );
     sim->pin_retries = 0;
+    sim->generation += 1;
 }
 
 void
@@ -97,6 +137,7 @@ asimcard_set_puk( ASimCard  sim, const char*  puk )
 {
     strncpy( sim->puk, puk, A_SIM_PUK_SIZE );
     sim->pin_retries = 0;
+    sim->generation += 1;
 }
 
 
@@ -108,6 +149,8 @@ asimcard_check_pin( ASimCard  sim, const char*  pin )
         return 0;
 
     if ( !strcmp( sim->pin, pin ) ) {
+        if (sim->status != A_SIM_STATUS_READY || sim->pin_retries != 0)
+            sim->generation += 1;
         sim->status      = A_SIM_STATUS_READY;
         sim->pin_retries = 0;
         return 1;
@@ -116,6 +159,7 @@ asimcard_check_pin( ASimCard  sim, const char*  pin )
     if (sim->status != A_SIM_STATUS_READY) {
         if (++sim->pin_retries == 3)
             sim->status = A_SIM_STATUS_PUK;
+        sim->generation += 1;
     }
     return 0;
 }
@@ -132,12 +176,14 @@ asimcard_check_puk( ASimCard  sim, const char* puk, const char*  pin )
         strncpy( sim->pin, pin, A_SIM_PIN_SIZE );
         sim->status      = A_SIM_STATUS_READY;
         sim->pin_retries = 0;
+        sim->generation += 1;
         return 1;
     }
 
     if ( ++sim->pin_retries == 6 ) {
         sim->status = A_SIM_STATUS_ABSENT;
     }
+    sim->generation += 1;
     return 0;
 }
 
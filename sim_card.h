@@ -13,6 +13,7 @@
 #define _android_sim_card_h
 
 #include "gsm.h"
+#include "snapshot.h"
 
 typedef struct ASimCardRec_*    ASimCard;
 
@@ -51,4 +52,13 @@ typedef enum {
 
 extern const char*  asimcard_io( ASimCard  sim, const char*  cmd );
 
+/* save the SIM state (status, PIN, PUK and retries) to a snapshot, and
+ * restore it. asimcard_load() leaves the card untouched and returns -1 if
+ * the data is malformed */
+extern void         asimcard_save( ASimCard  sim, SnapshotWriter  w );
+extern int          asimcard_load( ASimCard  sim, SnapshotReader  r );
+
+/* returns a counter that changes whenever the saved state changes */
+extern unsigned     asimcard_get_generation( ASimCard  sim );
+
 #endif /* _android_sim_card_h */
@@ -29,8 +29,43 @@
 
 #define  DEFAULT_PORT  6703
 
-static AModem  modem;
-static SysChannel s_handler;
+/* one simulated device: a modem, its AT port and its command port (AT
+ * port + 1). all devices share the same event loop and command tables */
+typedef struct {
+    AModem      modem;
+    int         port;
+    SysChannel  server;
+    SysChannel  cmd_server;
+    SysChannel  handler;   /* last AT client, receives unsolicited messages */
+
+    char        snapshot_path[32];
+    SysTimer    snapshot_timer;
+    int         snapshot_pending;
+} DeviceRec, *Device;
+
+/* the modem state is saved at most once per SNAPSHOT_DELAY ms, after the
+ * first command that changed it */
+#define  SNAPSHOT_DELAY  1000
+
+static void
+device_save_snapshot( void*  _device )
+{
+    Device  device = (Device) _device;
+
+    device->snapshot_pending = 0;
+    amodem_snapshot_save( device->modem, device->snapshot_path );
+}
+
+static void
+device_schedule_snapshot( Device  device )
+{
+    if (device->snapshot_pending || !amodem_snapshot_is_dirty( device->modem ))
+        return;
+
+    device->snapshot_pending = 1;
+    sys_timer_set( device->snapshot_timer, sys_time_ms() + SNAPSHOT_DELAY,
+                   device_save_snapshot, device );
+}
 
 // XXX
 
@@ -43,8 +78,9 @@ google::protobuf::uint32 read_header(char *buf)
   return size;
 }
 
-void read_body(int csock, google::protobuf::uint32 size)
+void read_body(Device device, int csock, google::protobuf::uint32 size)
 {
+    AModem modem = device->modem;
     int bytecount;
     sensors_packet payload;
     char* buffer = new char[size+4]; // size of the payload and hdr
@@ -172,28 +208,39 @@ void read_body(int csock, google::protobuf::uint32 size)
 
 typedef struct {
     SysChannel   channel;
+    Device       device;
     char         in_buff[ 128 ];
     int          in_pos;
 
-    char         out_buff[ 128 ];
+    char*        out_buff;  /* grows to hold long answers, e.g. AT%STATS? */
+    int          out_max;
     int          out_pos;
     int          out_size;
 } ClientRec, *Client;
 
+/* pending output of a client that doesn't read is dropped past this */
+#define  CLIENT_OUT_MAX  (64*1024)
+
 static Client
-client_alloc( SysChannel  channel )
+client_alloc( SysChannel  channel, Device  device )
 {
     Client  client = (Client) calloc( sizeof(*client), 1 );
 
     client->channel = channel;
+    client->device  = device;
     return client;
 }
 
 static void
 client_free( Client  client )
 {
+    if (client->device->handler == client->channel)
+        client->device->handler = NULL;
+    amodem_cancel_answer( client->device->modem, client );
+
     sys_channel_close( client->channel );
     client->channel = NULL;
+    free( client->out_buff );
     free( client );
 }
 
@@ -221,27 +268,42 @@ dump_line( const char*  line, const char*  prefix )
     printf( "\n" );
 }
 
+static void
+client_answer( void*  _client, const char*  answer )
+{
+    Client  client = (Client) _client;
+
+    dump_line( answer, ">> " );
+    client_append( client, answer, -1 );
+    client_append( client, "\r", 1 );
+    device_schedule_snapshot( client->device );
+}
+
 static void
 client_handle_line( Client  client, const char*  cmd )
 {
+    AModem       modem = client->device->modem;
     const char*  answer;
 
     dump_line( cmd, "<< " );
-    answer = amodem_send( modem, cmd );
-    if (answer == NULL)  /* not an AT command, ignored */ {
-        printf( "-- NO ANSWER\n" );
+    answer = amodem_send_async( modem, cmd, client_answer, client );
+    if (answer == NULL) {
+        if (amodem_answer_pending( modem, client )) {
+            /* the final result comes through client_answer() */
+            printf( "-- DEFERRED\n" );
+            device_schedule_snapshot( client->device );
+        } else  /* not an AT command, ignored */
+            printf( "-- NO ANSWER\n" );
         return;
     }
-
-    dump_line( answer, ">> " );
-    client_append( client, answer, -1 );
-    client_append( client, "\r", 1 );
+    client_answer( client, answer );
 }
 
 // XXX: Replace with protobuf
 static void
 cmd_client_handle_line( Client  client, const char*  cmd )
 {
+    AModem modem = client->device->modem;
     char command[10];
     bzero(command, 10);
     char* p, *args;
@@ -366,14 +428,36 @@ ExitClient:
 static void
 client_append( Client  client, const char*  str, int len )
 {
-    int  avail;
-
     if (len < 0)
         len = strlen(str);
 
-    avail = sizeof(client->out_buff) - client->out_size;
-    if (len > avail)
-        len = avail;
+    /* reclaim what was already written before growing */
+    if (client->out_size + len > client->out_max && client->out_pos > 0) {
+        client->out_size -= client->out_pos;
+        memmove( client->out_buff, client->out_buff + client->out_pos, client->out_size );
+        client->out_pos = 0;
+    }
+
+    if (client->out_size + len > client->out_max) {
+        int    new_max = client->out_max > 0 ? client->out_max : 256;
+        char*  new_buff;
+
+        if (client->out_size + len > CLIENT_OUT_MAX) {
+            D( "client %p doesn't read its output, dropping %d bytes", client, len );
+            return;
+        }
+        while (new_max < client->out_size + len)
+            new_max *= 2;
+        if (new_max > CLIENT_OUT_MAX)
+            new_max = CLIENT_OUT_MAX;
+
+        new_buff = (char*) realloc( client->out_buff, new_max );
+        if (new_buff == NULL)
+            return;
+
+        client->out_buff = new_buff;
+        client->out_max  = new_max;
+    }
 
     memcpy( client->out_buff + client->out_size, str, len );
     if (client->out_size == 0) {
@@ -384,20 +468,22 @@ client_append( Client  client, const char*  str, int len )
 
 
 static void
-accept_func( void*  _server, int  events )
+accept_func( void*  _device, int  events )
 {
-    SysChannel  server  = (SysChannel) _server;
+    Device      device  = (Device) _device;
     SysChannel  handler;
     Client      client;
 
     D("connection accepted for server channel, getting handler socket");
-    handler = sys_channel_create_tcp_handler( server );
-    client  = client_alloc( handler );
+    handler = sys_channel_create_tcp_handler( device->server );
+    if (handler == NULL)
+        return;
+    client  = client_alloc( handler, device );
     D("got one. created client %p", client);
 
     events=events;
     sys_channel_on( handler, SYS_EVENT_READ, client_handler, client );
-    s_handler = handler;
+    device->handler = handler;
 }
 
 static void
@@ -428,7 +514,8 @@ cmd_client_handler( void* _client, int  events )
               client, framing_size);
             goto ExitCmdClient;
         }
-        read_body(channel_get_fd(client->channel), framing_size);
+        read_body(client->device, channel_get_fd(client->channel), framing_size);
+        device_schedule_snapshot( client->device );
         client->in_buff[0] = 0;
         client->in_pos = 0;
     }
@@ -459,15 +546,17 @@ ExitCmdClient:
 
 
 static void
-cmd_accept_func( void*  _server, int  events )
+cmd_accept_func( void*  _device, int  events )
 {
-    SysChannel  server  = (SysChannel) _server;
+    Device      device  = (Device) _device;
     SysChannel  handler;
     Client      client;
 
     D("connection accepted for server channel, getting handler socket");
-    handler = sys_channel_create_tcp_handler( server );
-    client  = client_alloc( handler );
+    handler = sys_channel_create_tcp_handler( device->cmd_server );
+    if (handler == NULL)
+        return;
+    client  = client_alloc( handler, device );
     D("got one. created client %p", client);
 
     events=events;
@@ -477,29 +566,110 @@ cmd_accept_func( void*  _server, int  events )
 
 
 void func(void* opaque, const char* truc) {
+  Device device = (Device) opaque;
   D("Unsol: %p %s", opaque, truc);
-  sys_channel_write(s_handler, truc, strlen(truc));
+  if (device->handler != NULL)
+    sys_channel_write(device->handler, truc, strlen(truc));
 }
 
 
-
-int  main( void )
+/* create the device listening on AT port 'port' and command port 'port'+1.
+ * 'index' gives its phone number (base port), NVRAM and snapshot files, the
+ * first device keeps the historical "modem_config" and "modem_snapshot".
+ * the last saved state is restored only if 'resume' is set, and the NVRAM
+ * file is rewritten as an image (1) or as text (0) if 'nvram_image' >= 0 */
+static Device
+device_create( int  port, int  index, int  resume, int  nvram_image )
 {
-    int  port = DEFAULT_PORT;
-    SysChannel  server, cmd_server;
+    Device  device = (Device) calloc( sizeof(*device), 1 );
+    char    nvram_path[32];
+    int     opt_nodelay = 1;
+
+    if (device == NULL)
+        return NULL;
+
+    device->port       = port;
+    device->server     = sys_channel_create_tcp_server( port );
+    device->cmd_server = sys_channel_create_tcp_server( port + 1 );
+    if (device->server == NULL || device->cmd_server == NULL) {
+        D( "could not listen on ports %d, %d", port, port + 1 );
+        if (device->server)
+            sys_channel_close( device->server );
+        if (device->cmd_server)
+            sys_channel_close( device->cmd_server );
+        free( device );
+        return NULL;
+    }
+    setsockopt(channel_get_fd(device->cmd_server), IPPROTO_TCP, TCP_NODELAY, &opt_nodelay, sizeof(opt_nodelay));
+    D( "GSM simulator listening on local port %d, %d %p %p", port, port + 1, device->server, device->cmd_server);
+
+    if (index == 0) {
+        snprintf( nvram_path, sizeof(nvram_path), "modem_config" );
+        snprintf( device->snapshot_path, sizeof(device->snapshot_path), "modem_snapshot" );
+    } else {
+        snprintf( nvram_path, sizeof(nvram_path), "modem_config.%d", port );
+        snprintf( device->snapshot_path, sizeof(device->snapshot_path), "modem_snapshot.%d", port );
+    }
 
-    sys_main_init();
+    device->modem = amodem_create_with_nvram( index + 1, nvram_path, func, device );
+    if (device->modem == NULL) {
+        D( "could not create the modem for ports %d, %d", port, port + 1 );
+        sys_channel_close( device->server );
+        sys_channel_close( device->cmd_server );
+        free( device );
+        return NULL;
+    }
+    device->snapshot_timer = sys_timer_create();
 
-    server = sys_channel_create_tcp_server( port );
-    cmd_server = sys_channel_create_tcp_server( port  + 1);
-    int opt_nodelay;
-    setsockopt(channel_get_fd(cmd_server), IPPROTO_TCP, TCP_NODELAY, &opt_nodelay, sizeof(opt_nodelay));
-    D( "GSM simulator listening on local port %d, %d %p %p", port, port + 1, server, cmd_server);
+    if (nvram_image >= 0 && amodem_set_nvram_image( device->modem, nvram_image ) < 0)
+        D( "could not convert %s", nvram_path );
 
-    modem = amodem_create( 1, func, server);
+    /* resume from the last saved state, if any. a cold start must not
+     * bring back the calls and contexts of whatever ran before */
+    if (resume && amodem_snapshot_load( device->modem, device->snapshot_path ) == 0)
+        D( "restored modem state from %s", device->snapshot_path );
+
+    sys_channel_on( device->server, SYS_EVENT_READ, accept_func, device );
+    sys_channel_on( device->cmd_server, SYS_EVENT_READ, cmd_accept_func, device );
+    return device;
+}
+
+
+/* usage: gsmd [-r] [-n image|text] [port ...], one device per AT port,
+ * 6703 by default.
+ *   -r       resume each device from its last snapshot, e.g. after a VM restore
+ *   -n fmt   convert the NVRAM files to a binary image, or back to text */
+int  main( int  argc, char**  argv )
+{
+    int  nn, count = 0, first, resume = 0, nvram_image = -1;
+
+    for (first = 1; first < argc && argv[first][0] == '-'; first++) {
+        if (!strcmp( argv[first], "-r" ))
+            resume = 1;
+        else if (!strcmp( argv[first], "-n" ) && first + 1 < argc &&
+                 (!strcmp( argv[first+1], "image" ) || !strcmp( argv[first+1], "text" )))
+            nvram_image = !strcmp( argv[++first], "image" );
+        else {
+            fprintf( stderr, "usage: %s [-r] [-n image|text] [port ...]\n", argv[0] );
+            return 1;
+        }
+    }
+
+    sys_main_init();
+    amodem_load_plugins( getenv( "GSMD_PLUGINS" ) );
+
+    if (argc <= first) {
+        if (device_create( DEFAULT_PORT, 0, resume, nvram_image ) != NULL)
+            count++;
+    } else {
+        for (nn = first; nn < argc; nn++) {
+            if (device_create( atoi( argv[nn] ), nn - first, resume, nvram_image ) != NULL)
+                count++;
+        }
+    }
+    if (count == 0)
+        return 1;
 
-    sys_channel_on( server, SYS_EVENT_READ, accept_func, server );
-    sys_channel_on( cmd_server, SYS_EVENT_READ, cmd_accept_func, cmd_server );
     sys_main_loop();
     D( "GSM simulator exiting" );
     return 0;
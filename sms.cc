@@ -11,6 +11,7 @@
 */
 #include "sms.h"
 #include "gsm.h"
+#include "sysdeps.h"
 #include <memory.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -23,8 +24,8 @@
 /* maximum number of 7-bit septets in a SMS text message */
 #define  MAX_USER_DATA_SEPTETS  160
 
-/* size of the user data header in bytes */
-#define  USER_DATA_HEADER_SIZE   6
+/* size of the user data header in bytes, a single 16-bit concatenation element */
+#define  USER_DATA_HEADER_SIZE   7
 
 #define D_ACTIVE 0
 
@@ -400,23 +401,21 @@ Exit:
 int
 sms_address_from_hex  ( SmsAddress  address, const char*  hex, int  hexlen )
 {
-    const char*  hexend = hex + hexlen;
-    int          nn, len, num_digits;
+    byte_t  header[2];
+    int     len;
 
-    if (hexlen < 4)
+    if (hexlen < 4 || gsm_hex_to_bytes( (cbytes_t)hex, 4, header ) < 0)
         return -1;
 
-    address->len = num_digits = gsm_hex2_to_byte( hex );
-    address->toa = gsm_hex2_to_byte( hex+2 );
-    hex += 4;
-
-    len = (num_digits + 1)/2;
-    if (hex + len*2 > hexend)
+    len = (header[0] + 1)/2;
+    if (len > (int)sizeof(address->data) || 4 + len*2 > hexlen)
         return -1;
 
-    for ( nn = 0; nn < len; nn++ )
-        address->data[nn] = gsm_hex2_to_byte( hex + nn*2 );
+    if (gsm_hex_to_bytes( (cbytes_t)hex + 4, len*2, address->data ) < 0)
+        return -1;
 
+    address->len = header[0];
+    address->toa = header[1];
     return 0;
 }
 
@@ -424,7 +423,6 @@ int
 sms_address_to_hex    ( SmsAddress  address, char*   hex, int  hexlen )
 {
     int  len = (address->len + 1)/2 + 2;
-    int  nn;
 
     if (hex == NULL)
         hexlen = 0;
@@ -436,10 +434,9 @@ sms_address_to_hex    ( SmsAddress  address, char*   hex, int  hexlen )
     hex    += 4;
     hexlen -= 4;
     if ( hexlen > 2*(len - 2) )
-        hexlen = (len - 2)/2;
+        hexlen = 2*(len - 2);
 
-    for ( nn = 0; nn < hexlen; nn += 2 )
-        gsm_hex_from_byte( hex+nn, address->data[nn/2] );
+    gsm_hex_from_bytes( hex, address->data, hexlen/2 );
 
 Exit:
     return len*2;
@@ -464,7 +461,7 @@ sms_address_eq( const SmsAddressRec*  addr1, const SmsAddressRec*  addr2 )
          addr1->len != addr2->len )
         return 0;
 
-    return ( !memcmp( addr1->data, addr2->data, addr1->len ) );
+    return ( !memcmp( addr1->data, addr2->data, (addr1->len + 1)/2 ) );
 }
 
 /** SMS PARSER
@@ -625,6 +622,7 @@ sms_skip_address( cbytes_t   *pcur,
     if (cur > end)
         goto Exit;
 
+    *pcur  = cur;
     result = 0;
 Exit:
     return result;
@@ -668,11 +666,11 @@ sms_skip_validity_period( cbytes_t  *pcur,
     cbytes_t  cur = *pcur;
 
     switch ((mtiByte >> 3) & 3) {
-        case 1:  /* relative format */
+        case 2:  /* relative format */
             cur += 1;
             break;
 
-        case 2:  /* enhanced format */
+        case 1:  /* enhanced format */
         case 3:  /* absolute format */
             cur += 7;
     }
@@ -697,9 +695,7 @@ smspdu_free( SmsPDU  pdu )
 {
     if (pdu) {
         free( pdu->base );
-        pdu->base = NULL;
-        pdu->end  = NULL;
-        pdu->tpdu = NULL;
+        free( pdu );
     }
 }
 
@@ -797,16 +793,8 @@ sms_get_coding_scheme( cbytes_t  *pcur,
     *pcur      = cur;
 
     switch (dataCoding >> 4) {
-        case 0x00:
-        case 0x02:
-        case 0x03:
-            return SMS_CODING_SCHEME_GSM7;
-
-        case 0x01:
-            if (dataCoding == 0x10) return SMS_CODING_SCHEME_GSM7;
-            if (dataCoding == 0x11) return SMS_CODING_SCHEME_UCS2;
-            break;
-
+        /* general data coding, the alphabet is in bits 3-2 */
+        case 0x00: case 0x01: case 0x02: case 0x03:
         case 0x04: case 0x05: case 0x06: case 0x07:
             if (dataCoding & 0x20)           return SMS_CODING_SCHEME_UNKNOWN; /* compressed 7-bits */
             if (((dataCoding >> 2) & 3) == 0) return SMS_CODING_SCHEME_GSM7;
@@ -832,6 +820,7 @@ sms_get_text_utf8( cbytes_t        *pcur,
     cbytes_t  cur    = *pcur;
     int       result = -1;
     int       len;
+    int       skip   = 0;   /* septets taken by the header */
 
     if (cur >= end)
         goto Exit;
@@ -846,33 +835,38 @@ sms_get_text_utf8( cbytes_t        *pcur,
         if (cur >= end)
             goto Exit;
 
-        hlen = *cur++;
-        if (cur + hlen > end)
+        hlen = cur[0];
+        if (cur + 1 + hlen > end)
             goto Exit;
 
-        cur += hlen;
-
+        /* GSM text starts on the septet boundary that follows the header */
         if (coding == SMS_CODING_SCHEME_GSM7)
-            len -= 2*(hlen+1);
-        else
-            len -= hlen+1;
+            skip = ((hlen+1)*8 + 6)/7;
+        else {
+            cur += 1 + hlen;
+            skip = 1 + hlen;
+        }
+        len -= skip;
 
         if (len < 0)
             goto Exit;
     }
 
-    /* switch the user data header if any */
     if (coding == SMS_CODING_SCHEME_GSM7)
     {
-        int  count = utf8_from_gsm7( cur, 0, len, NULL );
+        int  count;
+
+        if (cur + ((skip + len)*7 + 7)/8 > end)
+            goto Exit;
 
+        count = utf8_from_gsm7( cur, skip*7, len, NULL );
         if (rope != NULL)
         {
             bytes_t  dst = (bytes_t) gsm_rope_reserve( rope, count );
             if (dst != NULL)
-                utf8_from_gsm7( cur, 0, len, dst );
+                utf8_from_gsm7( cur, skip*7, len, dst );
         }
-        cur += (len+1)/2;
+        cur += ((skip + len)*7 + 7)/8;
     }
     else if (coding == SMS_CODING_SCHEME_UCS2)
     {
@@ -913,7 +907,7 @@ smspdu_get_text_message( SmsPDU  pdu, unsigned char*  utf8, int  utf8len )
                 GsmRopeRec       rope[1];
                 int              result;
 
-                if ( sms_get_sc_address( &data, end, &address ) < 0 )
+                if ( sms_get_address( &data, end, &address ) < 0 )
                     goto Fail;
 
                 data  += 1;  /* skip protocol identifier */
@@ -924,8 +918,11 @@ smspdu_get_text_message( SmsPDU  pdu, unsigned char*  utf8, int  utf8len )
                 if ( sms_get_timestamp( &data, end, &timestamp ) < 0 )
                     goto Fail;
 
-                if ( sms_get_text_utf8( &data, end, (mtiByte & 0x40), coding, rope ) < 0 )
+                gsm_rope_init_alloc( rope, 0 );
+                if ( sms_get_text_utf8( &data, end, (mtiByte & 0x40), coding, rope ) < 0 ) {
+                    gsm_rope_done( rope );
                     goto Fail;
+                }
 
                 result = rope->pos;
                 if (utf8len > result)
@@ -976,8 +973,10 @@ Fail:
     return -1;
 }
 
+/* find the concatenation element of the user data header, 8-bit (0x00) or
+ * 16-bit (0x08) reference, and return a pointer to its (max, cur) bytes */
 static cbytes_t
-smspdu_get_user_data_ref( SmsPDU  pdu )
+smspdu_get_user_data_ref( SmsPDU  pdu, int  *pref )
 {
     cbytes_t  data    = pdu->tpdu;
     cbytes_t  end     = pdu->end;
@@ -1016,7 +1015,7 @@ smspdu_get_user_data_ref( SmsPDU  pdu )
             goto Fail;
     }
 
-    /* skip user-data length */
+    /* skip user-data length, the header length follows */
     if (data+1 >= end)
         goto Fail;
 
@@ -1027,12 +1026,17 @@ smspdu_get_user_data_ref( SmsPDU  pdu )
         int  htype = data[0];
         int  hlen = data[1];
 
-        if (htype == 00 && hlen == 3 && data + 5 <= end) {
-            return data + 2;
+        if (htype == 0x00 && hlen == 3 && data + 5 <= end) {
+            *pref = data[2];
+            return data + 3;
+        }
+        if (htype == 0x08 && hlen == 4 && data + 6 <= end) {
+            *pref = (data[2] << 8) | data[3];
+            return data + 4;
         }
 
-        data += hlen;
-        len  -= hlen - 2;
+        data += 2 + hlen;
+        len  -= 2 + hlen;
     }
 Fail:
     return NULL;
@@ -1041,11 +1045,12 @@ Fail:
 int
 smspdu_get_ref( SmsPDU  pdu )
 {
-    cbytes_t  user_ref = smspdu_get_user_data_ref( pdu );
+    int       ref;
+    cbytes_t  user_ref = smspdu_get_user_data_ref( pdu, &ref );
 
     if (user_ref != NULL)
     {
-        return user_ref[0];
+        return ref;
     }
     else
     {
@@ -1065,10 +1070,11 @@ smspdu_get_ref( SmsPDU  pdu )
 int
 smspdu_get_max_index( SmsPDU  pdu )
 {
-    cbytes_t  user_ref = smspdu_get_user_data_ref( pdu );
+    int       ref;
+    cbytes_t  user_ref = smspdu_get_user_data_ref( pdu, &ref );
 
     if (user_ref != NULL) {
-        return user_ref[1];
+        return user_ref[0];
     } else {
         return 1;
     }
@@ -1077,10 +1083,11 @@ smspdu_get_max_index( SmsPDU  pdu )
 int
 smspdu_get_cur_index( SmsPDU  pdu )
 {
-    cbytes_t  user_ref = smspdu_get_user_data_ref( pdu );
+    int       ref;
+    cbytes_t  user_ref = smspdu_get_user_data_ref( pdu, &ref );
 
     if (user_ref != NULL) {
-        return user_ref[2] - 1;
+        return user_ref[1] - 1;
     } else {
         return 0;
     }
@@ -1093,20 +1100,54 @@ gsm_rope_add_sms_user_header( GsmRope  rope,
                               int      pdu_count,
                               int      pdu_index )
 {
-    gsm_rope_add_c( rope, 0x05 );     /* total header length == 5 bytes */
-    gsm_rope_add_c( rope, 0x00 );     /* element id: concatenated message reference number */
-    gsm_rope_add_c( rope, 0x03 );     /* element len: 3 bytes */
-    gsm_rope_add_c( rope, (byte_t)ref_number );  /* reference number */
+    gsm_rope_add_c( rope, 0x06 );     /* total header length == 6 bytes */
+    gsm_rope_add_c( rope, 0x08 );     /* element id: concatenated message, 16-bit reference number */
+    gsm_rope_add_c( rope, 0x04 );     /* element len: 4 bytes */
+    gsm_rope_add_c( rope, (byte_t)(ref_number >> 8) );  /* reference number */
+    gsm_rope_add_c( rope, (byte_t)ref_number );
     gsm_rope_add_c( rope, (byte_t)pdu_count );     /* max pdu index */
     gsm_rope_add_c( rope, (byte_t)pdu_index+1 );   /* current pdu index */
 }
 
-/* write a SMS-DELIVER PDU into a rope */
+/* number of septets taken by the user data header, and padding bits before the
+ * text that follows it */
+#define  USER_DATA_HEADER_SEPTETS  ((USER_DATA_HEADER_SIZE*8 + 6) / 7)
+#define  USER_DATA_HEADER_PAD      (USER_DATA_HEADER_SEPTETS*7 - USER_DATA_HEADER_SIZE*8)
+
+/* text that fits in each part of a multipart message */
+#define  USER_DATA_PART_SEPTETS    (MAX_USER_DATA_SEPTETS - USER_DATA_HEADER_SEPTETS)
+#define  USER_DATA_PART_UCS2       ((MAX_USER_DATA_BYTES - USER_DATA_HEADER_SIZE)/2)
+
+/* size of the PDU written by gsm_rope_add_sms_deliver_pdu() */
+static int
+sms_deliver_pdu_size( const SmsAddressRec*  sender_address,
+                      int                   use_gsm7,
+                      int                   count,
+                      int                   pdu_count )
+{
+    int  size = 1 + 1 + 2 + (sender_address->len+1)/2 + 1 + 1 + 7 + 1;
+    int  pad  = 0;
+
+    if (pdu_count > 1) {
+        size += USER_DATA_HEADER_SIZE;
+        pad   = USER_DATA_HEADER_PAD;
+    }
+    if (use_gsm7)
+        size += (count*7+pad+7)/8;
+    else
+        size += count*2;
+
+    return size;
+}
+
+/* write a SMS-DELIVER PDU into a rope, 'count' is the length of the text
+ * in septets or UCS-2 characters */
 static void
 gsm_rope_add_sms_deliver_pdu( GsmRope                 rope,
                               cbytes_t                utf8,
                               int                     utf8len,
                               int                     use_gsm7,
+                              int                     count,
                               const SmsAddressRec*    sender_address,
                               const SmsTimeStampRec*  timestamp,
                               int                     ref_num,
@@ -1132,21 +1173,15 @@ gsm_rope_add_sms_deliver_pdu( GsmRope                 rope,
 
     if (use_gsm7) {
         bytes_t  dst;
-        int    count = utf8_to_gsm7( utf8, utf8len, NULL, 0 );
         int    pad   = 0;
 
-        assert( count <= MAX_USER_DATA_SEPTETS - USER_DATA_HEADER_SIZE );
+        assert( count <= (pdu_count > 1 ? USER_DATA_PART_SEPTETS : MAX_USER_DATA_SEPTETS) );
 
         if (pdu_count > 1)
         {
-            int  headerBits    = 6*8;  /* 6 is size of header in bytes */
-            int  headerSeptets = headerBits / 7;
-            if (headerBits % 7 > 0)
-                headerSeptets += 1;
-
-            pad = headerSeptets*7 - headerBits;
+            pad = USER_DATA_HEADER_PAD;
 
-            gsm_rope_add_c( rope, count + headerSeptets );
+            gsm_rope_add_c( rope, count + USER_DATA_HEADER_SEPTETS );
             gsm_rope_add_sms_user_header(rope, ref_num, pdu_count, pdu_index);
         }
         else
@@ -1160,19 +1195,17 @@ gsm_rope_add_sms_deliver_pdu( GsmRope                 rope,
         }
     } else {
         bytes_t  dst;
-        int      count = utf8_to_ucs2( utf8, utf8len, NULL );
 
-        assert( count*2 <= MAX_USER_DATA_BYTES - USER_DATA_HEADER_SIZE );
+        assert( count <= (pdu_count > 1 ? USER_DATA_PART_UCS2 : MAX_USER_DATA_BYTES/2) );
 
         if (pdu_count > 1)
         {
-            gsm_rope_add_c( rope, count*2 + 6 );
+            gsm_rope_add_c( rope, count*2 + USER_DATA_HEADER_SIZE );
             gsm_rope_add_sms_user_header( rope, ref_num, pdu_count, pdu_index );
         }
         else
             gsm_rope_add_c( rope, count*2 );
 
-        gsm_rope_add_c( rope, count*2 );
         dst = (bytes_t) gsm_rope_reserve( rope, count*2 );
         if (dst != NULL) {
             utf8_to_ucs2( utf8, utf8len, dst );
@@ -1185,6 +1218,7 @@ static SmsPDU
 smspdu_create_deliver( cbytes_t               utf8,
                        int                    utf8len,
                        int                    use_gsm7,
+                       int                    count,
                        const SmsAddressRec*   sender_address,
                        const SmsTimeStampRec* timestamp,
                        int                    ref_num,
@@ -1198,18 +1232,17 @@ smspdu_create_deliver( cbytes_t               utf8,
     p = (SmsPDU) calloc( sizeof(*p), 1 );
     if (!p) goto Exit;
 
-    gsm_rope_init( rope );
-    gsm_rope_add_sms_deliver_pdu( rope, utf8, utf8len, use_gsm7,
-                                 sender_address, timestamp,
-                                 ref_num, pdu_count, pdu_index);
-    if (rope->error)
-        goto Fail;
-
-    gsm_rope_init_alloc( rope, rope->pos );
-
-    gsm_rope_add_sms_deliver_pdu( rope, utf8, utf8len, use_gsm7,
+    /* the size is known in advance, the PDU is written once */
+    size = sms_deliver_pdu_size( sender_address, use_gsm7, count, pdu_count );
+    gsm_rope_init_alloc( rope, size );
+    gsm_rope_add_sms_deliver_pdu( rope, utf8, utf8len, use_gsm7, count,
                                  sender_address, timestamp,
                                  ref_num, pdu_count, pdu_index );
+    if (rope->error) {
+        gsm_rope_done( rope );
+        goto Fail;
+    }
+    assert( rope->pos == size );
 
     p->base = gsm_rope_done_acquire( rope, &size );
     if (p->base == NULL)
@@ -1225,6 +1258,92 @@ Fail:
     return NULL;
 }
 
+/* multipart messages carry a 16-bit reference that the receiver matches
+ * with the sender address, so references are counted per sender and only
+ * come back after 65536 messages from the same one. senders are kept in an
+ * open-addressed table that doubles when half full, up to SMS_REF_MAX_SLOTS.
+ * it is then emptied, and the senders seen again start from a counter
+ * advanced by all messages, which makes an early reuse unlikely */
+#define  SMS_REF_MIN_SLOTS  16
+#define  SMS_REF_MAX_SLOTS  8192
+
+typedef struct {
+    SmsAddressRec   from;
+    unsigned short  next;
+    unsigned char   used;
+} SmsRefSlotRec, *SmsRefSlot;
+
+static SmsRefSlot      _s_ref_slots;
+static unsigned        _s_ref_mask;
+static unsigned        _s_ref_count;
+static unsigned short  _s_ref_seed;
+
+static unsigned
+sms_address_hash( const SmsAddressRec*  from )
+{
+    unsigned  hash = 2166136261U;
+    int       len  = (from->len + 1)/2;
+    int       nn;
+
+    if (len > (int)sizeof(from->data))
+        len = sizeof(from->data);
+
+    hash = (hash ^ from->len) * 16777619U;
+    hash = (hash ^ from->toa) * 16777619U;
+    for (nn = 0; nn < len; nn++)
+        hash = (hash ^ from->data[nn]) * 16777619U;
+    return hash;
+}
+
+static SmsRefSlot
+sms_ref_slot( SmsRefSlot  slots, unsigned  mask, const SmsAddressRec*  from )
+{
+    unsigned  nn = sms_address_hash( from ) & mask;
+
+    while (slots[nn].used && !sms_address_eq( &slots[nn].from, from ))
+        nn = (nn + 1) & mask;
+
+    return slots + nn;
+}
+
+/* return the next reference for 'from', or -1 if out of memory */
+static int
+sms_ref_alloc( const SmsAddressRec*  from )
+{
+    SmsRefSlot  slot;
+
+    if (_s_ref_count >= _s_ref_mask/2 && _s_ref_mask+1 >= SMS_REF_MAX_SLOTS) {
+        memset( _s_ref_slots, 0, (_s_ref_mask+1)*sizeof(_s_ref_slots[0]) );
+        _s_ref_count = 0;
+    }
+    else if (_s_ref_count >= _s_ref_mask/2) {
+        unsigned    size  = _s_ref_slots ? 2*(_s_ref_mask+1) : SMS_REF_MIN_SLOTS;
+        SmsRefSlot  slots = (SmsRefSlot) calloc( size, sizeof(*slots) );
+        unsigned    nn;
+
+        if (slots == NULL)
+            return -1;
+
+        for (nn = 0; _s_ref_slots && nn <= _s_ref_mask; nn++) {
+            if (_s_ref_slots[nn].used)
+                sms_ref_slot( slots, size-1, &_s_ref_slots[nn].from )[0] = _s_ref_slots[nn];
+        }
+        free( _s_ref_slots );
+        _s_ref_slots = slots;
+        _s_ref_mask  = size-1;
+    }
+
+    slot = sms_ref_slot( _s_ref_slots, _s_ref_mask, from );
+    if (!slot->used) {
+        slot->from = from[0];
+        slot->next = _s_ref_seed;
+        slot->used = 1;
+        _s_ref_count += 1;
+    }
+    _s_ref_seed += 1;
+    return slot->next++;
+}
+
 
 void
 smspdu_free_list( SmsPDU*  pdus )
@@ -1248,69 +1367,55 @@ smspdu_create_deliver_utf8( const unsigned char*   utf8,
 {
     SmsTimeStampRec  ts0;
     int              use_gsm7;
-    int              count, block;
-    int              num_pdus = 0;
-    int              leftover = 0;
+    int              num_pdus, nn;
+    GsmSegment       segments;
     SmsPDU*          list = NULL;
-
-    static unsigned char  ref_num = 0;
+    int              ref_num;
 
     if (timestamp == NULL) {
         sms_timestamp_now( &ts0 );
         timestamp = &ts0;
     }
 
-    /* can we encode the message with the GSM 7-bit alphabet ? */
-    use_gsm7 = utf8_check_gsm7( utf8, utf8len );
-
-    /* count the number of SMS PDUs we'll need */
-    block = MAX_USER_DATA_SEPTETS - USER_DATA_HEADER_SIZE;
+    /* find the alphabet and the text of each SMS PDU in a single pass, the
+     * parts of a text that doesn't fit in one PDU leave room for the
+     * concatenation header */
+    num_pdus = utf8_split_segments( utf8, utf8len,
+                                    MAX_USER_DATA_SEPTETS, MAX_USER_DATA_BYTES/2,
+                                    USER_DATA_PART_SEPTETS, USER_DATA_PART_UCS2,
+                                    &use_gsm7, &segments );
+    if (num_pdus < 0)
+        return NULL;
 
-    if (use_gsm7) {
-        count = utf8_to_gsm7( utf8, utf8len, NULL, 0 );
-    } else {
-        count = utf8_to_ucs2( utf8, utf8len, NULL );
-        block = MAX_USER_DATA_BYTES - USER_DATA_HEADER_SIZE;
+    ref_num = 0;
+    if (num_pdus > 1) {
+        ref_num = sms_ref_alloc( sender_address );
+        if (ref_num < 0) {
+            free( segments );
+            return NULL;
+        }
     }
 
-    num_pdus = count / block;
-    leftover = count - num_pdus*block;
-    if (leftover > 0)
-        num_pdus += 1;
-
     list = (SmsPDURec**) calloc( sizeof(SmsPDU), num_pdus + 1 );
     if (list == NULL)
-        return NULL;
+        goto Fail;
 
     /* now create each SMS PDU */
+    for (nn = 0; nn < num_pdus; nn++)
     {
-        cbytes_t   src     = utf8;
-        cbytes_t   src_end = utf8 + utf8len;
-        int        nn;
-
-        for (nn = 0; nn < num_pdus; nn++)
-        {
-            int       skip = block;
-            cbytes_t  src_next;
-
-            if (leftover > 0 && nn == num_pdus-1)
-                skip = leftover;
-
-            src_next = utf8_skip_gsm7( src, src_end, skip );
-
-            list[nn] = smspdu_create_deliver( src, src_next - src, use_gsm7, sender_address, timestamp,
-                                              ref_num, num_pdus, nn );
-            if (list[nn] == NULL)
-                goto Fail;
+        GsmSegment  seg = segments + nn;
 
-            src = src_next;
-        }
+        list[nn] = smspdu_create_deliver( utf8 + seg->offset, seg->len, use_gsm7, seg->count,
+                                          sender_address, timestamp,
+                                          ref_num, num_pdus, nn );
+        if (list[nn] == NULL)
+            goto Fail;
     }
-
-    ref_num++;
+    free( segments );
     return list;
 
 Fail:
+    free( segments );
     smspdu_free_list(list);
     return NULL;
 }
@@ -1356,14 +1461,12 @@ int
 smspdu_to_hex( SmsPDU  pdu, char*  hex, int  hexlen )
 {
     int  result = (pdu->end - pdu->base)*2;
-    int  nn;
 
     if (hexlen > result)
         hexlen = result;
 
-    for (nn = 0; nn*2 < hexlen; nn++) {
-        gsm_hex_from_byte( &hex[nn*2], pdu->base[nn] );
-    }
+    if (hex != NULL)
+        gsm_hex_from_bytes( hex, pdu->base, hexlen/2 );
     return result;
 }
 
@@ -1372,10 +1475,21 @@ smspdu_to_hex( SmsPDU  pdu, char*  hex, int  hexlen )
  ** collects one or more SMS-SUBMIT PDUs to generate a single message to deliver
  **/
 
+/* partial messages are found by (receiver address, ref) when a fragment
+ * arrives, and by index when they're complete, through two hash tables.
+ * they're also linked from the least to the most recently updated one,
+ * to drop those that stopped receiving fragments, or the oldest ones when
+ * the receiver holds too much */
 typedef struct SmsFragmentRec {
-    struct SmsFragmentRec*  next;
+    struct SmsFragmentRec*  next_key;     /* in the by_key bucket */
+    struct SmsFragmentRec*  next_index;   /* in the by_index bucket */
+    struct SmsFragmentRec*  older;
+    struct SmsFragmentRec*  newer;
+    unsigned                hash;         /* of the address and ref */
+    long long               stamp;        /* when the last fragment arrived */
+    int                     bytes;        /* size of the received PDUs */
     SmsAddressRec           from[1];
-    byte_t                  ref;
+    int                     ref;          /* 8 or 16 bits */
     byte_t                  max;
     byte_t                  count;
     int                     index;
@@ -1386,10 +1500,25 @@ typedef struct SmsFragmentRec {
 
 typedef struct SmsReceiverRec {
     int           last;
-    SmsFragment   fragments;
+    SmsFragment*  by_key;
+    SmsFragment*  by_index;
+    unsigned      mask;         /* number of buckets - 1 */
+    int           count;        /* number of messages */
+    int           bytes;        /* size of all PDUs */
+    SmsFragment   oldest;
+    SmsFragment   newest;
+
+    int           timeout;
+    int           max_messages;
+    int           max_bytes;
+    unsigned      expired;
+    unsigned      evicted;
+    unsigned      generation;   /* bumped whenever the saved content changes */
 
 } SmsReceiverRec;
 
+#define  SMS_RECEIVER_MIN_BUCKETS  16
+
 
 static void
 sms_fragment_free( SmsFragment  frag )
@@ -1409,6 +1538,17 @@ sms_fragment_free( SmsFragment  frag )
     free( frag );
 }
 
+/* FNV-1a of the address digits and the reference */
+static unsigned
+sms_fragment_hash( const SmsAddressRec*  from, int  ref )
+{
+    unsigned  hash = sms_address_hash( from );
+
+    hash = (hash ^ (ref & 0xff)) * 16777619U;
+    hash = (hash ^ ((ref >> 8) & 0xff)) * 16777619U;
+    return hash;
+}
+
 static SmsFragment
 sms_fragment_alloc( SmsReceiver  rec, const SmsAddressRec*  from, int   ref, int  max )
 {
@@ -1420,60 +1560,236 @@ sms_fragment_alloc( SmsReceiver  rec, const SmsAddressRec*  from, int   ref, int
         frag->max     = max;
         frag->pdus    = (SmsPDU*)(frag + 1);
         frag->index   = ++rec->last;
+        frag->hash    = sms_fragment_hash( from, ref );
     }
     return  frag;
 }
 
 
+/* resize both tables to 'buckets', a power of 2 */
+static int
+sms_receiver_rehash( SmsReceiver  rec, unsigned  buckets )
+{
+    SmsFragment*  by_key   = (SmsFragment*) calloc( buckets, sizeof(SmsFragment) );
+    SmsFragment*  by_index = (SmsFragment*) calloc( buckets, sizeof(SmsFragment) );
+    SmsFragment   frag;
+
+    if (by_key == NULL || by_index == NULL) {
+        free( by_key );
+        free( by_index );
+        return -1;
+    }
+    for (frag = rec->oldest; frag != NULL; frag = frag->newer) {
+        SmsFragment*  pkey   = &by_key[ frag->hash & (buckets-1) ];
+        SmsFragment*  pindex = &by_index[ frag->index & (buckets-1) ];
+
+        frag->next_key   = *pkey;
+        *pkey            = frag;
+        frag->next_index = *pindex;
+        *pindex          = frag;
+    }
+    free( rec->by_key );
+    free( rec->by_index );
+    rec->by_key   = by_key;
+    rec->by_index = by_index;
+    rec->mask     = buckets - 1;
+    return 0;
+}
 
 SmsReceiver   sms_receiver_create( void )
 {
     SmsReceiver  rec = (SmsReceiver) calloc(sizeof(*rec),1);
+
+    if (rec == NULL)
+        return NULL;
+
+    if (sms_receiver_rehash( rec, SMS_RECEIVER_MIN_BUCKETS ) < 0) {
+        free(rec);
+        return NULL;
+    }
+    rec->timeout      = SMS_RECEIVER_TIMEOUT;
+    rec->max_messages = SMS_RECEIVER_MAX_MESSAGES;
+    rec->max_bytes    = SMS_RECEIVER_MAX_BYTES;
     return rec;
 }
 
 void
 sms_receiver_destroy( SmsReceiver  rec )
 {
-    while (rec->fragments) {
-        SmsFragment  frag = rec->fragments;
-        rec->fragments = frag->next;
+    while (rec->oldest) {
+        SmsFragment  frag = rec->oldest;
+        rec->oldest = frag->newer;
         sms_fragment_free(frag);
     }
+    free(rec->by_key);
+    free(rec->by_index);
+    free(rec);
 }
 
-static SmsFragment*
-sms_receiver_find_p( SmsReceiver  rec, const SmsAddressRec*  from, int  ref )
+/* add a message to the tables, as the most recent one */
+static int
+sms_receiver_insert( SmsReceiver  rec, SmsFragment  frag )
 {
-    SmsFragment*  pnode = &rec->fragments;
-    SmsFragment   node;
+    SmsFragment*  pkey;
+    SmsFragment*  pindex;
 
-    for (;;) {
-        node = *pnode;
-        if (node == NULL)
-            break;
-        if (node->ref == ref && sms_address_eq( node->from, from ))
+    if ((unsigned)rec->count > rec->mask &&
+        sms_receiver_rehash( rec, 2*(rec->mask + 1) ) < 0)
+        return -1;
+
+    pkey             = &rec->by_key[ frag->hash & rec->mask ];
+    pindex           = &rec->by_index[ frag->index & rec->mask ];
+    frag->next_key   = *pkey;
+    *pkey            = frag;
+    frag->next_index = *pindex;
+    *pindex          = frag;
+
+    frag->older = rec->newest;
+    frag->newer = NULL;
+    if (rec->newest)
+        rec->newest->newer = frag;
+    else
+        rec->oldest = frag;
+    rec->newest = frag;
+
+    rec->count += 1;
+    rec->bytes += frag->bytes;
+    rec->generation += 1;
+    return 0;
+}
+
+/* remove a message from the tables, without freeing it */
+static void
+sms_receiver_unlink( SmsReceiver  rec, SmsFragment  frag )
+{
+    SmsFragment*  pnode;
+
+    for (pnode = &rec->by_key[ frag->hash & rec->mask ]; *pnode != frag; )
+        pnode = &(*pnode)->next_key;
+    *pnode = frag->next_key;
+
+    for (pnode = &rec->by_index[ frag->index & rec->mask ]; *pnode != frag; )
+        pnode = &(*pnode)->next_index;
+    *pnode = frag->next_index;
+
+    if (frag->older)
+        frag->older->newer = frag->newer;
+    else
+        rec->oldest = frag->newer;
+    if (frag->newer)
+        frag->newer->older = frag->older;
+    else
+        rec->newest = frag->older;
+
+    rec->count -= 1;
+    rec->bytes -= frag->bytes;
+    rec->generation += 1;
+}
+
+/* move a message that just received a fragment to the end of the list */
+static void
+sms_receiver_touch( SmsReceiver  rec, SmsFragment  frag )
+{
+    frag->stamp      = sys_time_ms();
+    rec->generation += 1;
+    if (frag == rec->newest)
+        return;
+
+    if (frag->older)
+        frag->older->newer = frag->newer;
+    else
+        rec->oldest = frag->newer;
+    frag->newer->older = frag->older;
+
+    frag->older        = rec->newest;
+    frag->newer        = NULL;
+    rec->newest->newer = frag;
+    rec->newest        = frag;
+}
+
+static SmsFragment
+sms_receiver_find( SmsReceiver  rec, const SmsAddressRec*  from, int  ref )
+{
+    unsigned     hash = sms_fragment_hash( from, ref );
+    SmsFragment  node = rec->by_key[ hash & rec->mask ];
+
+    for ( ; node != NULL; node = node->next_key ) {
+        if (node->hash == hash && node->ref == ref && sms_address_eq( node->from, from ))
             break;
-        pnode = &node->next;
     }
-    return  pnode;
+    return  node;
 }
 
-static SmsFragment*
-sms_receiver_find_index_p( SmsReceiver  rec, int  index )
+static SmsFragment
+sms_receiver_find_index( SmsReceiver  rec, int  index )
 {
-    SmsFragment*  pnode = &rec->fragments;
-    SmsFragment   node;
+    SmsFragment  node = rec->by_index[ index & rec->mask ];
 
-    for (;;) {
-        node = *pnode;
-        if (node == NULL)
-            break;
+    for ( ; node != NULL; node = node->next_index ) {
         if (node->index == index)
             break;
-        pnode = &node->next;
     }
-    return  pnode;
+    return  node;
+}
+
+/* drop the oldest messages until the receiver is within its limits,
+ * except 'keep' which was just updated */
+static void
+sms_receiver_evict( SmsReceiver  rec, SmsFragment  keep )
+{
+    while (rec->oldest != NULL && rec->oldest != keep &&
+           ((rec->max_messages > 0 && rec->count > rec->max_messages) ||
+            (rec->max_bytes    > 0 && rec->bytes > rec->max_bytes)))
+    {
+        SmsFragment  frag = rec->oldest;
+
+        D( "%s: evicting SMS index %d with %d/%d fragments\n", __FUNCTION__,
+           frag->index, frag->count, frag->max );
+        sms_receiver_unlink( rec, frag );
+        sms_fragment_free( frag );
+        rec->evicted += 1;
+    }
+}
+
+void
+sms_receiver_set_limits( SmsReceiver  rec, int  timeout, int  max_messages, int  max_bytes )
+{
+    rec->timeout      = timeout;
+    rec->max_messages = max_messages;
+    rec->max_bytes    = max_bytes;
+    sms_receiver_evict( rec, NULL );
+}
+
+long long
+sms_receiver_expire( SmsReceiver  rec )
+{
+    long long  now = sys_time_ms();
+
+    if (rec->timeout <= 0)
+        return -1;
+
+    while (rec->oldest != NULL && rec->oldest->stamp + rec->timeout <= now) {
+        SmsFragment  frag = rec->oldest;
+
+        D( "%s: SMS index %d timed out with %d/%d fragments\n", __FUNCTION__,
+           frag->index, frag->count, frag->max );
+        sms_receiver_unlink( rec, frag );
+        sms_fragment_free( frag );
+        rec->expired += 1;
+    }
+    if (rec->oldest == NULL)
+        return -1;
+
+    return rec->oldest->stamp + rec->timeout;
+}
+
+void
+sms_receiver_get_stats( SmsReceiver  rec, SmsReceiverStats  stats )
+{
+    stats->messages = rec->count;
+    stats->bytes    = rec->bytes;
+    stats->expired  = rec->expired;
+    stats->evicted  = rec->evicted;
 }
 
 int
@@ -1481,7 +1797,6 @@ sms_receiver_add_submit_pdu( SmsReceiver  rec, SmsPDU       submit_pdu )
 {
     SmsAddressRec  from[1];
     int            ref, max, cur;
-    SmsFragment*   pnode;
     SmsFragment    frag;
 
     if ( smspdu_get_receiver_address( submit_pdu, from ) < 0 ) {
@@ -1495,17 +1810,27 @@ sms_receiver_add_submit_pdu( SmsReceiver  rec, SmsPDU       submit_pdu )
         return -1;
     }
     max = smspdu_get_max_index( submit_pdu );
-    if (max < 0) {
+    if (max < 1) {
         D( "%s: invalid max fragment value: %d should be >= 1\n",
            __FUNCTION__, max );
         return -1;
     }
-    pnode = sms_receiver_find_p( rec, from, ref );
-    frag  = *pnode;
+    cur = smspdu_get_cur_index( submit_pdu );
+    if (cur < 0) {
+        D("%s: SMS fragment index is too small: %d should be >= 1\n", __FUNCTION__, cur+1 );
+        return -1;
+    }
+    if (cur >= max) {
+        D("%s: SMS fragment index is too large (%d >= %d)\n", __FUNCTION__, cur, max);
+        return -1;
+    }
+
+    frag = sms_receiver_find( rec, from, ref );
     if (frag == NULL) {
         frag = sms_fragment_alloc( rec, from, ref, max );
-        if (frag == NULL) {
+        if (frag == NULL || sms_receiver_insert( rec, frag ) < 0) {
             D("%s: not enough memory to allocate new fragment\n", __FUNCTION__ );
+            free( frag );
             return -1;
         }
         if (D_ACTIVE) {
@@ -1520,26 +1845,27 @@ sms_receiver_add_submit_pdu( SmsReceiver  rec, SmsPDU       submit_pdu )
             D("%s: created SMS index %d, from %.*s, ref %d, max %d\n", __FUNCTION__,
                frag->index, len, tmp, frag->ref, frag->max);
         }
-        *pnode = frag;
     }
-
-    cur = smspdu_get_cur_index( submit_pdu );
-    if (cur < 0) {
-        D("%s: SMS fragment index is too small: %d should be >= 1\n", __FUNCTION__, cur+1 );
-        return -1;
-    }
-    if (cur >= max) {
-        D("%s: SMS fragment index is too large (%d >= %d)\n", __FUNCTION__, cur, max);
+    else if (cur >= frag->max) {
+        D("%s: SMS fragment index is too large (%d >= %d)\n", __FUNCTION__, cur, frag->max);
         return -1;
     }
+
     if ( frag->pdus[cur] != NULL ) {
         D("%s: receiving duplicate SMS fragment for %d/%d, ref=%d, discarding old one\n",
           __FUNCTION__, cur+1, max, ref);
+        frag->bytes -= frag->pdus[cur]->end - frag->pdus[cur]->base;
+        rec->bytes  -= frag->pdus[cur]->end - frag->pdus[cur]->base;
         smspdu_free( frag->pdus[cur] );
         frag->count -= 1;
     }
     frag->pdus[cur] = submit_pdu;
     frag->count    += 1;
+    frag->bytes    += submit_pdu->end - submit_pdu->base;
+    rec->bytes     += submit_pdu->end - submit_pdu->base;
+
+    sms_receiver_touch( rec, frag );
+    sms_receiver_evict( rec, frag );
 
     if (frag->count >= frag->max) {
         /* yes, we received all fragments for this SMS */
@@ -1555,11 +1881,145 @@ sms_receiver_add_submit_pdu( SmsReceiver  rec, SmsPDU       submit_pdu )
 }
 
 
+/* rebuild a PDU from its raw bytes, including the SC address */
+static SmsPDU
+smspdu_create_from_bytes( cbytes_t  data, int  len )
+{
+    SmsPDU    p;
+    cbytes_t  cur;
+
+    p = (SmsPDU) calloc( sizeof(*p), 1 );
+    if (!p)
+        return NULL;
+
+    p->base = (bytes_t) malloc( len > 0 ? len : 1 );
+    if (p->base == NULL) {
+        free(p);
+        return NULL;
+    }
+    memcpy( p->base, data, len );
+    p->end = p->base + len;
+
+    cur = p->base;
+    if ( sms_skip_sc_address( &cur, p->end ) < 0 ) {
+        free(p->base);
+        free(p);
+        return NULL;
+    }
+    p->tpdu = (bytes_t) cur;
+    return p;
+}
+
+unsigned
+sms_receiver_get_generation( SmsReceiver  rec )
+{
+    return rec->generation;
+}
+
+void
+sms_receiver_save( SmsReceiver  rec, SnapshotWriter  w )
+{
+    SmsFragment  frag;
+
+    snapshot_put_int ( w, rec->last );
+    snapshot_put_uint( w, rec->count );
+
+    /* oldest first, so that loading restores the order */
+    for (frag = rec->oldest; frag != NULL; frag = frag->newer) {
+        int  nn;
+
+        snapshot_put_uint ( w, frag->from->len );
+        snapshot_put_uint ( w, frag->from->toa );
+        snapshot_put_bytes( w, frag->from->data, sizeof(frag->from->data) );
+        snapshot_put_uint ( w, frag->ref );
+        snapshot_put_uint ( w, frag->max );
+        snapshot_put_int  ( w, frag->index );
+
+        /* one length-prefixed PDU per slot, empty for missing fragments */
+        for (nn = 0; nn < frag->max; nn++) {
+            SmsPDU  pdu = frag->pdus[nn];
+
+            if (pdu == NULL)
+                snapshot_put_bytes( w, NULL, 0 );
+            else
+                snapshot_put_bytes( w, pdu->base, pdu->end - pdu->base );
+        }
+    }
+}
+
+SmsReceiver
+sms_receiver_load( SnapshotReader  r )
+{
+    SmsReceiver   rec = sms_receiver_create();
+    unsigned      count, nn;
+    int           last;
+
+    if (rec == NULL)
+        return NULL;
+
+    last  = snapshot_get_int( r );
+    count = snapshot_get_uint( r );
+
+    for (nn = 0; nn < count && !r->error; nn++) {
+        SmsAddressRec  from[1];
+        const void*    data;
+        int            len, ref, max, index, mm;
+        SmsFragment    frag;
+
+        from->len = snapshot_get_uint( r );
+        from->toa = snapshot_get_uint( r );
+        data      = snapshot_get_bytes( r, &len );
+        ref       = snapshot_get_uint( r );
+        max       = snapshot_get_uint( r );
+        index     = snapshot_get_int( r );
+
+        if (r->error || len != sizeof(from->data) || ref > 0xffff || max < 1 || max > 255)
+            goto Fail;
+        memcpy( from->data, data, len );
+
+        frag = sms_fragment_alloc( rec, from, ref, max );
+        if (frag == NULL)
+            goto Fail;
+        frag->index = index;
+        if (sms_receiver_insert( rec, frag ) < 0) {
+            free( frag );
+            goto Fail;
+        }
+        /* the timeout starts over */
+        sms_receiver_touch( rec, frag );
+
+        for (mm = 0; mm < max; mm++) {
+            data = snapshot_get_bytes( r, &len );
+            if (r->error)
+                goto Fail;
+            if (len == 0)
+                continue;
+
+            frag->pdus[mm] = smspdu_create_from_bytes( (cbytes_t)data, len );
+            if (frag->pdus[mm] == NULL)
+                goto Fail;
+            frag->count += 1;
+            frag->bytes += len;
+            rec->bytes  += len;
+        }
+    }
+    if (r->error)
+        goto Fail;
+
+    /* sms_fragment_alloc() bumped the counter, restore it */
+    rec->last = last;
+    return rec;
+
+Fail:
+    sms_receiver_destroy( rec );
+    return NULL;
+}
+
+
 int
 sms_receiver_get_text_message( SmsReceiver  rec, int  index, bytes_t  utf8, int  utf8len )
 {
-    SmsFragment*  pnode = sms_receiver_find_index_p( rec, index );
-    SmsFragment   frag  = *pnode;
+    SmsFragment   frag = sms_receiver_find_index( rec, index );
     int           nn, total;
 
     if (frag == NULL) {
@@ -1591,10 +2051,9 @@ sms_receiver_get_text_message( SmsReceiver  rec, int  index, bytes_t  utf8, int
 static void
 sms_receiver_remove( SmsReceiver  rec, int  index )
 {
-    SmsFragment*  pnode = sms_receiver_find_index_p( rec, index );
-    SmsFragment   frag  = *pnode;
+    SmsFragment  frag = sms_receiver_find_index( rec, index );
     if (frag != NULL) {
-        *pnode = frag->next;
+        sms_receiver_unlink( rec, frag );
         sms_fragment_free(frag);
     }
 }
@@ -1604,8 +2063,7 @@ SmsPDU*
 sms_receiver_create_deliver( SmsReceiver  rec, int  index, const SmsAddressRec*  from )
 {
     SmsPDU*          result = NULL;
-    SmsFragment*     pnode = sms_receiver_find_index_p( rec, index );
-    SmsFragment      frag  = *pnode;
+    SmsFragment      frag   = sms_receiver_find_index( rec, index );
     SmsTimeStampRec  now[1];
     int              nn, total;
     bytes_t          utf8;
@@ -13,6 +13,7 @@
 #define _android_sms_h
 
 #include <time.h>
+#include "snapshot.h"
 
 /** MESSAGE TEXT
  **/
@@ -93,6 +94,7 @@ extern int  smspdu_get_sc_timestamp( SmsPDU  pdu, SmsTimeStamp  timestamp );
 /* retrieve the receiver address of a SMS-SUBMIT pdu, return -1 otherwise */
 extern int  smspdu_get_receiver_address( SmsPDU  pdu, SmsAddress  address );
 
+/* concatenation reference, 8 or 16 bits, and parts of a multipart message */
 extern int  smspdu_get_ref      ( SmsPDU  pdu );
 extern int  smspdu_get_max_index( SmsPDU  pdu );
 extern int  smspdu_get_cur_index( SmsPDU  pdu );
@@ -114,4 +116,35 @@ extern int           sms_receiver_add_submit_pdu( SmsReceiver  rec, SmsPDU
 extern int           sms_receiver_get_text_message( SmsReceiver  rec, int  index, unsigned char*  utf8, int  utf8len );
 extern SmsPDU*       sms_receiver_create_deliver( SmsReceiver  rec, int  index, const SmsAddressRec*  from );
 
+/* a message that is still missing fragments is dropped when none arrived
+ * for 'timeout' ms, and the least recently updated ones are evicted when
+ * more than 'max_messages' are pending, or when their PDUs take more than
+ * 'max_bytes'. 0 disables a limit */
+#define  SMS_RECEIVER_TIMEOUT         300000
+#define  SMS_RECEIVER_MAX_MESSAGES    256
+#define  SMS_RECEIVER_MAX_BYTES       (1024*1024)
+
+extern void          sms_receiver_set_limits( SmsReceiver  rec, int  timeout, int  max_messages, int  max_bytes );
+
+/* drop the messages that timed out, and return the time in ms (as given by
+ * sys_time_ms()) at which the next one will, or -1 if none is pending */
+extern long long     sms_receiver_expire( SmsReceiver  rec );
+
+typedef struct {
+    int       messages;   /* pending messages */
+    int       bytes;      /* size of their PDUs */
+    unsigned  expired;    /* messages dropped by sms_receiver_expire() */
+    unsigned  evicted;    /* messages dropped to stay within the limits */
+} SmsReceiverStatsRec, *SmsReceiverStats;
+
+extern void          sms_receiver_get_stats( SmsReceiver  rec, SmsReceiverStats  stats );
+
+/* save the partially reassembled messages to a snapshot, and create a new
+ * receiver from it. sms_receiver_load() returns NULL if the data is malformed */
+extern void          sms_receiver_save( SmsReceiver  rec, SnapshotWriter  w );
+extern SmsReceiver   sms_receiver_load( SnapshotReader  r );
+
+/* returns a counter that changes whenever the saved content changes */
+extern unsigned      sms_receiver_get_generation( SmsReceiver  rec );
+
 #endif /* _android_sms_h */
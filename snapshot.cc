@@ -0,0 +1,325 @@
+/* Copyright (C) 2007-2008 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#include "snapshot.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+/** WRITER
+ **/
+void
+snapshot_writer_init( SnapshotWriter  w )
+{
+    w->data  = NULL;
+    w->size  = 0;
+    w->max   = 0;
+    w->error = 0;
+}
+
+void
+snapshot_writer_done( SnapshotWriter  w )
+{
+    free( w->data );
+    snapshot_writer_init( w );
+}
+
+static unsigned char*
+snapshot_reserve( SnapshotWriter  w, int  len )
+{
+    unsigned char*  p;
+
+    if (w->error)
+        return NULL;
+
+    if (w->size + len > w->max) {
+        int             new_max = w->max + (w->max >> 1) + 256;
+        unsigned char*  new_data;
+
+        if (new_max < w->size + len)
+            new_max = w->size + len;
+
+        new_data = (unsigned char*) realloc( w->data, new_max );
+        if (new_data == NULL) {
+            w->error = 1;
+            return NULL;
+        }
+        w->data = new_data;
+        w->max  = new_max;
+    }
+    p        = w->data + w->size;
+    w->size += len;
+    return p;
+}
+
+void
+snapshot_put_raw( SnapshotWriter  w, const void*  data, int  len )
+{
+    unsigned char*  p = snapshot_reserve( w, len );
+
+    if (p != NULL && len > 0)
+        memcpy( p, data, len );
+}
+
+void
+snapshot_put_uint( SnapshotWriter  w, unsigned  value )
+{
+    unsigned char  temp[5];
+    int            len = 0;
+
+    do {
+        unsigned char  c = value & 0x7f;
+
+        value >>= 7;
+        temp[len++] = c | (value ? 0x80 : 0);
+    } while (value != 0);
+
+    snapshot_put_raw( w, temp, len );
+}
+
+void
+snapshot_put_int( SnapshotWriter  w, int  value )
+{
+    snapshot_put_uint( w, ((unsigned)value << 1) ^ (unsigned)(value >> 31) );
+}
+
+void
+snapshot_put_bytes( SnapshotWriter  w, const void*  data, int  len )
+{
+    snapshot_put_uint( w, len );
+    snapshot_put_raw( w, data, len );
+}
+
+void
+snapshot_put_str( SnapshotWriter  w, const char*  str )
+{
+    if (str == NULL)
+        str = "";
+    snapshot_put_bytes( w, str, strlen(str) );
+}
+
+int
+snapshot_begin_section( SnapshotWriter  w, int  tag )
+{
+    unsigned char  header[5] = { (unsigned char)tag, 0, 0, 0, 0 };
+
+    snapshot_put_raw( w, header, sizeof(header) );
+    return w->size;
+}
+
+void
+snapshot_end_section( SnapshotWriter  w, int  offset )
+{
+    unsigned        len = w->size - offset;
+    unsigned char*  p;
+
+    if (w->error)
+        return;
+
+    p    = w->data + offset - 4;
+    p[0] = (unsigned char)(len);
+    p[1] = (unsigned char)(len >> 8);
+    p[2] = (unsigned char)(len >> 16);
+    p[3] = (unsigned char)(len >> 24);
+}
+
+int
+snapshot_write_file( SnapshotWriter  w, const char*  path )
+{
+    char  temp[ 1024 ];
+    int   fd, len, ret;
+
+    if (w->error)
+        return -1;
+
+    len = snprintf( temp, sizeof(temp), "%s.tmp", path );
+    if (len < 0 || len >= (int)sizeof(temp))
+        return -1;
+
+    fd = open( temp, O_CREAT | O_TRUNC | O_WRONLY, 0644 );
+    if (fd < 0)
+        return -1;
+
+    for (len = 0; len < w->size; len += ret) {
+        ret = write( fd, w->data + len, w->size - len );
+        if (ret < 0 && errno == EINTR) {
+            ret = 0;
+            continue;
+        }
+        if (ret <= 0)
+            goto Fail;
+    }
+
+    /* the content must be on disk before the rename makes it visible */
+    if (fsync( fd ) < 0)
+        goto Fail;
+
+    close( fd );
+    if (rename( temp, path ) < 0) {
+        unlink( temp );
+        return -1;
+    }
+    return 0;
+
+Fail:
+    close( fd );
+    unlink( temp );
+    return -1;
+}
+
+/** READER
+ **/
+void
+snapshot_reader_init( SnapshotReader  r, const void*  data, int  size )
+{
+    r->data  = (const unsigned char*) data;
+    r->end   = r->data + size;
+    r->error = 0;
+}
+
+unsigned
+snapshot_get_uint( SnapshotReader  r )
+{
+    unsigned  value = 0;
+    int       shift = 0;
+
+    while (r->data < r->end && shift < 35) {
+        unsigned char  c = *r->data++;
+
+        value |= (unsigned)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return value;
+        shift += 7;
+    }
+    r->error = 1;
+    return 0;
+}
+
+int
+snapshot_get_int( SnapshotReader  r )
+{
+    unsigned  value = snapshot_get_uint( r );
+
+    return (int)(value >> 1) ^ -(int)(value & 1);
+}
+
+const void*
+snapshot_get_raw( SnapshotReader  r, int  len )
+{
+    const unsigned char*  p = r->data;
+
+    if (len < 0 || len > r->end - r->data) {
+        r->error = 1;
+        r->data  = r->end;
+        return NULL;
+    }
+    r->data += len;
+    return p;
+}
+
+const void*
+snapshot_get_bytes( SnapshotReader  r, int*  plen )
+{
+    unsigned     len = snapshot_get_uint( r );
+    const void*  p;
+
+    if (r->error || len > (unsigned)(r->end - r->data)) {
+        r->error = 1;
+        *plen    = 0;
+        return NULL;
+    }
+    p     = snapshot_get_raw( r, (int)len );
+    *plen = (int)len;
+    return p;
+}
+
+void
+snapshot_get_str( SnapshotReader  r, char*  buf, int  bufsize )
+{
+    int          len;
+    const char*  p = (const char*) snapshot_get_bytes( r, &len );
+
+    if (p == NULL)
+        len = 0;
+    if (len > bufsize-1)
+        len = bufsize-1;
+
+    memcpy( buf, p ? p : "", len );
+    buf[len] = 0;
+}
+
+int
+snapshot_next_section( SnapshotReader  r, SnapshotReader  section )
+{
+    const unsigned char*  header;
+    const unsigned char*  data;
+    unsigned              len;
+
+    if (r->data >= r->end)
+        return -1;
+
+    header = (const unsigned char*) snapshot_get_raw( r, 5 );
+    if (header == NULL)
+        return -1;
+
+    len  = header[1] | (header[2] << 8) | (header[3] << 16) | ((unsigned)header[4] << 24);
+    data = (const unsigned char*) snapshot_get_raw( r, (int)len );
+    if (data == NULL || (int)len < 0)
+        return -1;
+
+    snapshot_reader_init( section, data, len );
+    return header[0];
+}
+
+void*
+snapshot_read_file( const char*  path, int*  psize )
+{
+    struct stat  st;
+    char*        data;
+    int          fd, len, ret;
+
+    fd = open( path, O_RDONLY );
+    if (fd < 0)
+        return NULL;
+
+    if (fstat( fd, &st ) < 0 || st.st_size > (1 << 24)) {
+        close( fd );
+        return NULL;
+    }
+
+    data = (char*) malloc( st.st_size + 1 );
+    if (data == NULL) {
+        close( fd );
+        return NULL;
+    }
+
+    for (len = 0; len < st.st_size; len += ret) {
+        ret = read( fd, data + len, st.st_size - len );
+        if (ret < 0 && errno == EINTR) {
+            ret = 0;
+            continue;
+        }
+        if (ret <= 0)
+            break;
+    }
+    close( fd );
+
+    if (len != st.st_size) {
+        free( data );
+        return NULL;
+    }
+    *psize = len;
+    return data;
+}
@@ -0,0 +1,78 @@
+/* Copyright (C) 2007-2008 The Android Open Source Project
+**
+** This software is licensed under the terms of the GNU General Public
+** License version 2, as published by the Free Software Foundation, and
+** may be copied, distributed, and modified under those terms.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+*/
+#ifndef _android_snapshot_h
+#define _android_snapshot_h
+
+/** SNAPSHOT ENCODING
+ **
+ ** snapshots are compact binary images of the emulated state. integers are
+ ** stored as variable-length (LEB128) values, signed ones zigzag-encoded,
+ ** and strings or byte arrays are prefixed by their length. each module
+ ** writes its state into a section, a tag followed by a fixed 4-byte
+ ** length, so that readers can skip sections they don't know and ignore
+ ** fields appended by newer versions.
+ **/
+
+typedef struct {
+    unsigned char*  data;
+    int             size;
+    int             max;
+    int             error;   /* set if an allocation failed */
+} SnapshotWriterRec, *SnapshotWriter;
+
+extern void  snapshot_writer_init( SnapshotWriter  w );
+extern void  snapshot_writer_done( SnapshotWriter  w );
+
+extern void  snapshot_put_raw  ( SnapshotWriter  w, const void*  data, int  len );
+extern void  snapshot_put_uint ( SnapshotWriter  w, unsigned  value );
+extern void  snapshot_put_int  ( SnapshotWriter  w, int  value );
+extern void  snapshot_put_bytes( SnapshotWriter  w, const void*  data, int  len );
+extern void  snapshot_put_str  ( SnapshotWriter  w, const char*  str );
+
+/* sections, begin returns the offset to give to end */
+extern int   snapshot_begin_section( SnapshotWriter  w, int  tag );
+extern void  snapshot_end_section( SnapshotWriter  w, int  offset );
+
+/* write the snapshot to 'path' atomically, through a temporary file that is
+ * renamed over it. returns 0 on success, -1 on error */
+extern int   snapshot_write_file( SnapshotWriter  w, const char*  path );
+
+
+typedef struct {
+    const unsigned char*  data;
+    const unsigned char*  end;
+    int                   error;   /* set if the data is truncated or malformed */
+} SnapshotReaderRec, *SnapshotReader;
+
+extern void         snapshot_reader_init( SnapshotReader  r, const void*  data, int  size );
+
+/* these return 0 and set r->error when the data is exhausted */
+extern unsigned     snapshot_get_uint( SnapshotReader  r );
+extern int          snapshot_get_int ( SnapshotReader  r );
+
+/* returns a pointer to the next 'len' bytes, or NULL */
+extern const void*  snapshot_get_raw( SnapshotReader  r, int  len );
+
+/* returns the bytes of a length-prefixed value, and its length in *plen */
+extern const void*  snapshot_get_bytes( SnapshotReader  r, int*  plen );
+
+/* copy a string into 'buf', truncating it to 'bufsize'-1 characters */
+extern void         snapshot_get_str( SnapshotReader  r, char*  buf, int  bufsize );
+
+/* read the next section header, returns its tag and sets 'section' to a
+ * reader limited to its content, or returns -1 at the end of the data */
+extern int          snapshot_next_section( SnapshotReader  r, SnapshotReader  section );
+
+/* read a whole file into a malloc()-ed buffer, returns NULL on error */
+extern void*        snapshot_read_file( const char*  path, int*  psize );
+
+#endif /* _android_snapshot_h */
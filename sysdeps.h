@@ -44,6 +44,11 @@ extern SysChannel  sys_channel_create_tcp_handler( SysChannel  server_channel );
 extern SysChannel  sys_channel_create_tcp_client( const char*  hostname, int  port );
 extern int         sys_channel_set_non_block( SysChannel  channel );
 
+/* watch an already opened file descriptor (e.g. a netlink socket), the
+ * channel owns it and closes it in sys_channel_close(). returns NULL if
+ * it can't be watched, the descriptor is then left open */
+extern SysChannel  sys_channel_create_fd( int  fd );
+
 extern  void   sys_channel_on( SysChannel          channel,
                                int                 event_flags,
                                SysChannelCallback  event_callback,
@@ -71,6 +76,21 @@ extern void       sys_timer_set( SysTimer  timer, SysTime  when, SysCallback   c
 extern void       sys_timer_unset( SysTimer  timer );
 extern void       sys_timer_destroy( SysTimer  timer );
 
+/** child processes
+ **/
+typedef struct SysProcessRec_*  SysProcess;
+
+/* 'status' is the one returned by waitpid(), or -1 if it can't be known */
+typedef void  (*SysProcessCallback)( void*  opaque, int  status );
+
+/* start 'argv[0]', searched in the PATH, without waiting for it. 'callback'
+ * is called from the main loop once it exits, the process is then freed.
+ * returns NULL and sets errno if it can't be started */
+extern SysProcess  sys_process_spawn( char* const  argv[], SysProcessCallback  callback, void*  opaque );
+
+/* don't call the callback of a running process, it is still reaped */
+extern void        sys_process_detach( SysProcess  process );
+
 extern int channel_get_fd(SysChannel s);
 extern long long  sys_time_ms( void );
 
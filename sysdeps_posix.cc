@@ -25,11 +25,19 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+
+extern char**  environ;
 #endif
 
 /**  QUEUE
  **/
-#define  SYS_MAX_QUEUE  16
+/* a queue holds every channel or timer that became ready in one loop
+ * iteration, so it must be as large as the biggest of the two pools */
+#define  SYS_MAX_QUEUE  1024
 
 typedef struct {
     int    start;
@@ -102,7 +110,7 @@ int channel_get_fd(SysChannel s) {
 
 /*** channel allocation ***/
 #define  SYS_EVENT_MAX     50
-#define  SYS_MAX_CHANNELS  500
+#define  SYS_MAX_CHANNELS  1000   /* select() can't watch more than FD_SETSIZE fds anyway */
 
 static SysChannelRec  _s_channels0[ SYS_MAX_CHANNELS ];
 static SysChannel     _s_free_channels;
@@ -138,8 +146,9 @@ sys_channel_free( SysChannel  channel )
 }
 
 
-/* list of active channels */
+/* list of active channels, and the same indexed by file descriptor */
 static SysChannel     _s_channels;
+static SysChannel     _s_fd_channels[ FD_SETSIZE ];
 
 /* used by select to wait on channel events */
 static fd_set         _s_fdsets[SYS_EVENT_MAX];
@@ -160,22 +169,25 @@ sys_channel_deactivate( SysChannel  channel )
     *pnode          = channel->next;
     channel->next   = NULL;
     channel->active = 0;
+    _s_fd_channels[ channel->fd ] = NULL;
 }
 
 static void
 sys_channel_activate( SysChannel  channel )
 {
     assert( channel->active == 0 );
+    assert( channel->fd < FD_SETSIZE && "file descriptor too large for select()" );
     channel->next = _s_channels;
     _s_channels   = channel;
     channel->active = 1;
+    _s_fd_channels[ channel->fd ] = channel;
     if (channel->fd > _s_maxfd)
         _s_maxfd = channel->fd;
 }
 
 
 /* queue of pending channels */
-static SysQueueRec    _s_pending_channels[16];
+static SysQueueRec    _s_pending_channels[1];
 
 
 static void
@@ -249,6 +261,8 @@ sys_channel_read( SysChannel  channel, void*  buffer, int  size )
                 count = -1;
             break;
         }
+        if (len == 0)  /* end of stream, don't spin on it */
+            break;
         buff  += len;
         size  -= len;
         count += len;
@@ -322,7 +336,7 @@ typedef struct SysTimerRec_
     void*        opaque;
 } SysTimerRec;
 
-#define  SYS_MAX_TIMERS  16
+#define  SYS_MAX_TIMERS  1024
 
 static SysTimerRec   _s_timers0[ SYS_MAX_TIMERS ];
 static SysTimer      _s_free_timers;
@@ -467,18 +481,13 @@ sys_single_loop( void )
             if(FD_ISSET(i, &efd)) events |= SYS_EVENT_ERROR;
 
             if (events) {
-                SysChannel  channel;
+                SysChannel  channel = _s_fd_channels[i];
 
                 n--;
-                for (channel = _s_channels; channel; channel = channel->next)
-                {
-                    if (channel->fd != i)
-                        continue;
-
+                if (channel != NULL) {
                     channel->ready   = events;
                     channel->pending = 1;
                     sys_queue_add( _s_pending_channels, channel );
-                    break;
                 }
             }
         }
@@ -501,6 +510,145 @@ sys_single_loop( void )
     }
 }
 
+/** child processes
+ **
+ ** the SIGCHLD handler writes to a pipe watched by the main loop, which
+ ** then reaps the processes it started. other children are left alone.
+ **/
+typedef struct SysProcessRec_
+{
+    SysProcess          next;
+    pid_t               pid;
+    SysProcessCallback  callback;
+    void*               opaque;
+} SysProcessRec;
+
+static SysProcess   _s_processes;
+static int          _s_sigchld_fds[2] = { -1, -1 };
+static SysChannel   _s_sigchld_channel;
+
+static void
+sys_sigchld_handler( int  sig )
+{
+    int   saved_errno = errno;
+    char  c = 0;
+
+    sig = sig;
+    if (write( _s_sigchld_fds[1], &c, 1 ) < 0) {
+        /* the pipe is full, a wakeup is already pending */
+    }
+    errno = saved_errno;
+}
+
+static void
+sys_process_reap( void )
+{
+    SysProcess  *pnode = &_s_processes;
+    SysProcess   process;
+
+    while ((process = *pnode) != NULL) {
+        int    status;
+        pid_t  ret = waitpid( process->pid, &status, WNOHANG );
+
+        if (ret == 0 || (ret < 0 && errno == EINTR)) {
+            pnode = &process->next;
+            continue;
+        }
+        if (ret < 0)
+            status = -1;
+
+        /* unlink first, the callback may start another process */
+        *pnode = process->next;
+        if (process->callback != NULL)
+            process->callback( process->opaque, status );
+        free( process );
+    }
+}
+
+static void
+sys_sigchld_event( void*  opaque, int  events )
+{
+    char  buff[64];
+
+    opaque = opaque;
+    events = events;
+
+    while (read( _s_sigchld_fds[0], buff, sizeof(buff) ) > 0)
+        ;
+    sys_process_reap();
+}
+
+static int
+sys_init_processes( void )
+{
+    struct sigaction  sa;
+    int               nn;
+
+    if (_s_sigchld_channel != NULL)
+        return 0;
+
+    if (pipe( _s_sigchld_fds ) < 0)
+        return -1;
+
+    for (nn = 0; nn < 2; nn++) {
+        fcntl( _s_sigchld_fds[nn], F_SETFL, fcntl( _s_sigchld_fds[nn], F_GETFL ) | O_NONBLOCK );
+        fcntl( _s_sigchld_fds[nn], F_SETFD, FD_CLOEXEC );
+    }
+
+    _s_sigchld_channel = sys_channel_create_fd( _s_sigchld_fds[0] );
+    if (_s_sigchld_channel == NULL) {
+        close( _s_sigchld_fds[0] );
+        close( _s_sigchld_fds[1] );
+        _s_sigchld_fds[0] = _s_sigchld_fds[1] = -1;
+        return -1;
+    }
+    sys_channel_on( _s_sigchld_channel, SYS_EVENT_READ, sys_sigchld_event, NULL );
+
+    memset( &sa, 0, sizeof(sa) );
+    sa.sa_handler = sys_sigchld_handler;
+    sa.sa_flags   = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset( &sa.sa_mask );
+    sigaction( SIGCHLD, &sa, NULL );
+    return 0;
+}
+
+SysProcess
+sys_process_spawn( char* const  argv[], SysProcessCallback  callback, void*  opaque )
+{
+    SysProcess  process;
+    int         ret;
+
+    if (sys_init_processes() < 0)
+        return NULL;
+
+    process = (SysProcess) calloc( 1, sizeof(*process) );
+    if (process == NULL)
+        return NULL;
+
+    /* posix_spawnp() returns its error instead of setting errno */
+    ret = posix_spawnp( &process->pid, argv[0], NULL, NULL, argv, environ );
+    if (ret != 0) {
+        free( process );
+        errno = ret;
+        return NULL;
+    }
+
+    /* if it already exited, the pipe wakes up the loop anyway */
+    process->callback = callback;
+    process->opaque   = opaque;
+    process->next     = _s_processes;
+    _s_processes      = process;
+    return process;
+}
+
+void
+sys_process_detach( SysProcess  process )
+{
+    process->callback = NULL;
+    process->opaque   = NULL;
+}
+
+
 void  sys_main_init( void )
 {
     sys_init_channels();
@@ -601,6 +749,13 @@ sys_channel_create_tcp_handler( SysChannel  server_channel )
         return NULL;
     }
 
+    /* select() can't watch it, drop the connection rather than abort */
+    if (channel->fd >= FD_SETSIZE) {
+        fprintf( stderr, "accept: file descriptor %d too large for select()\n", channel->fd );
+        sys_channel_free( channel );
+        return NULL;
+    }
+
     /* set to non-blocking and disable TCP Nagle algorithm */
     fcntl(channel->fd, F_SETFL, O_NONBLOCK);
     setsockopt(channel->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
@@ -608,6 +763,21 @@ sys_channel_create_tcp_handler( SysChannel  server_channel )
 }
 
 
+SysChannel
+sys_channel_create_fd( int  fd )
+{
+    SysChannel  channel;
+
+    if (fd < 0 || fd >= FD_SETSIZE)
+        return NULL;
+
+    channel     = sys_channel_alloc();
+    channel->fd = fd;
+    fcntl(channel->fd, F_SETFL, fcntl(channel->fd, F_GETFL) | O_NONBLOCK);
+    return channel;
+}
+
+
 SysChannel
 sys_channel_create_tcp_client( const char*  hostname, int  port )
 {